@@ -0,0 +1,374 @@
+#include "AdjointMatrix.h"
+
+#include "matlib.h"
+
+using namespace std;
+
+AdjointMatrix Tape::variable(const Matrix& value) {
+    return record(value, [](const Matrix&) {});
+}
+
+AdjointMatrix Tape::record(const Matrix& value,
+        function<void(const Matrix& adjoint)> backward) {
+    Entry entry;
+    entry.value = value;
+    entry.hasAdjoint = false;
+    entry.backward = backward;
+    entries.push_back(entry);
+    return AdjointMatrix(*this, entries.size() - 1);
+}
+
+Matrix Tape::adjoint(int index) const {
+    const Entry& entry = entries[index];
+    if (!entry.hasAdjoint) {
+        return Matrix(entry.value.nRows(), entry.value.nCols());
+    }
+    return entry.adjoint;
+}
+
+void Tape::addAdjoint(int index, const Matrix& contribution) {
+    Entry& entry = entries[index];
+    if (entry.hasAdjoint) {
+        entry.adjoint += contribution;
+    } else {
+        entry.adjoint = contribution;
+        entry.hasAdjoint = true;
+    }
+}
+
+void Tape::reverse(const AdjointMatrix& result) {
+    ASSERT(&result.getTape() == this);
+    for (auto& entry : entries) {
+        entry.hasAdjoint = false;
+    }
+    addAdjoint(result.getIndex(), ones(result.nRows(), result.nCols()));
+    for (int i = result.getIndex(); i >= 0; i--) {
+        // entries nothing depends upon contribute nothing
+        if (entries[i].hasAdjoint) {
+            entries[i].backward(entries[i].adjoint);
+        }
+    }
+}
+
+AdjointMatrix operator+(const AdjointMatrix& x, const AdjointMatrix& y) {
+    Tape& tape = x.getTape();
+    int i = x.getIndex();
+    int j = y.getIndex();
+    return tape.record(x.value() + y.value(),
+        [&tape, i, j](const Matrix& adjoint) {
+            tape.addAdjoint(i, adjoint);
+            tape.addAdjoint(j, adjoint);
+        });
+}
+
+AdjointMatrix operator-(const AdjointMatrix& x, const AdjointMatrix& y) {
+    Tape& tape = x.getTape();
+    int i = x.getIndex();
+    int j = y.getIndex();
+    return tape.record(x.value() - y.value(),
+        [&tape, i, j](const Matrix& adjoint) {
+            tape.addAdjoint(i, adjoint);
+            tape.addAdjoint(j, -1.0*adjoint);
+        });
+}
+
+AdjointMatrix operator+(const AdjointMatrix& m, double scalar) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    return tape.record(m.value() + scalar,
+        [&tape, i](const Matrix& adjoint) {
+            tape.addAdjoint(i, adjoint);
+        });
+}
+
+AdjointMatrix operator-(const AdjointMatrix& m, double scalar) {
+    return m + (-scalar);
+}
+
+AdjointMatrix operator-(double scalar, const AdjointMatrix& m) {
+    return (-1.0*m) + scalar;
+}
+
+AdjointMatrix operator*(double scalar, const AdjointMatrix& m) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    return tape.record(scalar*m.value(),
+        [&tape, i, scalar](const Matrix& adjoint) {
+            tape.addAdjoint(i, scalar*adjoint);
+        });
+}
+
+AdjointMatrix dotTimes(const AdjointMatrix& x, const AdjointMatrix& y) {
+    Tape& tape = x.getTape();
+    int i = x.getIndex();
+    int j = y.getIndex();
+    Matrix value = x.value();
+    value.times(y.value());
+    return tape.record(value,
+        [&tape, i, j](const Matrix& adjoint) {
+            Matrix dx = adjoint;
+            dx.times(tape.value(j));
+            Matrix dy = adjoint;
+            dy.times(tape.value(i));
+            tape.addAdjoint(i, dx);
+            tape.addAdjoint(j, dy);
+        });
+}
+
+AdjointMatrix dotTimes(const AdjointMatrix& x, const Matrix& y) {
+    Tape& tape = x.getTape();
+    int i = x.getIndex();
+    Matrix value = x.value();
+    value.times(y);
+    return tape.record(value,
+        [&tape, i, y](const Matrix& adjoint) {
+            Matrix dx = adjoint;
+            dx.times(y);
+            tape.addAdjoint(i, dx);
+        });
+}
+
+AdjointMatrix operator*(const AdjointMatrix& a, const AdjointMatrix& b) {
+    Tape& tape = a.getTape();
+    int i = a.getIndex();
+    int j = b.getIndex();
+    return tape.record(a.value()*b.value(),
+        [&tape, i, j](const Matrix& adjoint) {
+            tape.addAdjoint(i, adjoint*transpose(tape.value(j)));
+            tape.addAdjoint(j, transpose(tape.value(i))*adjoint);
+        });
+}
+
+AdjointMatrix operator*(const Matrix& a, const AdjointMatrix& b) {
+    Tape& tape = b.getTape();
+    int j = b.getIndex();
+    // store the transpose as only it is needed
+    Matrix aTranspose = transpose(a);
+    return tape.record(a*b.value(),
+        [&tape, j, aTranspose](const Matrix& adjoint) {
+            tape.addAdjoint(j, aTranspose*adjoint);
+        });
+}
+
+AdjointMatrix exp(const AdjointMatrix& m) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    int result = tape.size();
+    return tape.record(exp(m.value()),
+        [&tape, i, result](const Matrix& adjoint) {
+            Matrix d = adjoint;
+            d.times(tape.value(result));
+            tape.addAdjoint(i, d);
+        });
+}
+
+AdjointMatrix log(const AdjointMatrix& m) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    Matrix value = m.value();
+    value.log();
+    return tape.record(value,
+        [&tape, i](const Matrix& adjoint) {
+            Matrix d = adjoint;
+            const Matrix& x = tape.value(i);
+            for (int k = 0; k < d.nRows()*d.nCols(); k++) {
+                d(k) /= x(k);
+            }
+            tape.addAdjoint(i, d);
+        });
+}
+
+AdjointMatrix positivePart(const AdjointMatrix& m) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    Matrix value = m.value();
+    value.positivePart();
+    return tape.record(value,
+        [&tape, i](const Matrix& adjoint) {
+            Matrix d = adjoint;
+            const Matrix& x = tape.value(i);
+            for (int k = 0; k < d.nRows()*d.nCols(); k++) {
+                if (x(k) <= 0.0) {
+                    d(k) = 0.0;
+                }
+            }
+            tape.addAdjoint(i, d);
+        });
+}
+
+AdjointMatrix transpose(const AdjointMatrix& m) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    return tape.record(transpose(m.value()),
+        [&tape, i](const Matrix& adjoint) {
+            tape.addAdjoint(i, transpose(adjoint));
+        });
+}
+
+AdjointMatrix col(const AdjointMatrix& m, int col) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    return tape.record(m.value().col(col),
+        [&tape, i, col](const Matrix& adjoint) {
+            const Matrix& x = tape.value(i);
+            Matrix d(x.nRows(), x.nCols());
+            d.setCol(col, adjoint, 0);
+            tape.addAdjoint(i, d);
+        });
+}
+
+AdjointMatrix diagonal(const AdjointMatrix& m) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    int n = m.nRows();
+    ASSERT(m.nCols() == n);
+    Matrix value(1, n, false);
+    for (int k = 0; k < n; k++) {
+        value(0, k) = m.value()(k, k);
+    }
+    return tape.record(value,
+        [&tape, i, n](const Matrix& adjoint) {
+            Matrix d(n, n);
+            for (int k = 0; k < n; k++) {
+                d(k, k) = adjoint(0, k);
+            }
+            tape.addAdjoint(i, d);
+        });
+}
+
+AdjointMatrix sumCols(const AdjointMatrix& m) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    int nRows = m.nRows();
+    return tape.record(sumCols(m.value()),
+        [&tape, i, nRows](const Matrix& adjoint) {
+            tape.addAdjoint(i, ones(nRows, 1)*adjoint);
+        });
+}
+
+/*  The inverse of a lower triangular matrix */
+static Matrix lowerInverse(const Matrix& L) {
+    int n = L.nRows();
+    Matrix ret(n, n);
+    for (int c = 0; c < n; c++) {
+        for (int j = c; j < n; j++) {
+            double s = j == c ? 1.0 : 0.0;
+            for (int k = c; k < j; k++) {
+                s -= L(j, k)*ret(k, c);
+            }
+            ret(j, c) = s / L(j, j);
+        }
+    }
+    return ret;
+}
+
+/**
+ *  If A = L L' then L^{-1} dA L^{-T} = L^{-1} dL + (L^{-1} dL)'
+ *  and L^{-1} dL is lower triangular, so it is the lower triangle
+ *  of the left hand side with the diagonal halved. Transposing
+ *  this gives the adjoint of A as L^{-T} P L^{-1} where P is the
+ *  lower triangle of L' times the adjoint of L with its diagonal
+ *  halved. We symmetrise it since A is symmetric.
+ */
+AdjointMatrix chol(const AdjointMatrix& m) {
+    Tape& tape = m.getTape();
+    int i = m.getIndex();
+    int result = tape.size();
+    return tape.record(chol(m.value()),
+        [&tape, i, result](const Matrix& adjoint) {
+            const Matrix& L = tape.value(result);
+            int n = L.nRows();
+            Matrix P = transpose(L)*adjoint;
+            for (int r = 0; r < n; r++) {
+                P(r, r) *= 0.5;
+                for (int c = r + 1; c < n; c++) {
+                    P(r, c) = 0.0;
+                }
+            }
+            Matrix inverse = lowerInverse(L);
+            Matrix S = transpose(inverse)*P*inverse;
+            tape.addAdjoint(i, 0.5*(S + transpose(S)));
+        });
+}
+
+//////////////////////////////////////
+//
+//   Tests
+//
+//////////////////////////////////////
+
+/*  Check the adjoint of a scalar function against central
+    differences for every element of its argument */
+static void checkAdjoint(
+        function<AdjointMatrix(const AdjointMatrix&)> f,
+        const Matrix& x,
+        double tolerance) {
+    Tape tape;
+    AdjointMatrix input = tape.variable(x);
+    AdjointMatrix output = f(input);
+    tape.reverse(output);
+    Matrix adjoint = input.adjoint();
+    double h = 1e-6;
+    for (int k = 0; k < x.nRows()*x.nCols(); k++) {
+        Matrix up = x;
+        up(k) += h;
+        Matrix down = x;
+        down(k) -= h;
+        Tape bumped;
+        double fUp = sumCols(sumRows(f(bumped.variable(up)).value()))
+            .asScalar();
+        double fDown = sumCols(sumRows(f(bumped.variable(down)).value()))
+            .asScalar();
+        ASSERT_APPROX_EQUAL(adjoint(k), (fUp - fDown) / (2 * h), tolerance);
+    }
+}
+
+static void testElementwiseOperations() {
+    Matrix x("1,2;3,4");
+    Matrix c("2,-1;0.5,3");
+    checkAdjoint([&](const AdjointMatrix& a) {
+        return dotTimes(exp(0.1*a), log(a + 1.0)) - a;
+    }, x, 1e-6);
+    checkAdjoint([&](const AdjointMatrix& a) {
+        return positivePart(dotTimes(a, c) - 1.0);
+    }, x, 1e-6);
+    checkAdjoint([&](const AdjointMatrix& a) {
+        return 3.0 - dotTimes(a, a);
+    }, x, 1e-6);
+}
+
+static void testMatrixOperations() {
+    Matrix x("1,2;3,4");
+    Matrix c("2,-1;0.5,3;1,1");
+    checkAdjoint([&](const AdjointMatrix& a) {
+        return col(c*(a*transpose(a)), 1);
+    }, x, 1e-5);
+    checkAdjoint([&](const AdjointMatrix& a) {
+        return diagonal(a) + sumCols(a);
+    }, x, 1e-6);
+}
+
+static void testCholesky() {
+    Matrix cov("5,2,1;2,6,-1;1,-1,7");
+    // bumping one entry of the argument moves both entries
+    // of the symmetric matrix factorised by half as much
+    auto f = [](const AdjointMatrix& a) {
+        AdjointMatrix s = 0.5*(a + transpose(a));
+        return sumCols(exp(0.1*chol(s)));
+    };
+    checkAdjoint(f, cov, 1e-6);
+    Tape tape;
+    AdjointMatrix input = tape.variable(cov);
+    tape.reverse(f(input));
+    Matrix adjoint = input.adjoint();
+    adjoint.assertEquals(transpose(adjoint), 1e-10);
+    // clearing the tape releases every entry
+    tape.clear();
+    ASSERT(tape.size() == 0);
+}
+
+void testAdjointMatrix() {
+    TEST(testElementwiseOperations);
+    TEST(testMatrixOperations);
+    TEST(testCholesky);
+}
@@ -0,0 +1,133 @@
+#ifndef ADJOINTMATRIX_H_INCLUDED
+#define ADJOINTMATRIX_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+#include "Matrix.h"
+
+class AdjointMatrix;
+
+/**
+ *   Records a calculation on matrices as it is performed, so
+ *   that the derivatives of a result with respect to every
+ *   input can be computed afterwards in a single reverse sweep,
+ *   at a small multiple of the cost of the calculation.
+ *
+ *   Each entry holds the value of an intermediate matrix and a
+ *   function which passes the adjoint of the entry back to the
+ *   entries it was computed from. Clearing the tape releases the
+ *   memory, so a long calculation can be split into pieces with
+ *   only the adjoints of the inputs carried between them.
+ */
+class Tape {
+public:
+    /*  Record an input of the calculation */
+    AdjointMatrix variable(const Matrix& value);
+    /*  Record a result computed from earlier entries. backward
+        is passed the adjoint of the result and should add its
+        contribution to the adjoints of the arguments */
+    AdjointMatrix record(const Matrix& value,
+        std::function<void(const Matrix& adjoint)> backward);
+    /*  The value of an entry */
+    const Matrix& value(int index) const {
+        return entries[index].value;
+    }
+    /*  The adjoint of an entry, which is zero
+        until the reverse sweep reaches it */
+    Matrix adjoint(int index) const;
+    /*  Add to the adjoint of an entry */
+    void addAdjoint(int index, const Matrix& contribution);
+    /*  Compute the derivatives of the sum of the elements of
+        the result with respect to every earlier entry */
+    void reverse(const AdjointMatrix& result);
+    /*  Forget every entry */
+    void clear() {
+        entries.clear();
+    }
+    /*  The number of entries recorded */
+    int size() const {
+        return entries.size();
+    }
+private:
+    struct Entry {
+        Matrix value;
+        Matrix adjoint;
+        bool hasAdjoint;
+        std::function<void(const Matrix&)> backward;
+    };
+    std::vector<Entry> entries;
+};
+
+/**
+ *   A matrix whose calculations are recorded on a tape
+ */
+class AdjointMatrix {
+public:
+    AdjointMatrix(Tape& tape, int index) :
+        tape(&tape),
+        index(index) {
+    }
+    /*  The value of the matrix */
+    const Matrix& value() const {
+        return tape->value(index);
+    }
+    /*  The derivative of the result of the reverse
+        sweep with respect to each element */
+    Matrix adjoint() const {
+        return tape->adjoint(index);
+    }
+    /*  The tape the matrix is recorded on */
+    Tape& getTape() const {
+        return *tape;
+    }
+    /*  The position of the matrix on the tape */
+    int getIndex() const {
+        return index;
+    }
+    int nRows() const {
+        return value().nRows();
+    }
+    int nCols() const {
+        return value().nCols();
+    }
+private:
+    Tape* tape;
+    int index;
+};
+
+/*  Elementwise arithmetic */
+AdjointMatrix operator+(const AdjointMatrix& x, const AdjointMatrix& y);
+AdjointMatrix operator-(const AdjointMatrix& x, const AdjointMatrix& y);
+AdjointMatrix operator+(const AdjointMatrix& m, double scalar);
+AdjointMatrix operator-(const AdjointMatrix& m, double scalar);
+AdjointMatrix operator-(double scalar, const AdjointMatrix& m);
+AdjointMatrix operator*(double scalar, const AdjointMatrix& m);
+/*  Elementwise product */
+AdjointMatrix dotTimes(const AdjointMatrix& x, const AdjointMatrix& y);
+/*  Elementwise product with a constant */
+AdjointMatrix dotTimes(const AdjointMatrix& x, const Matrix& y);
+/*  Matrix multiplication */
+AdjointMatrix operator*(const AdjointMatrix& a, const AdjointMatrix& b);
+/*  Matrix multiplication by a constant on the left */
+AdjointMatrix operator*(const Matrix& a, const AdjointMatrix& b);
+/*  Elementwise functions */
+AdjointMatrix exp(const AdjointMatrix& m);
+AdjointMatrix log(const AdjointMatrix& m);
+AdjointMatrix positivePart(const AdjointMatrix& m);
+/*  The transpose */
+AdjointMatrix transpose(const AdjointMatrix& m);
+/*  A column of a matrix */
+AdjointMatrix col(const AdjointMatrix& m, int col);
+/*  The diagonal of a square matrix as a row vector */
+AdjointMatrix diagonal(const AdjointMatrix& m);
+/*  The row vector of the sums of each column */
+AdjointMatrix sumCols(const AdjointMatrix& m);
+/*  The lower triangular Cholesky factor of a symmetric
+    positive definite matrix. The adjoint of the matrix is
+    returned as a symmetric matrix */
+AdjointMatrix chol(const AdjointMatrix& m);
+
+void testAdjointMatrix();
+
+#endif // ADJOINTMATRIX_H_INCLUDED
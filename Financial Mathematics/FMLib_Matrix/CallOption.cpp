@@ -9,6 +9,11 @@ Matrix CallOption::payoffAtMaturity( const Matrix& stockAtMaturity ) const {
     return val;
 }
 
+AdjointMatrix CallOption::adjointPayoffAtMaturity(
+        const AdjointMatrix& stockAtMaturity ) const {
+    return positivePart(stockAtMaturity - getStrike());
+}
+
 
 double CallOption::price(
         const MultiStockModel& msm ) const {
@@ -1 +1,129 @@
 #include "ContinuousTimeOption.h"
+
+using namespace std;
+
+/**
+ *  Computes the payoff of any option by recording
+ *  the paths in a MarketSimulation
+ */
+class RecordingPayoffAccumulator : public PayoffAccumulator {
+public:
+    RecordingPayoffAccumulator(
+            const ContinuousTimeOption& option,
+            const vector<string>& stocks,
+            int nPaths,
+            int nSteps) :
+        option(option),
+        recorder(stocks, nPaths, nSteps) {
+    }
+
+    void observe(int step, const Matrix& prices) {
+        recorder.observe(step, prices);
+    }
+
+    Matrix payoff() const {
+        return option.payoff(recorder.getSimulation());
+    }
+
+    bool storesPaths() const {
+        return true;
+    }
+private:
+    const ContinuousTimeOption& option;
+    PathRecorder recorder;
+};
+
+/**
+ *  Computes the payoff of an option from the statistics
+ *  it declares it needs
+ */
+class StatisticsPayoffAccumulator : public PayoffAccumulator {
+public:
+    StatisticsPayoffAccumulator(
+            const ContinuousTimeOption& option,
+            const PathRequirements& requirements,
+            const MultiStockModel& model,
+            int nPaths,
+            const vector<double>& dates) :
+        option(option),
+        statistics(requirements, model, dates, nPaths) {
+    }
+
+    void observe(int step, const Matrix& prices) {
+        statistics.observe(step, prices);
+    }
+
+    bool needsStep(int step, int nSteps) const {
+        return statistics.needsStep(step, nSteps);
+    }
+
+    bool usesLogPrices() const {
+        return statistics.usesLogPrices();
+    }
+
+    void observeLogPrices(int step, const Matrix& logPrices) {
+        statistics.observeLogPrices(step, logPrices);
+    }
+
+    Matrix payoff() const {
+        return option.payoffFromStatistics(statistics.getStatistics());
+    }
+private:
+    const ContinuousTimeOption& option;
+    StatisticsAccumulator statistics;
+};
+
+Matrix ContinuousTimeOption::payoffFromStatistics(
+        const PathStatistics& statistics) const {
+    // options that declare requirements must override this
+    throw runtime_error("The option has no payoff from statistics");
+}
+
+AdjointMatrix ContinuousTimeOption::adjointPayoff(
+        const AdjointMatrix& finalPrices,
+        const vector<string>& stocks) const {
+    // options that have an adjoint payoff must override this
+    throw runtime_error("The option has no adjoint payoff");
+}
+
+SPPayoffAccumulator ContinuousTimeOption::createAccumulator(
+        const MultiStockModel& model,
+        int nPaths,
+        const vector<double>& dates) const {
+    PathRequirements requirements;
+    if (getPathRequirements(requirements)) {
+        return SPPayoffAccumulator(new StatisticsPayoffAccumulator(
+            *this, requirements, model, nPaths, dates));
+    }
+    return SPPayoffAccumulator(new RecordingPayoffAccumulator(
+        *this, model.getStocks(), nPaths, dates.size()));
+}
+
+vector<double> ContinuousTimeOption::getTimeGrid(double fromDate,
+        int nSteps) const {
+    double maturity = getMaturity();
+    ASSERT(maturity > fromDate);
+    set<double> dates;
+    if (!getMonitoringDates(dates)) {
+        for (int i = 1; i < nSteps; i++) {
+            dates.insert(fromDate + i*(maturity - fromDate) / nSteps);
+        }
+    }
+    dates.insert(maturity);
+    // drop dates in the past and dates which
+    // are too close to the previous one
+    vector<double> ret;
+    for (double date : dates) {
+        double previous = ret.empty() ? fromDate : ret.back();
+        if (date > previous + DATE_TOLERANCE && date <= maturity) {
+            ret.push_back(date);
+        }
+    }
+    if (ret.empty()) {
+        // the maturity is within the tolerance of fromDate
+        ret.push_back(maturity);
+    } else if (ret.back() < maturity) {
+        ret.back() = maturity;
+    }
+    return ret;
+}
@@ -3,6 +3,8 @@
 #include "stdafx.h"
 #include "Priceable.h"
 #include "Matrix.h"
+#include "PathRequirements.h"
+#include "AdjointMatrix.h"
 
 /**
  *  Interface class for an option whose payoff should
@@ -22,9 +24,55 @@ public:
         ) const = 0;
     /*  Is the option path-dependent?*/
     virtual bool isPathDependent() const = 0;
+    /*  Is the payoff a continuous function of the prices?
+        Pathwise Greeks are only valid if it is */
+    virtual bool isPayoffContinuous() const {
+        return true;
+    }
     /*  What stocks does the contract depend upon? */
     virtual std::set<std::string>
         getStocks() const = 0;
+    /*  Add the statistics of the paths that the payoff needs
+        to the requirements. Returns false if the payoff needs
+        the whole of each path */
+    virtual bool getPathRequirements(
+            PathRequirements& requirements) const {
+        return false;
+    }
+    /*  Calculate the payoff from the statistics
+        declared by getPathRequirements. Options that declare
+        requirements must override this, otherwise it throws */
+    virtual Matrix payoffFromStatistics(
+        const PathStatistics& statistics) const;
+    /*  Can the payoff be recorded on a tape by adjointPayoff? */
+    virtual bool hasAdjointPayoff() const {
+        return false;
+    }
+    /*  Record the payoff on a tape given the prices at maturity,
+        with a column for each of the given stocks, so that its
+        derivatives can be computed by a reverse sweep */
+    virtual AdjointMatrix adjointPayoff(
+        const AdjointMatrix& finalPrices,
+        const std::vector<std::string>& stocks) const;
+    /*  Create an accumulator that computes the payoff as paths
+        of the given model are simulated one step at a time.
+        By default only the statistics declared by
+        getPathRequirements are computed, or if there are none
+        the paths are recorded and passed to payoff */
+    virtual SPPayoffAccumulator createAccumulator(
+        const MultiStockModel& model,
+        int nPaths,
+        const std::vector<double>& dates) const;
+    /*  Add the dates on which the payoff depends upon prices.
+        Returns false if prices are monitored continuously */
+    virtual bool getMonitoringDates(std::set<double>& dates) const {
+        return false;
+    }
+    /*  The dates to simulate from fromDate to compute the payoff.
+        These are the monitoring dates and the maturity, with nSteps
+        equally spaced dates added if prices are monitored
+        continuously */
+    std::vector<double> getTimeGrid(double fromDate, int nSteps) const;
 };
 
 typedef std::shared_ptr<ContinuousTimeOption> SPContinuousTimeOption;
@@ -7,6 +7,11 @@
 
 double ContinuousTimeOptionBase::price( const MultiStockModel& model ) const {
     MonteCarloPricer pricer;
+    SPUnitPathCache cache = UnitPathScope::current();
+    if (cache) {
+        pricer.reuseUnitPaths = true;
+        pricer.unitPaths = cache;
+    }
     return pricer.price( *this, model );
 }
 
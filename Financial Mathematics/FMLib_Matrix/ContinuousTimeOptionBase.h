@@ -46,12 +46,15 @@ public:
      *  for the option using the most appropriate method for
      *  the given option. Note that since you can't control
      *  the accuracy of the calculation this isn't a good method
-     *  for general use, but is handy for tests.
+     *  for general use, but is handy for tests. Reuses unit
+     *  paths from the cache of any UnitPathScope.
      */
     virtual double price( const MultiStockModel& model ) const;
 
     /**
-    *  Compute the payoff given the prices for the stock
+    *  Compute the payoff given the prices for the stock on
+    *  the dates of getTimeGrid. An option monitored on given
+    *  dates treats every column as a monitoring date
     */
     virtual Matrix payoff(const Matrix& stockPrices) const = 0;
 
@@ -59,7 +62,7 @@ public:
     *  Compute the payoff given the a simulation of the market
     */
     Matrix payoff(const MarketSimulation& sim) const {
-        return payoff(*sim.getStockPrices(getStock()));
+        return payoff(sim.getStockPrices(sim.getStockIndex(getStock())));
     }
 
     /*  What stocks does the contract depend upon */
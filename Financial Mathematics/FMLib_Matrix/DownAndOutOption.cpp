@@ -1,6 +1,7 @@
 #include "DownAndOutOption.h"
 #include "KnockoutOption.h"
 #include "matlib.h"
+#include "MonteCarloPricer.h"
 
 using namespace std;
 
@@ -15,6 +16,31 @@ Matrix DownAndOutOption::payoff(
     return p;
 }
 
+bool DownAndOutOption::getPathRequirements(
+        PathRequirements& requirements) const {
+    requirements.require(getStock(), TERMINAL_VALUE);
+    if (getMonitoringDates().empty()) {
+        requirements.require(getStock(), RUNNING_MINIMUM);
+    } else {
+        requirements.requireDates(getStock(),
+            getMonitoringDatesToMaturity());
+    }
+    return true;
+}
+
+Matrix DownAndOutOption::payoffFromStatistics(
+        const PathStatistics& statistics) const {
+    Matrix min = getMonitoringDates().empty()
+        ? statistics.get(getStock(), RUNNING_MINIMUM)
+        : minOverRows(statistics.getValues(getStock()));
+    Matrix didntHit = min > getBarrier();
+    Matrix p = statistics.get(getStock(), TERMINAL_VALUE);
+    p -= getStrike();
+    p.positivePart();
+    p.times(didntHit);
+    return p;
+}
+
 /////////////////////////////////////
 //
 //   TESTS
@@ -22,7 +48,7 @@ Matrix DownAndOutOption::payoff(
 /////////////////////////////////////
 
 
-void testDownAndOutOption() {
+static void testPayoff() {
     DownAndOutOption o;
     o.setBarrier(50);
     o.setStrike(70);
@@ -33,3 +59,30 @@ void testDownAndOutOption() {
     prices(0,0) = 40;
     ASSERT_APPROX_EQUAL( o.payoff( prices ).asScalar(), 0.0, 0.001);
 }
+
+static void testMonitoringDatesOutsideRange() {
+    BlackScholesModel model;
+    model.stockPrice = 100;
+    model.volatility = 0.2;
+    model.riskFreeRate = 0.05;
+
+    DownAndOutOption o;
+    o.setBarrier(90);
+    o.setStrike(100);
+    o.setMaturity(1.0);
+    o.setMonitoringDates(vector<double>({ 0.5 }));
+    DownAndOutOption outside = o;
+    outside.setMonitoringDates(vector<double>({ -1.0, 0.5, 2.0 }));
+
+    // dates before the model date or after maturity are ignored
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 10000;
+    double price = pricer.price( o, model );
+    ASSERT( price > 0 );
+    ASSERT_APPROX_EQUAL( pricer.price( outside, model ), price, 1e-8 );
+}
+
+void testDownAndOutOption() {
+    TEST( testPayoff );
+    TEST( testMonitoringDatesOutsideRange );
+}
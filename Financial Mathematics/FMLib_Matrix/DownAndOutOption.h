@@ -6,6 +6,13 @@ class DownAndOutOption : public KnockoutOption {
 public:
     Matrix payoff(
         const Matrix& prices ) const;
+    using KnockoutOption::getMonitoringDates;
+    /*  Only the final and minimum prices are needed */
+    bool getPathRequirements(
+        PathRequirements& requirements) const;
+    /*  Compute the payoff from the final and minimum prices */
+    Matrix payoffFromStatistics(
+        const PathStatistics& statistics) const;
 };
 
 
@@ -137,6 +137,138 @@ void ExecutorImpl::join() {
     }
 }
 
+/*  The tasks of one pooled executor still to finish */
+class TaskGroup {
+public:
+    TaskGroup() : pending(0) {}
+    int pending;
+};
+
+/**
+ *   Threads which live as long as the program, running the
+ *   tasks of every pooled executor in the order they arrive
+ */
+class ThreadPool {
+public:
+    explicit ThreadPool(int nThreads);
+    ~ThreadPool();
+    /*  Queue a task belonging to the given group */
+    void submit(shared_ptr<Task> task, TaskGroup& group);
+    /*  Wait until the group's tasks are complete, running
+        any which haven't started on this thread */
+    void wait(TaskGroup& group);
+    /*  The pool shared by all pooled executors */
+    static ThreadPool& instance();
+private:
+    /*  The loop each thread of the pool runs */
+    void run();
+    /*  Mutex to protect the queue and the groups */
+    mutex mtx;
+    /*  Signalled when a task is queued */
+    condition_variable taskQueued;
+    /*  Signalled when a task completes */
+    condition_variable taskDone;
+    /*  Tasks which haven't started */
+    deque< pair< shared_ptr<Task>, TaskGroup* > > queue;
+    /*  The threads of the pool */
+    vector<thread> threads;
+    /*  Set when the program exits */
+    bool stopping;
+};
+
+ThreadPool::ThreadPool(int nThreads) :
+    stopping(false) {
+    for (int i = 0; i < nThreads; i++) {
+        threads.push_back(thread(&ThreadPool::run, this));
+    }
+}
+
+ThreadPool::~ThreadPool() {
+    {
+        lock_guard<mutex> lock(mtx);
+        stopping = true;
+    }
+    taskQueued.notify_all();
+    for (auto& t : threads) {
+        t.join();
+    }
+}
+
+ThreadPool& ThreadPool::instance() {
+    static ThreadPool pool(
+        max(1, (int)thread::hardware_concurrency()));
+    return pool;
+}
+
+void ThreadPool::submit(shared_ptr<Task> task, TaskGroup& group) {
+    {
+        lock_guard<mutex> lock(mtx);
+        group.pending++;
+        queue.push_back(make_pair(task, &group));
+    }
+    taskQueued.notify_one();
+}
+
+void ThreadPool::run() {
+    unique_lock<mutex> lock(mtx);
+    while (true) {
+        while (!stopping && queue.empty()) {
+            taskQueued.wait(lock);
+        }
+        if (queue.empty()) {
+            return;
+        }
+        shared_ptr<Task> task = queue.front().first;
+        TaskGroup* group = queue.front().second;
+        queue.pop_front();
+        lock.unlock();
+        task->execute();
+        task.reset();
+        lock.lock();
+        group->pending--;
+        taskDone.notify_all();
+    }
+}
+
+void ThreadPool::wait(TaskGroup& group) {
+    unique_lock<mutex> lock(mtx);
+    while (group.pending > 0) {
+        auto pos = find_if(queue.begin(), queue.end(),
+            [&group](const pair< shared_ptr<Task>, TaskGroup* >& entry) {
+                return entry.second == &group;
+            });
+        if (pos == queue.end()) {
+            taskDone.wait(lock);
+            continue;
+        }
+        shared_ptr<Task> task = pos->first;
+        queue.erase(pos);
+        lock.unlock();
+        task->execute();
+        task.reset();
+        lock.lock();
+        group.pending--;
+    }
+}
+
+/**
+ *   An executor whose tasks run on the shared pool
+ */
+class PooledExecutor : public Executor {
+public:
+    ~PooledExecutor() {
+        join();
+    }
+    void addTask(shared_ptr<Task> task) {
+        ThreadPool::instance().submit(task, group);
+    }
+    void join() {
+        ThreadPool::instance().wait(group);
+    }
+private:
+    TaskGroup group;
+};
+
 /**
  *  Returns an executor
  */
@@ -153,6 +285,13 @@ shared_ptr<Executor> Executor::newInstance( int maxThreads ) {
     return ret;
 }
 
+/**
+ *  Returns an executor using the shared pool
+ */
+shared_ptr<Executor> Executor::newPooledInstance() {
+    return make_shared<PooledExecutor>();
+}
+
 
 
 static void test100Tasks() {
@@ -182,6 +321,51 @@ static void test100Tasks() {
     }
 }
 
+static void testPooledExecutor() {
+    class CountTask : public Task {
+    public:
+        atomic<int>& count;
+
+        void execute() {
+            count++;
+        }
+
+        CountTask(atomic<int>& count) : count(count) {}
+    };
+
+    // each task joins its own pooled executor, which
+    // mustn't deadlock however small the pool is
+    class NestedTask : public Task {
+    public:
+        atomic<int>& count;
+
+        void execute() {
+            SPExecutor executor = Executor::newPooledInstance();
+            for (int i = 0; i < 10; i++) {
+                executor->addTask(make_shared<CountTask>(count));
+            }
+            executor->join();
+        }
+
+        NestedTask(atomic<int>& count) : count(count) {}
+    };
+
+    atomic<int> count(0);
+    SPExecutor executor = Executor::newPooledInstance();
+    for (int i = 0; i < 10; i++) {
+        executor->addTask(make_shared<NestedTask>(count));
+    }
+    executor->join();
+    ASSERT(count == 100);
+
+    // the pool can be reused
+    SPExecutor another = Executor::newPooledInstance();
+    another->addTask(make_shared<CountTask>(count));
+    another->join();
+    ASSERT(count == 101);
+}
+
 void testExecutor() {
     TEST( test100Tasks );
+    TEST( testPooledExecutor );
 }
@@ -21,6 +21,12 @@ public:
     /*  Factory method */
     static std::shared_ptr<Executor> newInstance(
         int maxThreads );
+    /*  Returns an executor which runs its tasks on a pool of
+        threads that lives as long as the program and is shared
+        by all such executors, so no threads are created. A
+        thread which joins runs its executor's queued tasks
+        itself, so tasks may use pooled executors too */
+    static std::shared_ptr<Executor> newPooledInstance();
 };
 
 typedef std::shared_ptr<Executor> SPExecutor;
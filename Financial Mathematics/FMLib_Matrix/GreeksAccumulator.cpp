@@ -0,0 +1,293 @@
+#include "GreeksAccumulator.h"
+
+#include "matlib.h"
+#include "geometry.h"
+#include "AdjointMatrix.h"
+#include "CallOption.h"
+#include "UpAndOutOption.h"
+
+using namespace std;
+
+GreeksAccumulator::GreeksAccumulator(
+        const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        int nPaths,
+        const vector<double>& dates,
+        bool pathwise) :
+    option(option),
+    stocks(model.getStocks()),
+    pathwise(pathwise),
+    dates(dates),
+    startDate(model.getDate()),
+    payoffAccumulator(option.createAccumulator(model, nPaths, dates)) {
+    if (pathwise && !option.hasAdjointPayoff()) {
+        throw runtime_error(
+            "Pathwise Greeks need an option with an adjoint payoff");
+    }
+    int nStocks = stocks.size();
+    double r = model.getRiskFreeRate();
+    previousLogPrices = Matrix(nPaths, nStocks, false);
+    for (int j = 0; j < nStocks; j++) {
+        // only the variances are needed, which a factor model
+        // gives without forming the covariance matrix
+        BlackScholesModel bsm = model.getBlackScholesModel(stocks[j]);
+        stockPrices.push_back(bsm.stockPrice);
+        volatilities.push_back(bsm.volatility);
+        logDrifts.push_back(r - 0.5*bsm.volatility*bsm.volatility);
+        double logS0 = log(stockPrices[j]);
+        for (int p = 0; p < nPaths; p++) {
+            previousLogPrices(p, j) = logS0;
+        }
+    }
+    int nParameters = 2 * nStocks + 1;
+    if (pathwise) {
+        volatilityDerivatives = Matrix(nPaths, nStocks);
+    } else {
+        cholesky = model.getCholeskyFactor();
+        scores = Matrix(nPaths, nParameters);
+    }
+}
+
+void GreeksAccumulator::observe(int step, const Matrix& prices) {
+    Matrix logPrices = prices;
+    logPrices.log();
+    observeLogPrices(step, logPrices);
+}
+
+/**
+ *  Write u for the normalised increment of the log prices,
+ *  (x - mu dt)/sqrt(dt), which has covariance matrix C. Its
+ *  log density is -u'C^{-1}u/2 - log(det C)/2 up to a constant.
+ *  Writing y = C^{-1}u and differentiating gives the scores
+ *      price of stock j       y_j/(S_j sqrt(dt)), first step only
+ *      volatility of stock j  (y_j u_j - 1)/sigma_j - sigma_j sqrt(dt) y_j
+ *      risk free rate         sqrt(dt) sum_j y_j
+ *  The derivative of the log price of stock j with respect to
+ *  sigma_j is -sigma_j dt + (x_j - mu_j dt)/sigma_j over each step.
+ */
+void GreeksAccumulator::observeLogPrices(int step,
+        const Matrix& logPrices) {
+    int nPaths = logPrices.nRows();
+    int nStocks = logPrices.nCols();
+    int nSteps = dates.size();
+    double dt = dates[step] - (step == 0 ? startDate : dates[step - 1]);
+    double rootDt = sqrt(dt);
+
+    if (pathwise) {
+        for (int j = 0; j < nStocks; j++) {
+            double sigma = volatilities[j];
+            double driftTerm = logDrifts[j] * dt;
+            const double* x = logPrices.begin() + logPrices.offset(0, j);
+            const double* previous = previousLogPrices.begin()
+                + previousLogPrices.offset(0, j);
+            double* d = volatilityDerivatives.begin()
+                + volatilityDerivatives.offset(0, j);
+            for (int p = 0; p < nPaths; p++) {
+                d[p] += -sigma*dt
+                    + (x[p] - previous[p] - driftTerm) / sigma;
+            }
+        }
+    } else {
+        const Matrix& A = cholesky;
+        vector<double> u(nStocks);
+        vector<double> y(nStocks);
+        for (int p = 0; p < nPaths; p++) {
+            for (int j = 0; j < nStocks; j++) {
+                u[j] = (logPrices(p, j) - previousLogPrices(p, j)
+                    - logDrifts[j] * dt) / rootDt;
+            }
+            // solve A A' y = u by forward then back substitution
+            for (int j = 0; j < nStocks; j++) {
+                double s = u[j];
+                for (int k = 0; k < j; k++) {
+                    s -= A(j, k)*y[k];
+                }
+                y[j] = s / A(j, j);
+            }
+            for (int j = nStocks - 1; j >= 0; j--) {
+                double s = y[j];
+                for (int k = j + 1; k < nStocks; k++) {
+                    s -= A(k, j)*y[k];
+                }
+                y[j] = s / A(j, j);
+            }
+            double sumY = 0.0;
+            for (int j = 0; j < nStocks; j++) {
+                double sigma = volatilities[j];
+                if (step == 0) {
+                    scores(p, j) += y[j] / (stockPrices[j] * rootDt);
+                }
+                scores(p, nStocks + j) += (y[j] * u[j] - 1) / sigma
+                    - sigma*rootDt*y[j];
+                sumY += y[j];
+            }
+            scores(p, 2 * nStocks) += rootDt*sumY;
+        }
+    }
+    previousLogPrices = logPrices;
+
+    bool usesPrices = !payoffAccumulator->usesLogPrices();
+    Matrix prices;
+    if (usesPrices) {
+        prices = logPrices;
+        prices.exp();
+    }
+    if (payoffAccumulator->needsStep(step, nSteps)) {
+        if (usesPrices) {
+            payoffAccumulator->observe(step, prices);
+        } else {
+            payoffAccumulator->observeLogPrices(step, logPrices);
+        }
+    }
+}
+
+Matrix GreeksAccumulator::payoff() const {
+    return payoffAccumulator->payoff();
+}
+
+/**
+ *  The final price of stock j is S_j exp(x_j), where x_j moves
+ *  by one over S_j as S_j moves, by the elapsed time as the risk
+ *  free rate moves, and by its accumulated derivative as the
+ *  volatility moves. So each pathwise derivative is the
+ *  derivative of the payoff with respect to the final price,
+ *  times the final price, times the derivative of x_j
+ */
+Matrix GreeksAccumulator::sensitivities() const {
+    int nStocks = stockPrices.size();
+    int nParameters = 2 * nStocks + 1;
+    Matrix payoffs = payoff();
+    int nPaths = payoffs.nRows();
+    Matrix ret(nPaths, nParameters, false);
+    if (!pathwise) {
+        for (int q = 0; q < nParameters; q++) {
+            for (int p = 0; p < nPaths; p++) {
+                ret(p, q) = payoffs(p)*scores(p, q);
+            }
+        }
+        return ret;
+    }
+    Matrix finalPrices = previousLogPrices;
+    finalPrices.exp();
+    Tape tape;
+    AdjointMatrix S = tape.variable(finalPrices);
+    tape.reverse(option.adjointPayoff(S, stocks));
+    Matrix gradient = S.adjoint();
+    double elapsed = dates.back() - startDate;
+    for (int p = 0; p < nPaths; p++) {
+        double rho = 0.0;
+        for (int j = 0; j < nStocks; j++) {
+            double dx = gradient(p, j)*finalPrices(p, j);
+            ret(p, j) = dx / stockPrices[j];
+            ret(p, nStocks + j) = dx*volatilityDerivatives(p, j);
+            rho += dx*elapsed;
+        }
+        ret(p, 2 * nStocks) = rho;
+    }
+    return ret;
+}
+
+//////////////////////////////////////
+//
+//   Tests
+//
+//////////////////////////////////////
+
+/*  The mean undiscounted sensitivities of an option */
+static Matrix meanSensitivities(const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        int nPaths,
+        int nSteps,
+        bool pathwise) {
+    vector<double> dates = option.getTimeGrid(model.getDate(), nSteps);
+    GreeksAccumulator accumulator(option, model, nPaths, dates, pathwise);
+    mt19937 rng;
+    model.simulateRiskNeutralPricePaths(rng, dates, nPaths,
+        SamplingOptions(), accumulator);
+    return meanCols(accumulator.sensitivities());
+}
+
+static void testCallOptionGreeks() {
+    BlackScholesModel bsm;
+    bsm.stockPrice = 100.0;
+    bsm.volatility = 0.2;
+    bsm.riskFreeRate = 0.05;
+    MultiStockModel msm(bsm);
+    CallOption c;
+    c.setStrike(105.0);
+    c.setMaturity(1.0);
+
+    // the Black Scholes Greeks. The sensitivities are those
+    // of the undiscounted payoff, so the derivative of the
+    // discount factor is added to rho
+    double T = 1.0;
+    double df = exp(-0.05*T);
+    double d1 = (log(100.0 / 105.0) + (0.05 + 0.02)*T) / (0.2*sqrt(T));
+    double d2 = d1 - 0.2*sqrt(T);
+    double price = 100.0*normcdf(d1) - df*105.0*normcdf(d2);
+    double delta = normcdf(d1);
+    double vega = 100.0*sqrt(T)*exp(-0.5*d1*d1) / sqrt(2 * PI);
+    double rho = df*105.0*T*normcdf(d2) + T*price;
+
+    Matrix pathwise = meanSensitivities(c, msm, 100000, 1, true);
+    ASSERT_APPROX_EQUAL(df*pathwise(0), delta, 0.01);
+    ASSERT_APPROX_EQUAL(df*pathwise(1), vega, 0.5);
+    ASSERT_APPROX_EQUAL(df*pathwise(2), rho, 0.5);
+
+    // the derivatives of the log prices accumulate over the steps
+    Matrix stepped = meanSensitivities(c, msm, 100000, 4, true);
+    ASSERT_APPROX_EQUAL(df*stepped(0), delta, 0.01);
+    ASSERT_APPROX_EQUAL(df*stepped(1), vega, 0.5);
+    ASSERT_APPROX_EQUAL(df*stepped(2), rho, 0.5);
+
+    // the likelihood ratio method has a larger variance
+    Matrix ratios = meanSensitivities(c, msm, 100000, 4, false);
+    ASSERT_APPROX_EQUAL(df*ratios(0), delta, 0.02);
+    ASSERT_APPROX_EQUAL(df*ratios(1), vega, 1.5);
+    ASSERT_APPROX_EQUAL(df*ratios(2), rho, 1.5);
+}
+
+static void testBarrierOptionGreeks() {
+    BlackScholesModel bsm;
+    bsm.stockPrice = 100.0;
+    bsm.volatility = 0.2;
+    bsm.riskFreeRate = 0.05;
+    MultiStockModel msm(bsm);
+    UpAndOutOption o;
+    o.setStrike(100.0);
+    o.setBarrier(130.0);
+    o.setMaturity(1.0);
+
+    // compare with bumping the stock price
+    // using the same random numbers
+    Matrix ratios = meanSensitivities(o, msm, 100000, 10, false);
+    double h = 1.0;
+    vector<double> dates = o.getTimeGrid(0.0, 10);
+    double bumped[2];
+    for (int s = 0; s < 2; s++) {
+        BlackScholesModel bumpedModel = bsm;
+        bumpedModel.stockPrice += s == 0 ? h : -h;
+        MultiStockModel m(bumpedModel);
+        mt19937 rng;
+        MarketSimulation sim = m.generateRiskNeutralPricePaths(
+            rng, dates, 100000, SamplingOptions());
+        const ContinuousTimeOption& option = o;
+        bumped[s] = meanCols(option.payoff(sim)).asScalar();
+    }
+    double expected = (bumped[0] - bumped[1]) / (2 * h);
+    ASSERT_APPROX_EQUAL(ratios(0), expected, 0.03);
+
+    // the payoff has no derivative to take pathwise
+    bool thrown = false;
+    try {
+        GreeksAccumulator accumulator(o, msm, 10, dates, true);
+    } catch (const runtime_error&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testGreeksAccumulator() {
+    TEST(testCallOptionGreeks);
+    TEST(testBarrierOptionGreeks);
+}
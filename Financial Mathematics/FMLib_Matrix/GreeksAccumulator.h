@@ -0,0 +1,90 @@
+#ifndef GREEKSACCUMULATOR_H_INCLUDED
+#define GREEKSACCUMULATOR_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+#include "ContinuousTimeOption.h"
+#include "MultiStockModel.h"
+
+/**
+ *   Computes the payoff of an option together with its
+ *   derivatives with respect to the model parameters on the
+ *   same paths, as they are simulated in the Q measure.
+ *
+ *   The derivatives are with respect to the price and the
+ *   volatility of each stock of the model, keeping the
+ *   correlations fixed, and the risk free rate ignoring
+ *   discounting.
+ *
+ *   Pathwise derivatives differentiate the payoff of each path
+ *   with respect to the final prices, by a reverse sweep of the
+ *   adjoint payoff, and apply the chain rule through the
+ *   derivatives of the final prices with respect to each
+ *   parameter. Only the derivatives of the final log prices
+ *   with respect to the volatilities are accumulated as the
+ *   paths are simulated, so this costs little more than the
+ *   payoff. It needs a continuous payoff of the final prices
+ *   with an adjoint payoff.
+ *
+ *   Otherwise the likelihood ratio method multiplies the payoff
+ *   by the derivative of the log density of the path, which
+ *   works for any payoff but has a higher variance.
+ */
+class GreeksAccumulator : public PayoffAccumulator {
+public:
+    /*  Pathwise derivatives need an option with an adjoint
+        payoff */
+    GreeksAccumulator(const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        int nPaths,
+        const std::vector<double>& dates,
+        bool pathwise);
+    void observe(int step, const Matrix& prices);
+    /*  The increments of the log prices are needed */
+    bool usesLogPrices() const {
+        return true;
+    }
+    void observeLogPrices(int step, const Matrix& logPrices);
+    Matrix payoff() const;
+    bool storesPaths() const {
+        return payoffAccumulator->storesPaths();
+    }
+    /*  The derivatives of the payoff on each path, with a column
+        for the price of each stock, then for the volatility of
+        each stock, then one for the risk free rate */
+    Matrix sensitivities() const;
+private:
+    /*  The option */
+    const ContinuousTimeOption& option;
+    /*  The stocks of the model */
+    std::vector<std::string> stocks;
+    /*  Are the derivatives pathwise? */
+    bool pathwise;
+    /*  The simulated dates */
+    std::vector<double> dates;
+    /*  The date the simulation starts */
+    double startDate;
+    /*  The initial stock prices */
+    std::vector<double> stockPrices;
+    /*  The volatility of each stock */
+    std::vector<double> volatilities;
+    /*  The drift of each log stock price */
+    std::vector<double> logDrifts;
+    /*  The Cholesky factor of the covariance matrix */
+    Matrix cholesky;
+    /*  Computes the payoff */
+    SPPayoffAccumulator payoffAccumulator;
+    /*  The log prices at the previous step */
+    Matrix previousLogPrices;
+    /*  For pathwise derivatives, the derivative of each log
+        price with respect to the volatility of its stock */
+    Matrix volatilityDerivatives;
+    /*  For the likelihood ratio method, the derivatives of the
+        log density of each path with respect to the parameters */
+    Matrix scores;
+};
+
+void testGreeksAccumulator();
+
+#endif // GREEKSACCUMULATOR_H_INCLUDED
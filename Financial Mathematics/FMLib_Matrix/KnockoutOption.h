@@ -17,9 +17,47 @@ public:
         this->barrier=barrier;
     }
 
+    /*  The dates on which the barrier is monitored. If there
+        are none, the barrier is monitored continuously */
+    const std::vector<double>& getMonitoringDates() const {
+        return monitoringDates;
+    }
+
+    void setMonitoringDates(const std::vector<double>& dates) {
+        this->monitoringDates = dates;
+    }
+
+    /*  The monitoring dates which are on or before the maturity,
+        together with the maturity itself */
+    std::vector<double> getMonitoringDatesToMaturity() const {
+        std::set<double> dates;
+        for (double date : monitoringDates) {
+            if (date <= getMaturity()) {
+                dates.insert(date);
+            }
+        }
+        dates.insert(getMaturity());
+        return std::vector<double>(dates.begin(), dates.end());
+    }
+
+    bool getMonitoringDates(std::set<double>& dates) const {
+        if (monitoringDates.empty()) {
+            return false;
+        }
+        dates.insert(monitoringDates.begin(), monitoringDates.end());
+        dates.insert(getMaturity());
+        return true;
+    }
+
     bool isPathDependent() const {
         return true;
     }
+
+    /*  The payoff jumps to zero at the barrier */
+    bool isPayoffContinuous() const {
+        return false;
+    }
 private:
     double barrier;
+    std::vector<double> monitoringDates;
 };
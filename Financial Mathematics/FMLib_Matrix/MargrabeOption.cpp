@@ -14,16 +14,45 @@ set<string> MargrabeOption::getStocks() const {
 Matrix MargrabeOption::payoff(
     const MarketSimulation& simulation
     ) const {
-    auto stockPrices1 = simulation.getStockPrices(stock1);
-    int nSteps = stockPrices1->nCols();
-    Matrix finalPrices1 = stockPrices1->col(nSteps - 1);
-    auto stockPrices2 = simulation.getStockPrices(stock2);
-    Matrix finalPrices2 = stockPrices2->col(nSteps - 1);
+    const Matrix& stockPrices1 = simulation.getStockPrices(
+        simulation.getStockIndex(stock1));
+    int nSteps = stockPrices1.nCols();
+    Matrix finalPrices1 = stockPrices1.col(nSteps - 1);
+    const Matrix& stockPrices2 = simulation.getStockPrices(
+        simulation.getStockIndex(stock2));
+    Matrix finalPrices2 = stockPrices2.col(nSteps - 1);
     Matrix ret = finalPrices1 - finalPrices2;
     ret.positivePart();
     return ret;
 }
 
+bool MargrabeOption::getPathRequirements(
+        PathRequirements& requirements) const {
+    requirements.require(stock1, TERMINAL_VALUE);
+    requirements.require(stock2, TERMINAL_VALUE);
+    return true;
+}
+
+Matrix MargrabeOption::payoffFromStatistics(
+        const PathStatistics& statistics) const {
+    Matrix ret = statistics.get(stock1, TERMINAL_VALUE)
+        - statistics.get(stock2, TERMINAL_VALUE);
+    ret.positivePart();
+    return ret;
+}
+
+AdjointMatrix MargrabeOption::adjointPayoff(
+        const AdjointMatrix& finalPrices,
+        const vector<string>& stocks) const {
+    int index1 = find(stocks.begin(), stocks.end(), stock1)
+        - stocks.begin();
+    int index2 = find(stocks.begin(), stocks.end(), stock2)
+        - stocks.begin();
+    ASSERT(index1 < (int)stocks.size() && index2 < (int)stocks.size());
+    return positivePart(col(finalPrices, index1)
+        - col(finalPrices, index2));
+}
+
 
 static void testAnalyticalFormula() {
 
@@ -30,6 +30,28 @@ public:
         return false;
     }
 
+    /*  Only the prices at maturity are monitored */
+    virtual bool getMonitoringDates(
+            std::set<double>& dates) const override {
+        dates.insert(maturity);
+        return true;
+    }
+
+    /*  Only the final prices are needed */
+    virtual bool getPathRequirements(
+        PathRequirements& requirements) const override;
+
+    virtual Matrix payoffFromStatistics(
+        const PathStatistics& statistics) const override;
+
+    /*  The payoff is differentiable almost everywhere */
+    bool hasAdjointPayoff() const override {
+        return true;
+    }
+
+    AdjointMatrix adjointPayoff(const AdjointMatrix& finalPrices,
+        const std::vector<std::string>& stocks) const override;
+
     double price(const MultiStockModel& model) const {
         MonteCarloPricer pricer;
         return pricer.price(*this, model);
@@ -6,15 +6,48 @@
 #include "stdafx.h"
 #include "Matrix.h"
 
+/**
+ *   The simulated prices of a collection of stocks.
+ *
+ *   Each stock has an integer handle, its position in the
+ *   order the stocks were added. Simulations generated by a
+ *   MultiStockModel use the model's stock indices as handles,
+ *   so a handle can be resolved once and then used for
+ *   lookups that need neither a search nor a reference count.
+ */
 class MarketSimulation {
 public:
 
     /**
-     *  Store a simulation
+     *  Store a simulation, returning the handle of the stock
      */
-    void addSimulation(const std::string& stock,
+    int addSimulation(const std::string& stock,
         SPCMatrix matrix) {
-        simulations[stock] = matrix;
+        auto pos = stockToIndex.find(stock);
+        if (pos != stockToIndex.end()) {
+            simulations[pos->second] = matrix;
+            return pos->second;
+        }
+        int index = simulations.size();
+        stockToIndex[stock] = index;
+        simulations.push_back(matrix);
+        return index;
+    }
+
+    /**
+     *   The number of stocks simulated
+     */
+    int nStocks() const {
+        return simulations.size();
+    }
+
+    /**
+     *   The handle of a stock
+     */
+    int getStockIndex(const std::string& stock) const {
+        auto pos = stockToIndex.find(stock);
+        ASSERT(pos != stockToIndex.end());
+        return pos->second;
     }
 
     /**
@@ -24,13 +57,39 @@ public:
      */
     SPCMatrix getStockPrices( const std::string& stock)
         const {
-        auto pos = simulations.find(stock);
-        ASSERT(pos != simulations.end());
-        return pos->second;
+        return simulations[getStockIndex(stock)];
+    }
+
+    /**
+     *   Returns the matrix of prices of the stock
+     *   with the given handle
+     */
+    const Matrix& getStockPrices(int stockIndex) const {
+        ASSERT(stockIndex >= 0 && stockIndex < nStocks());
+        return *simulations[stockIndex];
+    }
+
+    /**
+     *  Store the likelihood ratio of each scenario when
+     *  the simulation was importance sampled
+     */
+    void setWeights(SPCMatrix weights) {
+        this->weights = weights;
+    }
+
+    /**
+     *   Returns a column vector of weights by which each
+     *   scenario's payoff must be multiplied, or an empty
+     *   pointer if the scenarios are unweighted
+     */
+    SPCMatrix getWeights() const {
+        return weights;
     }
 
 private:
-    std::map< std::string, SPCMatrix> simulations;
+    std::unordered_map< std::string, int> stockToIndex;
+    std::vector< SPCMatrix> simulations;
+    SPCMatrix weights;
 };
 
 #endif // MARKETSIMULATION_H_INCLUDED
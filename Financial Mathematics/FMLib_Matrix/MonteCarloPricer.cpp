@@ -2,15 +2,52 @@
 
 #include "matlib.h"
 #include "CallOption.h"
+#include "UpAndOutOption.h"
+#include "MargrabeOption.h"
 #include "Executor.h"
+#include "GreeksAccumulator.h"
+#include "geometry.h"
 
 using namespace std;
 
 
+/*  The cache of the innermost UnitPathScope on this thread */
+static thread_local SPUnitPathCache scopedUnitPaths;
+
+UnitPathScope::UnitPathScope(SPUnitPathCache cache) :
+    previous(scopedUnitPaths) {
+    scopedUnitPaths = cache;
+}
+
+UnitPathScope::~UnitPathScope() {
+    scopedUnitPaths = previous;
+}
+
+SPUnitPathCache UnitPathScope::current() {
+    return scopedUnitPaths;
+}
+
 MonteCarloPricer::MonteCarloPricer() :
     nScenarios(100000),
     nSteps(10),
-    nTasks(1) {
+    nTasks(1),
+    chunkSize(10000),
+    batchSize(0),
+    reproducible(false),
+    computeGreeks(false),
+    computeAdjoints(false),
+    reuseUnitPaths(false),
+    unitPaths(make_shared<UnitPathCache>()),
+    memoryBudget(256.0 * 1024 * 1024),
+    reportMomentMatchingBias(false),
+    chooseDriftShift(false),
+    nPilotScenarios(10000),
+    confidenceLevel(0.95),
+    targetStandardError(0.0),
+    targetRelativeError(0.0),
+    maxSeconds(0.0),
+    adaptiveBatchSize(10000),
+    anytimeSeconds(0.0) {
 }
 
 double MonteCarloPricer::price(
@@ -22,86 +59,804 @@ double MonteCarloPricer::price(
     return price(option, msm);
 }
 
-double singleThreadedPrice(
-        int taskNumber,
-        int nScenarios,
-        int nSteps,
+/**
+ *  Compute the payoffs, weighting them by the likelihood
+ *  ratios if the simulation was importance sampled
+ */
+static Matrix weightedPayoffs(
         const ContinuousTimeOption& option,
-        const MultiStockModel& model ) {
+        const MarketSimulation& sim) {
+    Matrix payoffs = option.payoff( sim );
+    SPCMatrix weights = sim.getWeights();
+    if (weights) {
+        payoffs.times( *weights );
+    }
+    return payoffs;
+}
+
+/**
+ *  Accumulates payoffs so that we can estimate both the
+ *  mean payoff and the variance of that estimate. The
+ *  variance calculation takes account of how the paths
+ *  were sampled.
+ */
+class PayoffStatistics {
+public:
+    explicit PayoffStatistics(const SamplingOptions& sampling);
+    /*  Add the payoffs computed from one simulation */
+    void add(const Matrix& payoffs);
+    /*  Add the payoffs recorded by another instance */
+    void add(const PayoffStatistics& other);
+    /*  The number of payoffs recorded */
+    long long count() const;
+    /*  The estimate of the mean payoff */
+    double mean() const;
+    /*  The variance of the estimate of the mean */
+    double variance() const;
+private:
+    /*  How the paths were sampled */
+    SamplingMethod method;
+    /*  The number of paths in each block */
+    int nStrata;
+    /*  Sums of the payoffs and their squares in each stratum */
+    vector<double> sums;
+    vector<double> sumSquares;
+    /*  The number of payoffs in each stratum */
+    vector<long long> counts;
+    /*  Sums of the means of complete latin hypercube
+        blocks and their squares */
+    double blockTotal;
+    double blockTotalSq;
+    /*  The number of complete latin hypercube blocks */
+    long long nBlocks;
+};
+
+PayoffStatistics::PayoffStatistics(
+        const SamplingOptions& sampling) :
+    method(sampling.method),
+    nStrata(sampling.nStrata),
+    blockTotal(0.0),
+    blockTotalSq(0.0),
+    nBlocks(0) {
+    int nBuckets = method == STRATIFIED ? nStrata : 1;
+    sums.resize(nBuckets, 0.0);
+    sumSquares.resize(nBuckets, 0.0);
+    counts.resize(nBuckets, 0);
+}
+
+void PayoffStatistics::add(const Matrix& payoffs) {
+    int n = payoffs.nRows();
+    int nBuckets = sums.size();
+    for (int p = 0; p < n; p++) {
+        // paths are assigned to strata by their index
+        // in the simulation
+        int h = p % nBuckets;
+        double x = payoffs(p);
+        sums[h] += x;
+        sumSquares[h] += x*x;
+        counts[h]++;
+    }
+    if (method == LATIN_HYPERCUBE) {
+        for (int start = 0; start + nStrata <= n; start += nStrata) {
+            double blockSum = 0.0;
+            for (int k = 0; k < nStrata; k++) {
+                blockSum += payoffs(start + k);
+            }
+            double blockMean = blockSum / nStrata;
+            blockTotal += blockMean;
+            blockTotalSq += blockMean*blockMean;
+            nBlocks++;
+        }
+    }
+}
+
+void PayoffStatistics::add(const PayoffStatistics& other) {
+    ASSERT(other.sums.size() == sums.size());
+    for (int h = 0; h < (int)sums.size(); h++) {
+        sums[h] += other.sums[h];
+        sumSquares[h] += other.sumSquares[h];
+        counts[h] += other.counts[h];
+    }
+    blockTotal += other.blockTotal;
+    blockTotalSq += other.blockTotalSq;
+    nBlocks += other.nBlocks;
+}
+
+long long PayoffStatistics::count() const {
+    long long total = 0;
+    for (auto n : counts) {
+        total += n;
+    }
+    return total;
+}
+
+double PayoffStatistics::mean() const {
+    // each stratum has equal probability
+    int nBuckets = sums.size();
+    double total = 0.0;
+    for (int h = 0; h < nBuckets; h++) {
+        ASSERT(counts[h] > 0);
+        total += sums[h] / counts[h];
+    }
+    return total / nBuckets;
+}
+
+double PayoffStatistics::variance() const {
+    if (method == LATIN_HYPERCUBE) {
+        // the blocks are independent designs so we can
+        // estimate the variance from the block means
+        if (nBlocks < 2) {
+            return 0.0;
+        }
+        double blockVariance = (blockTotalSq
+            - blockTotal*blockTotal / nBlocks) / (nBlocks - 1);
+        return blockVariance / nBlocks;
+    }
+    int nBuckets = sums.size();
+    double total = 0.0;
+    for (int h = 0; h < nBuckets; h++) {
+        long long n = counts[h];
+        if (n < 2) {
+            continue;
+        }
+        double sampleVariance = (sumSquares[h]
+            - sums[h] * sums[h] / n) / (n - 1);
+        total += sampleVariance / n;
+    }
+    return total / ((double)nBuckets*nBuckets);
+}
+/**
+ *  The statistics of the payoffs of each option priced together
+ *  with those of each column of their sensitivities, if Greeks are
+ *  computed, and the total adjoints of the inputs, if adjoints
+ *  are computed
+ */
+class ScenarioStatistics {
+public:
+    ScenarioStatistics(const SamplingOptions& sampling,
+            int nOptions,
+            int nSensitivities,
+            int nAdjoints) :
+        payoffs(nOptions, PayoffStatistics(sampling)),
+        sensitivities(nSensitivities, PayoffStatistics(sampling)),
+        adjoints(nAdjoints, 0.0) {
+    }
+    /*  Add the adjoints of the total payoff of a batch */
+    void addAdjoints(const vector<double>& batchAdjoints) {
+        ASSERT(batchAdjoints.size() == adjoints.size());
+        for (int k = 0; k < (int)adjoints.size(); k++) {
+            adjoints[k] += batchAdjoints[k];
+        }
+    }
+    /*  Add the payoffs, with a column for each option, and
+        the sensitivities of one simulation */
+    void add(const Matrix& payoffs, const Matrix& sensitivities) {
+        if (this->payoffs.size() == 1) {
+            this->payoffs[0].add(payoffs);
+        } else {
+            for (int k = 0; k < (int)this->payoffs.size(); k++) {
+                this->payoffs[k].add(payoffs.col(k));
+            }
+        }
+        for (int q = 0; q < (int)this->sensitivities.size(); q++) {
+            this->sensitivities[q].add(sensitivities.col(q));
+        }
+    }
+    /*  Add the statistics recorded by another instance */
+    void add(const ScenarioStatistics& other) {
+        ASSERT(other.payoffs.size() == payoffs.size());
+        for (int k = 0; k < (int)payoffs.size(); k++) {
+            payoffs[k].add(other.payoffs[k]);
+        }
+        ASSERT(other.sensitivities.size() == sensitivities.size());
+        for (int q = 0; q < (int)sensitivities.size(); q++) {
+            sensitivities[q].add(other.sensitivities[q]);
+        }
+        addAdjoints(other.adjoints);
+    }
+    vector<PayoffStatistics> payoffs;
+    vector<PayoffStatistics> sensitivities;
+    vector<double> adjoints;
+};
+
+/**
+ *  The state of a pricing calculation shared by all
+ *  the tasks working on it
+ */
+class PricingRun {
+public:
+    PricingRun(const MonteCarloPricer& pricer,
+            const SamplingOptions& sampling,
+            const vector<double>& discounts,
+            int nScenarios,
+            int chunkSize,
+            int nSensitivities,
+            int nAdjoints) :
+        pricer(pricer),
+        statistics(sampling, discounts.size(), nSensitivities, nAdjoints),
+        discounts(discounts),
+        adaptive(pricer.targetStandardError > 0
+            || pricer.targetRelativeError > 0
+            || pricer.maxSeconds > 0
+            || pricer.anytimeSeconds > 0
+            || pricer.control),
+        finished(false),
+        interrupted(false),
+        nScenarios(nScenarios),
+        chunkSize(chunkSize),
+        nChunks((nScenarios + chunkSize - 1) / chunkSize),
+        chunksTaken(0),
+        chunksAdded(0),
+        start(chrono::steady_clock::now()) {
+    }
+
+    /*  Take the next chunk, returning false once there
+        are none left or the tasks should stop */
+    bool takeChunk(int& chunk, int& nChunkScenarios) {
+        lock_guard<mutex> lock(mtx);
+        if (finished || chunksTaken >= nChunks) {
+            return false;
+        }
+        chunk = chunksTaken++;
+        nChunkScenarios = min(chunkSize, nScenarios - chunk*chunkSize);
+        return true;
+    }
+
+    /*  Record the payoffs of a batch and return
+        whether the tasks should stop */
+    bool add(const ScenarioStatistics& batch) {
+        lock_guard<mutex> lock(mtx);
+        statistics.add(batch);
+        checkFinished();
+        return finished;
+    }
 
+    /*  Record the payoffs of a whole chunk and return whether
+        the tasks should stop. Chunks are added to the statistics
+        in order, and the accuracy checked after each, so neither
+        the sums nor where we stop depend on which task priced
+        which chunk */
+    bool addChunk(int chunk, const ScenarioStatistics& chunkStatistics) {
+        lock_guard<mutex> lock(mtx);
+        pending.insert(make_pair(chunk, chunkStatistics));
+        while (!finished && !pending.empty()
+                && pending.begin()->first == chunksAdded) {
+            statistics.add(pending.begin()->second);
+            pending.erase(pending.begin());
+            chunksAdded++;
+            checkFinished();
+        }
+        return finished;
+    }
+
+    /*  Check whether every price is accurate enough, we are
+        out of time or the calculation has been cancelled */
+    void checkFinished() {
+        if (pricer.control && !finished) {
+            reportProgress();
+            finished = pricer.control->shouldStop();
+            interrupted = finished;
+        }
+        if (adaptive && !finished) {
+            bool accurate = true;
+            for (int k = 0; k < (int)discounts.size() && accurate; k++) {
+                const PayoffStatistics& payoffs = statistics.payoffs[k];
+                double price = discounts[k]*payoffs.mean();
+                double standardError
+                    = discounts[k]*sqrt(payoffs.variance());
+                accurate = pricer.isAccurateEnough(price, standardError);
+            }
+            interrupted = !accurate && pricer.maxSeconds > 0
+                && elapsedSeconds() >= pricer.maxSeconds;
+            finished = accurate || interrupted
+                || (pricer.anytimeSeconds > 0
+                    && elapsedSeconds() >= pricer.anytimeSeconds);
+        }
+    }
+
+    /*  The number of scenarios recorded so far */
+    long long scenariosAdded() {
+        lock_guard<mutex> lock(mtx);
+        return statistics.payoffs[0].count();
+    }
+
+    /*  Pass the progress of the first option to the control */
+    void reportProgress() const {
+        if (!pricer.control->onProgress) {
+            return;
+        }
+        const PayoffStatistics& payoffs = statistics.payoffs[0];
+        PricingProgress progress;
+        progress.nScenarios = payoffs.count();
+        progress.price = discounts[0]*payoffs.mean();
+        progress.standardError = discounts[0]*sqrt(payoffs.variance());
+        progress.elapsedSeconds = elapsedSeconds();
+        pricer.control->onProgress(progress);
+    }
 
+    /*  The time since we started */
+    double elapsedSeconds() const {
+        chrono::duration<double> elapsed
+            = chrono::steady_clock::now() - start;
+        return elapsed.count();
+    }
+
+    const MonteCarloPricer& pricer;
+    /*  Mutex to protect the statistics */
+    mutex mtx;
+    /*  The payoffs recorded by every task */
+    ScenarioStatistics statistics;
+    /*  The discount factor to the maturity of each option */
+    vector<double> discounts;
+    /*  Whether we should stop early */
+    bool adaptive;
+    /*  Set once the tasks should stop */
+    bool finished;
+    /*  Set if they stopped early because the calculation was
+        cancelled, or passed its deadline or time limit */
+    bool interrupted;
+    /*  The total number of scenarios */
+    int nScenarios;
+    /*  The number of scenarios in each chunk but the last */
+    int chunkSize;
+    /*  The number of chunks */
+    int nChunks;
+    /*  The number of chunks handed out so far */
+    int chunksTaken;
+    /*  The number of chunks added in order so far */
+    int chunksAdded;
+    /*  Chunks which finished before an earlier chunk */
+    map<int, ScenarioStatistics> pending;
+    /*  When we started */
+    chrono::steady_clock::time_point start;
+};
+
+/**
+*   The dates to simulate for an option. Options which
+*   aren't path dependent only need their monitoring dates
+*/
+static vector<double> timeGrid(
+        const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        int nSteps) {
     if (!option.isPathDependent()) {
         nSteps = 1;
     }
-    double total = 0.0;
+    return option.getTimeGrid(model.getDate(), nSteps);
+}
+
+/*  The stream of random numbers for a chunk of scenarios */
+static mt19937 chunkStream(int chunk) {
+    seed_seq seed({ (unsigned)chunk });
+    return mt19937(seed);
+}
+
+/**
+ *  Passes each time step to the accumulators of several options,
+ *  each of which only sees the dates up to its own maturity
+ */
+class OptionSetAccumulator : public PayoffAccumulator {
+public:
+    OptionSetAccumulator(
+            const vector<const ContinuousTimeOption*>& options,
+            const MultiStockModel& model,
+            int nPaths,
+            const vector<double>& dates) {
+        for (auto option : options) {
+            vector<double> optionDates;
+            for (double date : dates) {
+                if (date <= option->getMaturity() + DATE_TOLERANCE) {
+                    optionDates.push_back(date);
+                }
+            }
+            accumulators.push_back(option->createAccumulator(
+                model, nPaths, optionDates));
+            nDates.push_back(optionDates.size());
+        }
+    }
 
-    MultiStockModel subModel = model.getSubmodel(
-        option.getStocks());
+    void observe(int step, const Matrix& prices) {
+        for (int k = 0; k < (int)accumulators.size(); k++) {
+            if (step < nDates[k]
+                    && accumulators[k]->needsStep(step, nDates[k])) {
+                accumulators[k]->observe(step, prices);
+            }
+        }
+    }
 
-    long long randSize = subModel.randSize(nScenarios,
-                                           nSteps);
-    mt19937 rng;
-    rng.discard(randSize*taskNumber);
+    void observeLogPrices(int step, const Matrix& logPrices) {
+        for (int k = 0; k < (int)accumulators.size(); k++) {
+            if (step < nDates[k]
+                    && accumulators[k]->needsStep(step, nDates[k])) {
+                accumulators[k]->observeLogPrices(step, logPrices);
+            }
+        }
+    }
 
-    // We price at most one million scenarios at a time to avoid running out of memory
-    int batchSize = 1000000/nSteps;
-    if (batchSize<=0) {
-        batchSize = 1;
+    bool needsStep(int step, int nSteps) const {
+        for (int k = 0; k < (int)accumulators.size(); k++) {
+            if (step < nDates[k]
+                    && accumulators[k]->needsStep(step, nDates[k])) {
+                return true;
+            }
+        }
+        return false;
     }
 
-    int scenariosRemaining = nScenarios;
-    while (scenariosRemaining>0) {
+    /*  Log prices can only be used if every option uses them */
+    bool usesLogPrices() const {
+        for (auto& accumulator : accumulators) {
+            if (!accumulator->usesLogPrices()) {
+                return false;
+            }
+        }
+        return true;
+    }
 
-        int thisBatch = batchSize;
-        if (scenariosRemaining<batchSize) {
-            thisBatch = scenariosRemaining;
+    /*  The payoffs with a column for each option */
+    Matrix payoff() const {
+        ASSERT(accumulators.size() > 0);
+        Matrix first = accumulators[0]->payoff();
+        Matrix ret(first.nRows(), accumulators.size(), false);
+        ret.setCol(0, first, 0);
+        for (int k = 1; k < (int)accumulators.size(); k++) {
+            ret.setCol(k, accumulators[k]->payoff(), 0);
         }
+        return ret;
+    }
 
-        MarketSimulation sim = subModel.
-            generateRiskNeutralPricePaths(
-                rng,
-                option.getMaturity(),
-                thisBatch,
-                nSteps );
-        Matrix payoffs = option.payoff( sim );
-        total+= sumCols( payoffs ).asScalar();
-        scenariosRemaining-=thisBatch;
+    bool storesPaths() const {
+        for (auto& accumulator : accumulators) {
+            if (accumulator->storesPaths()) {
+                return true;
+            }
+        }
+        return false;
+    }
+private:
+    vector<SPPayoffAccumulator> accumulators;
+    /*  The number of dates each option needs */
+    vector<int> nDates;
+};
+
+/**
+ *  The options a run prices on each path. The paths cover the
+ *  stocks of every option up to the longest maturity on the union
+ *  of the dates each option would be simulated on alone, and the
+ *  payoff has a column for each option. The options must outlive
+ *  the set.
+ */
+class OptionSet {
+public:
+    OptionSet(const ContinuousTimeOption& option,
+            const MultiStockModel& model,
+            int nSteps) :
+        options({ &option }),
+        stocks(option.getStocks()),
+        dates(timeGrid(option, model, nSteps)) {
+    }
+
+    OptionSet(const vector<SPCContinuousTimeOption>& options,
+            const MultiStockModel& model,
+            int nSteps) {
+        set<double> allDates;
+        for (auto& option : options) {
+            this->options.push_back(option.get());
+            set<string> optionStocks = option->getStocks();
+            stocks.insert(optionStocks.begin(), optionStocks.end());
+            vector<double> grid = timeGrid(*option, model, nSteps);
+            allDates.insert(grid.begin(), grid.end());
+        }
+        dates.assign(allDates.begin(), allDates.end());
+    }
+
+    /*  The number of options */
+    int size() const {
+        return options.size();
+    }
+
+    /*  One of the options */
+    const ContinuousTimeOption& getOption(int k) const {
+        return *options[k];
+    }
+
+    /*  The stocks to simulate */
+    const set<string>& getStocks() const {
+        return stocks;
+    }
+
+    /*  The dates to simulate */
+    const vector<double>& getDates() const {
+        return dates;
+    }
+
+    /*  Create an accumulator computing the payoff of every
+        option as paths on the dates are simulated */
+    SPPayoffAccumulator createAccumulator(
+            const MultiStockModel& model,
+            int nPaths) const {
+        if (options.size() == 1) {
+            return options[0]->createAccumulator(model, nPaths, dates);
+        }
+        return make_shared<OptionSetAccumulator>(options, model, nPaths,
+            dates);
+    }
+private:
+    vector<const ContinuousTimeOption*> options;
+    set<string> stocks;
+    vector<double> dates;
+};
+
+/**
+ *  Simulate a batch on a tape and sweep back through it,
+ *  returning the payoffs and setting adjoints to the derivatives
+ *  of their total with respect to the stock prices, then the
+ *  covariance matrix in column major order, then the risk free
+ *  rate. The payoff only depends on the final prices, which are
+ *  exactly log normal, so one step suffices. Only the tape of
+ *  the current batch is held in memory.
+ */
+static Matrix adjointBatch(
+        mt19937& rng,
+        int nPaths,
+        const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        vector<double>& adjoints) {
+    vector<string> stocks = model.getStocks();
+    int nStocks = stocks.size();
+    Matrix stockPrices(1, nStocks, false);
+    for (int j = 0; j < nStocks; j++) {
+        stockPrices(0, j) = model.getStockPrice(stocks[j]);
     }
-    double mean = total/nScenarios;
-    double r = model.getRiskFreeRate();
     double T = option.getMaturity() - model.getDate();
-    return exp(-r*T)*mean;
+
+    Tape tape;
+    AdjointMatrix S0 = tape.variable(stockPrices);
+    AdjointMatrix cov = tape.variable(model.getCovarianceMatrix());
+    AdjointMatrix r = tape.variable(Matrix(model.getRiskFreeRate()));
+    AdjointMatrix drift = transpose(ones(nStocks, 1)*r)
+        - 0.5*diagonal(cov);
+    Matrix paths = ones(nPaths, 1);
+    Matrix Z = randn(rng, nPaths, nStocks);
+    AdjointMatrix logPrices = paths*(log(S0) + T*drift)
+        + sqrt(T)*(Z*transpose(chol(cov)));
+    AdjointMatrix payoffs = option.adjointPayoff(exp(logPrices), stocks);
+    tape.reverse(payoffs);
+
+    adjoints.clear();
+    for (const AdjointMatrix& input : { S0, cov, r }) {
+        Matrix adjoint = input.adjoint();
+        adjoints.insert(adjoints.end(), adjoint.begin(), adjoint.end());
+    }
+    return payoffs.value();
+}
+
+/*  The batch sizes of anytime mode */
+static const int BATCHES_PER_BUDGET = 50;
+static const int PILOT_BATCH_SIZE = 64;
+static const int MIN_BATCH_SIZE = 16;
+
+/**
+ *  Sizes the batches of one task in anytime mode. Each batch
+ *  takes about a fiftieth of the time budget, so the run checks
+ *  the deadline often, and the last batch is cut to the time
+ *  left. The cost of a scenario is measured from the batches
+ *  priced so far, starting with a small pilot batch.
+ */
+class AnytimeBatchSizer {
+public:
+    AnytimeBatchSizer(PricingRun& run,
+            int maxBatchSize,
+            int granularity) :
+        run(run),
+        maxBatchSize(maxBatchSize),
+        granularity(granularity),
+        secondsPerScenario(0.0),
+        batchStart(0.0) {
+    }
+
+    /*  The size of the next batch, or zero if there
+        isn't time for one */
+    int nextBatchSize() {
+        batchStart = run.elapsedSeconds();
+        double budget = run.pricer.anytimeSeconds;
+        double remaining = budget - batchStart;
+        int smallest = roundDown(max(MIN_BATCH_SIZE, granularity));
+        if (secondsPerScenario <= 0.0) {
+            if (remaining <= 0.0 && run.scenariosAdded() > 0) {
+                return 0;
+            }
+            return roundDown(PILOT_BATCH_SIZE);
+        }
+        double seconds = min(budget / BATCHES_PER_BUDGET, remaining);
+        double size = seconds / secondsPerScenario;
+        if (size < smallest) {
+            // an estimate is needed even if we started late
+            return run.scenariosAdded() > 0 ? 0 : smallest;
+        }
+        return roundDown((int)min(size, (double)maxBatchSize));
+    }
+
+    /*  Record that a batch of the given size has been priced */
+    void batchDone(int nScenarios) {
+        double seconds = run.elapsedSeconds() - batchStart;
+        double measured = seconds / nScenarios;
+        // the first batches include warming the caches
+        secondsPerScenario = secondsPerScenario <= 0.0 ? measured
+            : 0.5*(secondsPerScenario + measured);
+    }
+
+private:
+    /*  Keep the blocks of strata within a batch */
+    int roundDown(int size) const {
+        size = min(size, maxBatchSize);
+        return max(granularity, size - size % granularity);
+    }
+
+    PricingRun& run;
+    int maxBatchSize;
+    int granularity;
+    double secondsPerScenario;
+    double batchStart;
+};
+
+/*  Multiply each row by the likelihood ratio of its path */
+static void weightRows(Matrix& m, const Matrix& weights) {
+    int nRows = m.nRows();
+    for (int c = 0; c < m.nCols(); c++) {
+        double* column = m.begin() + m.offset(0, c);
+        for (int p = 0; p < nRows; p++) {
+            column[p] *= weights(p);
+        }
+    }
+}
+
+/**
+ *  Price chunks of scenarios until there are none left
+ */
+void singleThreadedPrice(
+        int batchSize,
+        const SamplingOptions& sampling,
+        const OptionSet& options,
+        const MultiStockModel& model,
+        PricingRun& run ) {
+
+
+    SPCMultiStockModel subModel = model.getSubmodel(
+        options.getStocks());
+    const vector<double>& dates = options.getDates();
+    // Greeks and adjoints are only computed for a single option
+    const ContinuousTimeOption& option = options.getOption(0);
+    int nOptions = run.statistics.payoffs.size();
+    int nSensitivities = run.statistics.sensitivities.size();
+    int nAdjoints = run.statistics.adjoints.size();
+
+    int chunk;
+    int scenariosRemaining;
+    bool finished = false;
+    bool anytime = run.pricer.anytimeSeconds > 0;
+    AnytimeBatchSizer sizer( run, batchSize,
+        sampling.method == PSEUDO_RANDOM ? 1 : sampling.nStrata );
+    while (!finished && run.takeChunk(chunk, scenariosRemaining)) {
+        mt19937 rng = chunkStream(chunk);
+        ScenarioStatistics chunkStatistics( sampling, nOptions,
+            nSensitivities, nAdjoints );
+        int batchIndex = 0;
+        while (scenariosRemaining>0 && !finished) {
+
+            int thisBatch = batchSize;
+            if (anytime) {
+                thisBatch = sizer.nextBatchSize();
+                if (thisBatch == 0) {
+                    finished = true;
+                    break;
+                }
+            }
+            if (scenariosRemaining<thisBatch) {
+                thisBatch = scenariosRemaining;
+            }
+
+            ScenarioStatistics batch( sampling, nOptions, nSensitivities,
+                nAdjoints );
+            if (run.pricer.computeAdjoints) {
+                vector<double> adjoints;
+                Matrix payoffs = adjointBatch( rng, thisBatch, option,
+                    *subModel, adjoints );
+                batch.add( payoffs, Matrix() );
+                batch.addAdjoints( adjoints );
+                if (run.pricer.reproducible) {
+                    chunkStatistics.add( batch );
+                } else {
+                    finished = run.add( batch );
+                }
+                if (anytime) {
+                    sizer.batchDone( thisBatch );
+                }
+                scenariosRemaining-=thisBatch;
+                continue;
+            }
+
+            SPPayoffAccumulator accumulator;
+            shared_ptr<GreeksAccumulator> greeks;
+            if (run.pricer.computeGreeks) {
+                greeks = make_shared<GreeksAccumulator>(
+                    option, *subModel, thisBatch, dates,
+                    option.isPayoffContinuous()
+                        && option.hasAdjointPayoff() );
+                accumulator = greeks;
+            } else {
+                accumulator = options.createAccumulator(
+                    *subModel, thisBatch );
+            }
+            SPCMatrix weights;
+            if (run.pricer.reuseUnitPaths) {
+                weights = run.pricer.unitPaths->simulate(
+                    *subModel, dates, thisBatch, sampling,
+                    chunk, batchIndex++, *accumulator );
+            } else {
+                weights = subModel->simulateRiskNeutralPricePaths(
+                    rng,
+                    dates,
+                    thisBatch,
+                    sampling,
+                    *accumulator );
+            }
+            Matrix payoffs = accumulator->payoff();
+            Matrix sensitivities;
+            if (greeks) {
+                sensitivities = greeks->sensitivities();
+            }
+            if (weights) {
+                weightRows( payoffs, *weights );
+                if (greeks) {
+                    weightRows( sensitivities, *weights );
+                }
+            }
+            if (run.pricer.reproducible) {
+                chunkStatistics.add( payoffs, sensitivities );
+            } else {
+                batch.add( payoffs, sensitivities );
+                finished = run.add( batch );
+            }
+            if (anytime) {
+                sizer.batchDone( thisBatch );
+            }
+            scenariosRemaining-=thisBatch;
+        }
+        if (run.pricer.reproducible) {
+            finished = run.addChunk( chunk, chunkStatistics );
+        }
+    }
 }
 
 
 
 class PriceTask : public Task {
 public:
-    /*  Amount of random numbers to skip */
-    int taskNumber;
-    int nScenarios, nSteps;
-    const ContinuousTimeOption& option;
+    int batchSize;
+    const SamplingOptions& sampling;
+    const OptionSet& options;
     const MultiStockModel& model;
-    /*  Output data */
-    double result;
+    /*  Where results are recorded */
+    PricingRun& run;
 
     PriceTask(
-            int taskNumber,
-            int nScenarios,
-            int nSteps,
-            const ContinuousTimeOption& option,
-            const MultiStockModel& model)
+            int batchSize,
+            const SamplingOptions& sampling,
+            const OptionSet& options,
+            const MultiStockModel& model,
+            PricingRun& run)
         :
-        taskNumber(taskNumber),
-        nScenarios(nScenarios),
-        nSteps(nSteps),
-        option(option),
-        model(model) {
+        batchSize(batchSize),
+        sampling(sampling),
+        options(options),
+        model(model),
+        run(run) {
     }
 
     void execute() {
-        result = singleThreadedPrice( taskNumber,
-            nScenarios, nSteps, option, model);
+        singleThreadedPrice(batchSize, sampling, options,
+            model, run);
     }
 };
 
@@ -111,23 +866,542 @@ public:
 double MonteCarloPricer::price(
     const ContinuousTimeOption& option,
     const MultiStockModel& model) const {
-    ASSERT(nTasks >= 1);
-    vector< shared_ptr<PriceTask> > tasks;
-    shared_ptr<Executor> executor =
-        Executor::newInstance(nTasks);
-    for (int i = 0; i<nTasks; i++) {
-        shared_ptr<PriceTask> task(new PriceTask(
-            i, nScenarios/nTasks,
-            nSteps, option, model));
-        tasks.push_back(task);
-        executor->addTask(task);
+    return evaluate(option, model).price;
+}
+
+/**
+*   Convert the total adjoints of the payoffs into the
+*   derivatives of the price. The adjoint of the covariance matrix
+*   treats its entries as independent, so an off diagonal entry
+*   moved together with its transpose receives both. Moving the
+*   volatility of stock k with the correlations fixed moves
+*   row and column k of the covariance matrix in proportion.
+*/
+static void setAdjointSensitivities(
+        PricingResult& result,
+        const vector<double>& adjoints,
+        long long nPaths,
+        const vector<string>& stocks,
+        const Matrix& cov,
+        double discount,
+        double T,
+        double meanPayoff) {
+    int nStocks = stocks.size();
+    double scale = discount / nPaths;
+    const double* covarianceAdjoints = &adjoints[nStocks];
+    result.covarianceSensitivities = Matrix(nStocks, nStocks, false);
+    for (int i = 0; i < nStocks; i++) {
+        result.deltas[stocks[i]] = scale*adjoints[i];
+        double vega = 0.0;
+        for (int j = 0; j < nStocks; j++) {
+            double g = covarianceAdjoints[cov.offset(i, j)];
+            double gTranspose = covarianceAdjoints[cov.offset(j, i)];
+            result.covarianceSensitivities(i, j)
+                = scale*(i == j ? g : g + gTranspose);
+            vega += (g + gTranspose)*cov(i, j);
+        }
+        result.vegas[stocks[i]] = scale*vega / sqrt(cov(i, i));
+    }
+    result.rho = scale*adjoints[nStocks*(nStocks + 1)]
+        - discount*T*meanPayoff;
+}
+
+/**
+*   The number of scenarios to simulate, which in anytime
+*   mode is limited only by the time
+*/
+static int scenariosToRun(const MonteCarloPricer& pricer) {
+    if (pricer.anytimeSeconds > 0) {
+        if (pricer.reproducible) {
+            throw runtime_error(
+                "Anytime pricing can't be reproducible as the number "
+                "of scenarios depends on the time taken");
+        }
+        return numeric_limits<int>::max() - pricer.chunkSize;
+    }
+    return pricer.nScenarios;
+}
+
+/**
+*   The number of scenarios in each chunk
+*/
+static int scenariosPerChunk(const MonteCarloPricer& pricer) {
+    ASSERT(pricer.nTasks >= 1);
+    ASSERT(pricer.chunkSize >= 1);
+    const SamplingOptions& sampling = pricer.sampling;
+    if (sampling.method != PSEUDO_RANDOM && sampling.nStrata < 1) {
+        throw runtime_error("The number of strata must be positive");
+    }
+    if (sampling.method == STRATIFIED
+            && pricer.nScenarios < 2 * sampling.nStrata) {
+        // we need two paths per stratum to estimate the variance
+        throw runtime_error(
+            "Stratified sampling needs at least two scenarios "
+            "per stratum");
+    }
+    if (sampling.method == PSEUDO_RANDOM) {
+        return pricer.chunkSize;
+    }
+    // keep the blocks of strata within a chunk
+    return max(sampling.nStrata,
+        pricer.chunkSize - pricer.chunkSize % sampling.nStrata);
+}
+
+/*  The batch size for a run, defined below */
+static int chooseBatchSize(const MonteCarloPricer& pricer,
+    const OptionSet& options,
+    const MultiStockModel& model);
+
+/**
+*   Price the chunks of a run on the shared thread pool,
+*   returning the batch size used
+*/
+static int runTasks(const MonteCarloPricer& pricer,
+        const SamplingOptions& sampling,
+        const OptionSet& options,
+        const MultiStockModel& model,
+        PricingRun& run) {
+    int batchSize = min(chooseBatchSize(pricer, options, model),
+        run.chunkSize);
+    // each task prices chunks until there are none left, so no
+    // task is idle while another has work queued
+    int nWorkers = min(pricer.nTasks, run.nChunks);
+    shared_ptr<Executor> executor = Executor::newPooledInstance();
+    for (int i = 0; i<nWorkers; i++) {
+        executor->addTask(make_shared<PriceTask>(
+            batchSize, sampling, options, model, run));
     }
     executor->join();
+    return batchSize;
+}
+
+/**
+*   Price the option by Monte Carlo, estimating the standard
+*   error. If a target error or time limit is set, we stop
+*   as soon as it is reached.
+*/
+PricingResult MonteCarloPricer::evaluate(
+    const ContinuousTimeOption& option,
+    const MultiStockModel& model) const {
+    double r = model.getRiskFreeRate();
+    double T = option.getMaturity() - model.getDate();
+    double discount = exp(-r*T);
+
+    SamplingOptions taskSampling = sampling;
+    if (chooseDriftShift) {
+        taskSampling.driftShift = optimalDriftShift(option, model);
+    }
+    vector<string> stocks = model.getSubmodel(option.getStocks())
+        ->getStocks();
+    int nStocks = stocks.size();
+    int nSensitivities = computeGreeks ? 2 * nStocks + 1 : 0;
+    int nAdjoints = computeAdjoints ? nStocks*(nStocks + 1) + 1 : 0;
+    if (computeAdjoints) {
+        // the paths are simulated on a tape directly from
+        // pseudo random numbers, so nothing else can be used
+        if (computeGreeks || !option.hasAdjointPayoff()
+                || sampling.method != PSEUDO_RANDOM
+                || sampling.momentMatching || chooseDriftShift
+                || !sampling.driftShift.empty()) {
+            throw runtime_error("computeAdjoints needs an option with"
+                " an adjoint payoff and plain pseudo random sampling");
+        }
+    }
+    PricingRun run(*this, taskSampling, vector<double>({ discount }),
+        scenariosToRun(*this), scenariosPerChunk(*this), nSensitivities,
+        nAdjoints);
+    OptionSet options(option, model, nSteps);
+    int taskBatchSize = runTasks(*this, taskSampling, options, model, run);
+
+    PricingResult result;
+    const PayoffStatistics& payoffs = run.statistics.payoffs[0];
+    result.setPrice(discount*payoffs.mean(),
+        discount*sqrt(payoffs.variance()),
+        confidenceLevel);
+    if (computeGreeks) {
+        auto& sensitivities = run.statistics.sensitivities;
+        for (int j = 0; j < nStocks; j++) {
+            result.deltas[stocks[j]] = discount*sensitivities[j].mean();
+            result.vegas[stocks[j]]
+                = discount*sensitivities[nStocks + j].mean();
+        }
+        // the sensitivities ignore the discount factor
+        result.rho = discount*(sensitivities[2 * nStocks].mean()
+            - T*payoffs.mean());
+    }
+    if (computeAdjoints) {
+        setAdjointSensitivities(result, run.statistics.adjoints,
+            payoffs.count(), stocks, model.getSubmodel(
+                option.getStocks())->getCovarianceMatrix(),
+            discount, T, payoffs.mean());
+    }
+    result.nScenarios = payoffs.count();
+    result.batchSize = taskBatchSize;
+    result.elapsedSeconds = run.elapsedSeconds();
+    result.completed = !run.interrupted;
+    if (reportMomentMatchingBias && sampling.momentMatching) {
+        double biasError;
+        double bias = momentMatchingBias(option, model, 10, biasError);
+        INFO("Moment matching bias " << bias << " +/- " << biasError);
+    }
+    return result;
+}
+
+/**
+*   Price the option on the shared thread pool
+*/
+PricingHandle MonteCarloPricer::priceAsync(
+        SPCContinuousTimeOption option,
+        const MultiStockModel& model,
+        SPPricingControl control) const {
+    MonteCarloPricer pricer = *this;
+    pricer.control = control ? control : make_shared<PricingControl>();
+    return PricingHandle::start(pricer.control, [pricer, option, model]() {
+        return pricer.evaluate(*option, model);
+    });
+}
+
+/**
+*   Price the option in anytime mode
+*/
+PricingResult MonteCarloPricer::evaluateWithin(
+        const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        double seconds) const {
+    ASSERT(seconds > 0);
+    MonteCarloPricer pricer = *this;
+    pricer.anytimeSeconds = seconds;
+    return pricer.evaluate(option, model);
+}
+
+/**
+*   Simulate the union of the stocks up to the longest maturity
+*   once, and compute the payoff of every option on each path.
+*   Each price is discounted from its own maturity.
+*/
+vector<PricingResult> MonteCarloPricer::priceMany(
+        const vector<SPCContinuousTimeOption>& options,
+        const MultiStockModel& model) const {
+    ASSERT(options.size() > 0);
+    if (computeGreeks || computeAdjoints || chooseDriftShift) {
+        throw runtime_error("priceMany can't compute Greeks, adjoints"
+            " or a drift shift");
+    }
+    OptionSet optionSet(options, model, nSteps);
+    vector<double> discounts;
+    for (auto& option : options) {
+        double T = option->getMaturity() - model.getDate();
+        discounts.push_back(exp(-model.getRiskFreeRate()*T));
+    }
+    PricingRun run(*this, sampling, discounts, scenariosToRun(*this),
+        scenariosPerChunk(*this), 0, 0);
+    int taskBatchSize = runTasks(*this, sampling, optionSet, model, run);
+
+    vector<PricingResult> ret;
+    for (int k = 0; k < (int)options.size(); k++) {
+        const PayoffStatistics& payoffs = run.statistics.payoffs[k];
+        PricingResult result;
+        result.setPrice(discounts[k]*payoffs.mean(),
+            discounts[k]*sqrt(payoffs.variance()),
+            confidenceLevel);
+        result.nScenarios = payoffs.count();
+        result.batchSize = taskBatchSize;
+        result.elapsedSeconds = run.elapsedSeconds();
+        result.completed = !run.interrupted;
+        ret.push_back(result);
+    }
+    return ret;
+}
+
+/**
+ *  The size in bytes of the data cache at the given level
+ *  as reported by Linux, or zero if it is unknown
+ */
+static long long detectCacheSize(int level) {
+    for (int index = 0; index < 10; index++) {
+        string dir = "/sys/devices/system/cpu/cpu0/cache/index"
+            + to_string(index) + "/";
+        ifstream levelFile(dir + "level");
+        if (!levelFile) {
+            break;
+        }
+        int cacheLevel = 0;
+        levelFile >> cacheLevel;
+        string type;
+        ifstream(dir + "type") >> type;
+        if (cacheLevel != level || type == "Instruction") {
+            continue;
+        }
+        string size;
+        ifstream(dir + "size") >> size;
+        long long ret = atoll(size.c_str());
+        if (!size.empty() && size.back() == 'K') {
+            ret *= 1024;
+        } else if (!size.empty() && size.back() == 'M') {
+            ret *= 1024 * 1024;
+        }
+        return ret;
+    }
+    return 0;
+}
+
+/**
+ *  The cache each of the given number of threads can use,
+ *  which is its L2 cache or its share of the L3 cache,
+ *  whichever is larger
+ */
+static long long cachePerThread(int nThreads) {
+    static const long long l2 = detectCacheSize(2);
+    static const long long l3 = detectCacheSize(3);
+    long long l2Size = l2 > 0 ? l2 : 256 * 1024;
+    long long l3Size = l3 > 0 ? l3 : 8 * 1024 * 1024;
+    return max(l2Size, l3Size / max(nThreads, 1));
+}
+
+/**
+ *  Size the batches from the bytes each path needs. Paths
+ *  which are stored, by the accumulator or in the cache of
+ *  unit paths, need a double per stock and date. When
+ *  streaming, each step revisits the log price, the price and
+ *  about two running statistics of every stock on every path,
+ *  which we would like to stay in the cache. With only one
+ *  step nothing is revisited, so only memory matters.
+ */
+static int chooseBatchSize(const MonteCarloPricer& pricer,
+        const OptionSet& options,
+        const MultiStockModel& model) {
+    const SamplingOptions& sampling = pricer.sampling;
+    if (pricer.batchSize > 0) {
+        if (sampling.method == PSEUDO_RANDOM) {
+            return pricer.batchSize;
+        }
+        // paths are assigned to strata by their index in the
+        // batch, so a batch must hold whole blocks of strata
+        int nStrata = sampling.nStrata;
+        return (pricer.batchSize + nStrata - 1) / nStrata * nStrata;
+    }
+    if (pricer.reproducible) {
+        // the random numbers each path receives depend on
+        // how its chunk is split into batches
+        return pricer.chunkSize;
+    }
+    SPCMultiStockModel subModel = model.getSubmodel(options.getStocks());
+    double nStocks = subModel->getStocks().size();
+    double nDates = options.getDates().size();
+    double bytes = sizeof(double);
+    double memoryBudget = pricer.memoryBudget;
+    int nTasks = pricer.nTasks;
+    double ret;
+    if (pricer.reuseUnitPaths
+            || options.createAccumulator(*subModel, 1)->storesPaths()) {
+        ret = memoryBudget / (nTasks*nStocks*(nDates + 2)*bytes);
+    } else if (nDates == 1) {
+        ret = memoryBudget / (nTasks*nStocks*4*bytes);
+    } else {
+        ret = cachePerThread(nTasks) / (nStocks*4*bytes);
+    }
+    ret = min(ret, 1e8);
+    if (pricer.targetStandardError > 0 || pricer.targetRelativeError > 0
+        || pricer.maxSeconds > 0 || pricer.anytimeSeconds > 0) {
+        // check the error regularly
+        ret = min(ret, (double)pricer.adaptiveBatchSize);
+    }
+    int size = max(1, (int)ret);
+    if (sampling.method != PSEUDO_RANDOM && size > sampling.nStrata) {
+        // keep the blocks of strata within a batch
+        size -= size % sampling.nStrata;
+    }
+    return size;
+}
+
+int MonteCarloPricer::chooseBatchSize(
+        const ContinuousTimeOption& option,
+        const MultiStockModel& model) const {
+    return ::chooseBatchSize(*this, OptionSet(option, model, nSteps),
+        model);
+}
+
+/**
+*   Check the error against the targets
+*/
+bool MonteCarloPricer::isAccurateEnough(double price,
+        double standardError) const {
+    if (targetStandardError > 0
+        && standardError <= targetStandardError) {
+        return true;
+    }
+    if (targetRelativeError > 0
+        && standardError <= targetRelativeError*fabs(price)) {
+        return true;
+    }
+    return false;
+}
+
+/**
+*   Each replication prices the option with the full number of
+*   scenarios twice from the same random numbers, once with and
+*   once without moment matching. Without moment matching the
+*   estimate is unbiased, so the mean difference estimates the bias.
+*/
+double MonteCarloPricer::momentMatchingBias(
+    const ContinuousTimeOption& option,
+    const MultiStockModel& model,
+    int nReplications,
+    double& standardError) const {
+    ASSERT(nReplications >= 2);
+    vector<double> dates = timeGrid(option, model, nSteps);
+    SPCMultiStockModel subModel = model.getSubmodel(option.getStocks());
+    SamplingOptions matched = sampling;
+    matched.momentMatching = true;
+    SamplingOptions unmatched = sampling;
+    unmatched.momentMatching = false;
+
     double total = 0.0;
-    for (int i = 0; i<nTasks; i++) {
-        total += tasks[i]->result;
+    double totalSq = 0.0;
+    for (int i = 0; i < nReplications; i++) {
+        mt19937 rng(i + 1);
+        mt19937 copy = rng;
+        MarketSimulation sim = subModel->generateRiskNeutralPricePaths(
+            rng, dates, nScenarios, matched);
+        MarketSimulation rawSim = subModel->generateRiskNeutralPricePaths(
+            copy, dates, nScenarios, unmatched);
+        double difference = meanCols(weightedPayoffs(option, sim)).asScalar()
+            - meanCols(weightedPayoffs(option, rawSim)).asScalar();
+        total += difference;
+        totalSq += difference*difference;
+    }
+    double r = model.getRiskFreeRate();
+    double T = option.getMaturity() - model.getDate();
+    double discount = exp(-r*T);
+    double mean = total / nReplications;
+    double variance = (totalSq - total*total / nReplications)
+        / (nReplications - 1);
+    standardError = discount*sqrt(variance / nReplications);
+    return discount*mean;
+}
+
+/*  Seed for the random numbers used in pilot runs */
+static const unsigned int PILOT_SEED = 1;
+
+/**
+*   Recover the terminal values of the independent Brownian
+*   motions that generated a risk neutral simulation
+*/
+static Matrix terminalBrownianMotion(
+    const MarketSimulation& sim,
+    const MultiStockModel& model,
+    double T) {
+    vector<string> stocks = model.getStocks();
+    int nStocks = stocks.size();
+    Matrix cov = model.getCovarianceMatrix();
+    const Matrix& A = model.getCholeskyFactor();
+    int nPaths = sim.getStockPrices(0).nRows();
+    Matrix ret(nPaths, nStocks, false);
+    for (int j = 0; j < nStocks; j++) {
+        // the simulation was generated by the model, so its
+        // handles are the model's stock indices
+        const Matrix& prices = sim.getStockPrices(j);
+        double mu = model.getRiskFreeRate() - 0.5*cov(j, j);
+        double offset = log(model.getStockPrice(stocks[j])) + mu*T;
+        const double* finalPrices = prices.begin()
+            + prices.offset(0, prices.nCols() - 1);
+        for (int p = 0; p < nPaths; p++) {
+            ret(p, j) = log(finalPrices[p]) - offset;
+        }
+    }
+    // the log returns are A times the Brownian motion, so
+    // solve by forward substitution
+    for (int p = 0; p < nPaths; p++) {
+        for (int j = 0; j < nStocks; j++) {
+            double s = ret(p, j);
+            for (int k = 0; k < j; k++) {
+                s -= A(j, k)*ret(p, k);
+            }
+            ret(p, j) = s / A(j, j);
+        }
     }
-    return total / nTasks;
+    return ret;
+}
+
+/**
+*   Choose the drift shift by the cross entropy method. The
+*   optimal importance sampling density is proportional to the
+*   payoff times the normal density, so we use the shift which
+*   matches the payoff weighted mean of the terminal Brownian
+*   motion estimated from a pilot run. If the pilot run sees no
+*   payoff at all we first search along each axis for a shift
+*   under which the payoff is observed.
+*/
+vector<double> MonteCarloPricer::optimalDriftShift(
+    const ContinuousTimeOption& option,
+    const MultiStockModel& model) const {
+    vector<double> dates = timeGrid(option, model, nSteps);
+    SPCMultiStockModel subModel = model.getSubmodel(option.getStocks());
+    int nStocks = subModel->getStocks().size();
+    double T = option.getMaturity() - model.getDate();
+    ASSERT(T > 0);
+
+    SamplingOptions pilot;
+    pilot.driftShift = vector<double>(nStocks, 0.0);
+    // use different random numbers to the pricing run
+    // so that the shift is independent of the paths
+    mt19937 rng(PILOT_SEED);
+
+    // run a pilot with the current shift returning the
+    // total weight observed
+    vector<double> weightedMean(nStocks, 0.0);
+    auto runPilot = [&]() {
+        MarketSimulation sim = subModel->generateRiskNeutralPricePaths(
+            rng, dates, nPilotScenarios, pilot);
+        Matrix weights = weightedPayoffs(option, sim);
+        Matrix W = terminalBrownianMotion(sim, *subModel, T);
+        double totalWeight = 0.0;
+        fill(weightedMean.begin(), weightedMean.end(), 0.0);
+        for (int p = 0; p < nPilotScenarios; p++) {
+            double w = fabs(weights(p));
+            totalWeight += w;
+            for (int j = 0; j < nStocks; j++) {
+                weightedMean[j] += w*W(p, j);
+            }
+        }
+        if (totalWeight > 0) {
+            for (int j = 0; j < nStocks; j++) {
+                weightedMean[j] /= totalWeight;
+            }
+        }
+        return totalWeight;
+    };
+
+    double totalWeight = runPilot();
+    double scale = 1.0 / sqrt(T);
+    for (int size = 1; size <= 4 && totalWeight == 0.0; size *= 2) {
+        for (int j = 0; j < nStocks && totalWeight == 0.0; j++) {
+            for (int sign = 1; sign >= -1 && totalWeight == 0.0; sign -= 2) {
+                fill(pilot.driftShift.begin(), pilot.driftShift.end(), 0.0);
+                pilot.driftShift[j] = sign*size*scale;
+                totalWeight = runPilot();
+            }
+        }
+    }
+    if (totalWeight == 0.0) {
+        // we can't find the payoff, so don't shift
+        return vector<double>(nStocks, 0.0);
+    }
+    // each pilot refines the shift, so the last update
+    // needs no pilot of its own
+    const int nIterations = 3;
+    for (int i = 0; i < nIterations; i++) {
+        vector<double> previous = pilot.driftShift;
+        for (int j = 0; j < nStocks; j++) {
+            pilot.driftShift[j] = weightedMean[j] / T;
+        }
+        if (i + 1 < nIterations && runPilot() == 0.0) {
+            // the new shift misses the payoff, so keep the
+            // last one that found it
+            return previous;
+        }
+    }
+    return pilot.driftShift;
 }
 
 //////////////////////////////////////
@@ -162,6 +1436,734 @@ static void testPriceCallOption() {
     ASSERT_APPROX_EQUAL( price2, price, 0.000001);
 }
 
+/*  Does evaluating the option throw? */
+static bool evaluateThrows( const MonteCarloPricer& pricer,
+        const ContinuousTimeOption& option,
+        const MultiStockModel& model ) {
+    try {
+        pricer.evaluate( option, model );
+    } catch (const runtime_error&) {
+        return true;
+    }
+    return false;
+}
+
+static void testStratifiedSampling() {
+    CallOption c;
+    c.setStrike( 110 );
+    c.setMaturity( 1 );
+
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+
+    MultiStockModel msm(m);
+    double expected = c.price( msm );
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 20000;
+    PricingResult plain = pricer.evaluate( c, msm );
+    ASSERT_APPROX_EQUAL( plain.price, expected, 4*plain.standardError );
+
+    pricer.sampling.method = STRATIFIED;
+    PricingResult stratified = pricer.evaluate( c, msm );
+    ASSERT_APPROX_EQUAL( stratified.price, expected,
+        4*stratified.standardError );
+    ASSERT( stratified.standardError < 0.2*plain.standardError );
+
+    // the per stratum variance estimate combines across tasks
+    pricer.nTasks = 4;
+    PricingResult multiThreaded = pricer.evaluate( c, msm );
+    ASSERT_APPROX_EQUAL( multiThreaded.price, expected,
+        4*multiThreaded.standardError );
+    ASSERT_APPROX_EQUAL( multiThreaded.standardError,
+        stratified.standardError, 0.2*stratified.standardError );
+
+    // stratifying the terminal value also helps path
+    // dependent options
+    UpAndOutOption knockout;
+    knockout.setStrike( 100 );
+    knockout.setBarrier( 1000 );
+    knockout.setMaturity( 1 );
+    pricer.nSteps = 5;
+    PricingResult knockoutResult = pricer.evaluate( knockout, msm );
+    CallOption call;
+    call.setStrike( 100 );
+    call.setMaturity( 1 );
+    double callPrice = call.price( msm );
+    ASSERT_APPROX_EQUAL( knockoutResult.price, callPrice,
+        4*knockoutResult.standardError );
+
+    // a batch smaller than a block of strata is rounded up
+    pricer.nSteps = 1;
+    pricer.batchSize = 30;
+    pricer.sampling.nStrata = 50;
+    PricingResult smallBatches = pricer.evaluate( c, msm );
+    ASSERT( smallBatches.batchSize == 50 );
+    ASSERT_APPROX_EQUAL( smallBatches.price, expected,
+        4*smallBatches.standardError );
+
+    // too few scenarios to estimate the variance of every
+    // stratum, or no strata at all, are rejected
+    pricer.nScenarios = 99;
+    ASSERT( evaluateThrows( pricer, c, msm ) );
+    pricer.nScenarios = 20000;
+    pricer.sampling.nStrata = 0;
+    ASSERT( evaluateThrows( pricer, c, msm ) );
+}
+
+static void testLatinHypercubeSampling() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    msm.setRiskFreeRate(0.05);
+    auto stocks = msm.getStocks();
+
+    MargrabeOption o;
+    o.stock1 = stocks[0];
+    o.stock2 = stocks[1];
+    o.maturity = 1.0;
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 50000;
+    PricingResult plain = pricer.evaluate( o, msm );
+
+    pricer.sampling.method = LATIN_HYPERCUBE;
+    pricer.sampling.nDimensions = 2;
+    PricingResult lhs = pricer.evaluate( o, msm );
+    ASSERT( lhs.standardError < plain.standardError );
+    ASSERT_APPROX_EQUAL( lhs.price, plain.price, 4*plain.standardError );
+}
+
+static void testMomentMatching() {
+    CallOption c;
+    c.setStrike( 100 );
+    c.setMaturity( 0.25 );
+
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+
+    MultiStockModel msm(m);
+    double expected = c.price( msm );
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 10000;
+    pricer.sampling.momentMatching = true;
+    double price = pricer.price( c, msm );
+    ASSERT_APPROX_EQUAL( price, expected, 0.05 );
+
+    // the bias is far smaller than the sampling error
+    pricer.nScenarios = 1000;
+    double biasError;
+    double bias = pricer.momentMatchingBias( c, msm, 20, biasError );
+    ASSERT( biasError > 0.0 );
+    ASSERT_APPROX_EQUAL( bias, 0.0, 4*biasError + 0.01 );
+}
+
+static void testImportanceSampling() {
+    CallOption c;
+    c.setStrike( 160 );
+    c.setMaturity( 1 );
+
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+
+    MultiStockModel msm(m);
+    double expected = c.price( msm );
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 10000;
+    PricingResult plain = pricer.evaluate( c, msm );
+
+    pricer.chooseDriftShift = true;
+    vector<double> shift = pricer.optimalDriftShift( c, msm );
+    ASSERT( shift.size()==1 );
+    ASSERT( shift[0] > 1.0 );
+    PricingResult shifted = pricer.evaluate( c, msm );
+    ASSERT_APPROX_EQUAL( shifted.price, expected, 4*shifted.standardError );
+    ASSERT( shifted.standardError < 0.1*plain.standardError );
+
+    // an explicit shift can also be given
+    pricer.chooseDriftShift = false;
+    pricer.sampling.driftShift = shift;
+    PricingResult explicitShift = pricer.evaluate( c, msm );
+    ASSERT_APPROX_EQUAL( explicitShift.price, expected,
+        4*explicitShift.standardError );
+
+    // the shift also works for path dependent options
+    UpAndOutOption knockout;
+    knockout.setStrike( 140 );
+    knockout.setBarrier( 170 );
+    knockout.setMaturity( 1 );
+    pricer.nSteps = 20;
+    pricer.sampling.driftShift.clear();
+    PricingResult knockoutPlain = pricer.evaluate( knockout, msm );
+    pricer.chooseDriftShift = true;
+    PricingResult knockoutShifted = pricer.evaluate( knockout, msm );
+    ASSERT( knockoutShifted.standardError < knockoutPlain.standardError );
+    ASSERT_APPROX_EQUAL( knockoutShifted.price, knockoutPlain.price,
+        4*(knockoutShifted.standardError + knockoutPlain.standardError) );
+}
+
+static void testPricingResult() {
+    CallOption c;
+    c.setStrike( 110 );
+    c.setMaturity( 1 );
+
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+
+    MultiStockModel msm(m);
+    double expected = c.price( msm );
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 100000;
+    PricingResult result = pricer.evaluate( c, msm );
+    ASSERT( result.nScenarios == 100000 );
+    ASSERT( result.elapsedSeconds >= 0.0 );
+    ASSERT( result.lowerBound < result.price );
+    ASSERT( result.upperBound > result.price );
+    ASSERT_APPROX_EQUAL( result.upperBound - result.price,
+        1.96*result.standardError, 0.01*result.standardError );
+    ASSERT_APPROX_EQUAL( result.price, expected, 4*result.standardError );
+}
+
+static void testAdaptiveStopping() {
+    CallOption c;
+    c.setStrike( 110 );
+    c.setMaturity( 1 );
+
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+
+    MultiStockModel msm(m);
+    double expected = c.price( msm );
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 10000000;
+    pricer.adaptiveBatchSize = 1000;
+    pricer.targetStandardError = 0.05;
+    PricingResult result = pricer.evaluate( c, msm );
+    ASSERT( result.standardError <= 0.05 );
+    ASSERT( result.nScenarios < 100000 );
+    ASSERT_APPROX_EQUAL( result.price, expected, 4*result.standardError );
+
+    pricer.targetStandardError = 0.0;
+    pricer.targetRelativeError = 0.01;
+    pricer.nTasks = 4;
+    result = pricer.evaluate( c, msm );
+    ASSERT( result.standardError <= 0.01*result.price );
+    ASSERT( result.nScenarios < 1000000 );
+
+    // the maximum number of scenarios caps the calculation
+    pricer.targetRelativeError = 1e-6;
+    pricer.nScenarios = 20000;
+    result = pricer.evaluate( c, msm );
+    ASSERT( result.nScenarios == 20000 );
+    ASSERT( result.standardError > 1e-6*result.price );
+}
+
+static void testStreamingPathDependentOption() {
+    UpAndOutOption o;
+    o.setStrike( 100 );
+    o.setBarrier( 130 );
+    o.setMaturity( 1 );
+
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+    MultiStockModel msm(m);
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 2000;
+    pricer.nSteps = 1000;
+    double price = pricer.price( o, msm );
+
+    // the streamed payoffs match those computed from stored
+    // paths, drawn from the stream of the only chunk
+    mt19937 rng = chunkStream(0);
+    MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+        rng, 1.0, pricer.nScenarios, pricer.nSteps );
+    double expected = exp(-0.05)*meanCols( o.payoff(
+        *sim.getStockPrices( o.getStock() ) ) ).asScalar();
+    ASSERT_APPROX_EQUAL( price, expected, 1e-8 );
+}
+
+static void testChunkedScheduling() {
+    CallOption c;
+    c.setStrike( 110 );
+    c.setMaturity( 1 );
+
+    BlackScholesModel m;
+    m.volatility = 0.1;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+    MultiStockModel msm(m);
+
+    // every scenario is used even when the chunks
+    // don't divide evenly between the tasks
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 10007;
+    pricer.chunkSize = 1000;
+    pricer.nTasks = 3;
+    PricingResult result = pricer.evaluate( c, msm );
+    ASSERT( result.nScenarios == 10007 );
+
+    // each chunk has its own random numbers, so only the
+    // order in which the chunks are summed depends on
+    // the number of tasks
+    pricer.nTasks = 1;
+    PricingResult single = pricer.evaluate( c, msm );
+    ASSERT_APPROX_EQUAL( result.price, single.price, 1e-10 );
+    ASSERT_APPROX_EQUAL( result.standardError,
+        single.standardError, 1e-10 );
+}
+
+static void testBatchSize() {
+    UpAndOutOption o;
+    o.setStrike( 100 );
+    o.setBarrier( 130 );
+    o.setMaturity( 1 );
+    CallOption c;
+    c.setStrike( 100 );
+    c.setMaturity( 1 );
+    MultiStockModel msm = MultiStockModel::createTestModel();
+
+    MonteCarloPricer pricer;
+    pricer.nSteps = 1000;
+    // options which only need their final prices can
+    // use the whole memory budget
+    int callBatch = pricer.chooseBatchSize( c, msm );
+    int barrierBatch = pricer.chooseBatchSize( o, msm );
+    ASSERT( callBatch > barrierBatch );
+    pricer.memoryBudget *= 2;
+    ASSERT( pricer.chooseBatchSize( c, msm ) > callBatch );
+
+    // the batch size can be overridden, and is reported
+    pricer.batchSize = 123;
+    pricer.nScenarios = 1000;
+    ASSERT( pricer.chooseBatchSize( o, msm ) == 123 );
+    PricingResult result = pricer.evaluate( c, msm );
+    ASSERT( result.batchSize == 123 );
+    ASSERT( result.nScenarios == 1000 );
+
+    // a small memory budget gives smaller batches
+    pricer.batchSize = 0;
+    pricer.nScenarios = 40000;
+    pricer.memoryBudget = 5000 * 4 * sizeof(double);
+    ASSERT( pricer.chooseBatchSize( c, msm ) == 5000 );
+    ASSERT( pricer.evaluate( c, msm ).batchSize == 5000 );
+    // while batches larger than a chunk need larger chunks
+    pricer.memoryBudget = 20000 * 4 * sizeof(double);
+    ASSERT( pricer.chooseBatchSize( c, msm ) == 20000 );
+    ASSERT( pricer.evaluate( c, msm ).batchSize == pricer.chunkSize );
+    pricer.chunkSize = 20000;
+    result = pricer.evaluate( c, msm );
+    ASSERT( result.batchSize == 20000 );
+    ASSERT( result.nScenarios == 40000 );
+}
+
+static void testReproducible() {
+    UpAndOutOption o;
+    o.setStrike( 100 );
+    o.setBarrier( 130 );
+    o.setMaturity( 1 );
+    MargrabeOption margrabe;
+    margrabe.stock1 = "Bigbank";
+    margrabe.stock2 = "Acme";
+    margrabe.maturity = 1.0;
+    MultiStockModel msm = MultiStockModel::createTestModel();
+
+    MonteCarloPricer pricer;
+    pricer.reproducible = true;
+    pricer.nScenarios = 20000;
+    pricer.chunkSize = 1000;
+    pricer.nSteps = 50;
+    for (int method = PSEUDO_RANDOM; method <= STRATIFIED; method++) {
+        pricer.sampling.method = (SamplingMethod)method;
+        for (const ContinuousTimeOption* option :
+                { (const ContinuousTimeOption*)&o,
+                  (const ContinuousTimeOption*)&margrabe }) {
+            pricer.nTasks = 1;
+            PricingResult single = pricer.evaluate( *option, msm );
+            for (int nTasks : { 3, 8 }) {
+                pricer.nTasks = nTasks;
+                PricingResult result = pricer.evaluate( *option, msm );
+                ASSERT( result.price == single.price );
+                ASSERT( result.standardError == single.standardError );
+            }
+        }
+    }
+
+    // stopping early is reproducible too
+    pricer.sampling.method = PSEUDO_RANDOM;
+    pricer.targetRelativeError = 0.02;
+    pricer.nTasks = 1;
+    PricingResult single = pricer.evaluate( margrabe, msm );
+    pricer.nTasks = 4;
+    PricingResult result = pricer.evaluate( margrabe, msm );
+    ASSERT( result.nScenarios < pricer.nScenarios );
+    ASSERT( result.nScenarios == single.nScenarios );
+    ASSERT( result.price == single.price );
+}
+
+static void testGreeks() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    MargrabeOption margrabe;
+    margrabe.stock1 = "Bigbank";
+    margrabe.stock2 = "Acme";
+    margrabe.maturity = 1.0;
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 50000;
+    pricer.computeGreeks = true;
+
+    // Margrabe's formula doesn't depend on the risk free rate
+    Matrix cov = msm.getCovarianceMatrix();
+    double sigma = sqrt( cov(0,0) + cov(1,1) - 2*cov(0,1) );
+    double d1 = (log( 200.0/100.0 ) + 0.5*sigma*sigma) / sigma;
+    double d2 = d1 - sigma;
+    PricingResult result = pricer.evaluate( margrabe, msm );
+    ASSERT( result.deltas.size() == 2 );
+    ASSERT( result.vegas.size() == 2 );
+    ASSERT_APPROX_EQUAL( result.deltas["Bigbank"], normcdf( d1 ), 0.01 );
+    ASSERT_APPROX_EQUAL( result.deltas["Acme"], -normcdf( d2 ), 0.01 );
+    ASSERT_APPROX_EQUAL( result.rho, 0.0, 0.5 );
+
+    // a knockout option uses likelihood ratios, compare
+    // with bumping the stock price
+    UpAndOutOption o;
+    o.setStrike( 100 );
+    o.setBarrier( 130 );
+    o.setMaturity( 1 );
+    BlackScholesModel bsm;
+    bsm.stockPrice = 100;
+    bsm.volatility = 0.2;
+    bsm.riskFreeRate = 0.05;
+    result = pricer.evaluate( o, MultiStockModel( bsm ) );
+    MonteCarloPricer bumpPricer;
+    bumpPricer.nScenarios = 200000;
+    double h = 1.0;
+    BlackScholesModel up = bsm;
+    up.stockPrice += h;
+    BlackScholesModel down = bsm;
+    down.stockPrice -= h;
+    double expected = (bumpPricer.price( o, up )
+        - bumpPricer.price( o, down )) / (2*h);
+    ASSERT_APPROX_EQUAL( result.deltas[o.getStock()], expected, 0.03 );
+}
+
+static void testAdjoints() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    MargrabeOption margrabe;
+    margrabe.stock1 = "Bigbank";
+    margrabe.stock2 = "Acme";
+    margrabe.maturity = 1.0;
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 100000;
+    pricer.computeAdjoints = true;
+    pricer.nTasks = 2;
+    PricingResult result = pricer.evaluate( margrabe, msm );
+
+    // Margrabe's formula depends on the covariance matrix through
+    // the variance of the log of the ratio of the prices
+    Matrix cov = msm.getCovarianceMatrix();
+    double sigma = sqrt( cov(0,0) + cov(1,1) - 2*cov(0,1) );
+    double d1 = (log( 200.0/100.0 ) + 0.5*sigma*sigma) / sigma;
+    double d2 = d1 - sigma;
+    double price = 200.0*normcdf( d1 ) - 100.0*normcdf( d2 );
+    double dPriceByVariance = 200.0*exp( -0.5*d1*d1 )
+        / (sqrt( 8*PI )*sigma);
+    ASSERT_APPROX_EQUAL( result.price, price, 0.5 );
+    ASSERT_APPROX_EQUAL( result.deltas["Bigbank"], normcdf( d1 ), 0.01 );
+    ASSERT_APPROX_EQUAL( result.deltas["Acme"], -normcdf( d2 ), 0.01 );
+    ASSERT_APPROX_EQUAL( result.rho, 0.0, 0.5 );
+    // the sub model orders the stocks alphabetically
+    Matrix expected( 2, 2 );
+    expected(0,0) = dPriceByVariance;
+    expected(1,1) = dPriceByVariance;
+    expected(0,1) = -2*dPriceByVariance;
+    expected(1,0) = -2*dPriceByVariance;
+    expected.assertEquals( result.covarianceSensitivities, 5.0 );
+
+    // the vegas agree with the pathwise vegas
+    MonteCarloPricer greeksPricer;
+    greeksPricer.computeGreeks = true;
+    PricingResult greeks = greeksPricer.evaluate( margrabe, msm );
+    for (auto& stock : margrabe.getStocks()) {
+        ASSERT_APPROX_EQUAL( result.vegas[stock], greeks.vegas[stock], 1.0 );
+    }
+}
+
+static void testAdjointsRejected() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    MargrabeOption margrabe;
+    margrabe.stock1 = "Bigbank";
+    margrabe.stock2 = "Acme";
+    margrabe.maturity = 1.0;
+    UpAndOutOption knockout;
+    knockout.setStrike( 100 );
+    knockout.setBarrier( 130 );
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 1000;
+    pricer.computeAdjoints = true;
+    ASSERT( !evaluateThrows( pricer, margrabe, msm ) );
+    // an option without an adjoint payoff
+    ASSERT( evaluateThrows( pricer, knockout, msm ) );
+    // sampling the tape can't follow
+    pricer.sampling.method = STRATIFIED;
+    ASSERT( evaluateThrows( pricer, margrabe, msm ) );
+    pricer.sampling = SamplingOptions();
+    pricer.sampling.momentMatching = true;
+    ASSERT( evaluateThrows( pricer, margrabe, msm ) );
+    pricer.sampling = SamplingOptions();
+    pricer.sampling.driftShift = vector<double>({ 0.1, 0.1 });
+    ASSERT( evaluateThrows( pricer, margrabe, msm ) );
+}
+
+static void testPriceMany() {
+    BlackScholesModel bsm;
+    bsm.stockPrice = 100;
+    bsm.volatility = 0.2;
+    bsm.riskFreeRate = 0.05;
+    MultiStockModel msm( bsm );
+
+    vector<SPCContinuousTimeOption> options;
+    vector<double> strikes({ 90, 100, 110, 100 });
+    vector<double> maturities({ 1.0, 1.0, 1.0, 0.5 });
+    for (int k = 0; k < (int)strikes.size(); k++) {
+        shared_ptr<CallOption> c = make_shared<CallOption>();
+        c->setStrike( strikes[k] );
+        c->setMaturity( maturities[k] );
+        options.push_back( c );
+    }
+    shared_ptr<UpAndOutOption> barrier = make_shared<UpAndOutOption>();
+    barrier->setStrike( 100 );
+    barrier->setBarrier( 130 );
+    barrier->setMaturity( 0.75 );
+    options.push_back( barrier );
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 50000;
+    pricer.nTasks = 2;
+    vector<PricingResult> results = pricer.priceMany( options, msm );
+    ASSERT( results.size() == options.size() );
+    for (int k = 0; k < (int)options.size(); k++) {
+        const PricingResult& result = results[k];
+        ASSERT( result.nScenarios == 50000 );
+        ASSERT( result.standardError > 0 );
+        // each option is priced with its own maturity
+        double expected = k < 4 ? options[k]->price( msm )
+            : pricer.price( *barrier, msm );
+        ASSERT_APPROX_EQUAL( result.price, expected,
+            5*result.standardError );
+    }
+    // the calls see the same paths, so their prices decrease
+    // with the strike
+    ASSERT( results[0].price > results[1].price );
+    ASSERT( results[1].price > results[2].price );
+}
+
+static void testReuseUnitPaths() {
+    CallOption c;
+    c.setStrike( 100 );
+    c.setMaturity( 1 );
+    BlackScholesModel bsm;
+    bsm.stockPrice = 100;
+    bsm.volatility = 0.2;
+    bsm.riskFreeRate = 0.05;
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 20000;
+    pricer.chunkSize = 5000;
+    pricer.nTasks = 2;
+    pricer.reuseUnitPaths = true;
+    pricer.price( c, bsm );
+    int nEntries = pricer.unitPaths->size();
+    ASSERT( nEntries > 0 );
+
+    // a spot ladder reuses the same paths
+    for (double spot : { 90.0, 110.0 }) {
+        BlackScholesModel moved = bsm;
+        moved.stockPrice = spot;
+        PricingResult result = pricer.evaluate( c, MultiStockModel( moved ) );
+        ASSERT( pricer.unitPaths->size() == nEntries );
+        ASSERT_APPROX_EQUAL( result.price, c.price( MultiStockModel( moved ) ),
+            4*result.standardError );
+
+        // which are those a fresh cache would draw
+        MonteCarloPricer fresh = pricer;
+        fresh.unitPaths = make_shared<UnitPathCache>();
+        ASSERT_APPROX_EQUAL( fresh.price( c, moved ), result.price, 1e-8 );
+    }
+}
+
+static void testSharedUnitPaths() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    vector<string> stocks = msm.getStocks();
+    UpAndOutOption c;
+    c.setStock( stocks[0] );
+    c.setStrike( msm.getStockPrice( stocks[0] ) );
+    c.setBarrier( 2 * msm.getStockPrice( stocks[0] ) );
+    c.setMaturity( 1 );
+
+    SPUnitPathCache cache = make_shared<UnitPathCache>();
+    {
+        UnitPathScope scope( cache );
+        // pricers built elsewhere keep their defaults
+        ASSERT( !MonteCarloPricer().reuseUnitPaths );
+        c.price( msm );
+        ASSERT( cache->getStatistics().misses > 0 );
+        ASSERT( cache->getStatistics().hits == 0 );
+
+        // an inner scope ends by restoring the cache
+        {
+            UnitPathScope inner( make_shared<UnitPathCache>() );
+            ASSERT( UnitPathScope::current() != cache );
+        }
+        ASSERT( UnitPathScope::current() == cache );
+
+        // pricing again, with a new pricer, hits the cache and
+        // gives the price of a pricer with a cache of its own
+        MonteCarloPricer pricer;
+        pricer.reuseUnitPaths = true;
+        pricer.unitPaths = make_shared<UnitPathCache>();
+        ASSERT_APPROX_EQUAL( c.price( msm ), pricer.price( c, msm ), 1e-10 );
+        ASSERT( cache->getStatistics().hits
+            == cache->getStatistics().misses );
+    }
+    ASSERT( !UnitPathScope::current() );
+}
+
+static void testPriceAsync() {
+    shared_ptr<CallOption> c = make_shared<CallOption>();
+    c->setStrike( 100 );
+    c->setMaturity( 1 );
+    BlackScholesModel bsm;
+    bsm.stockPrice = 100;
+    bsm.volatility = 0.2;
+    bsm.riskFreeRate = 0.05;
+    MultiStockModel model( bsm );
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 40000;
+    pricer.chunkSize = 5000;
+    pricer.nTasks = 2;
+    SPPricingControl control = make_shared<PricingControl>();
+    mutex mtx;
+    vector<PricingProgress> progress;
+    control->onProgress = [&]( const PricingProgress& p ) {
+        lock_guard<mutex> lock( mtx );
+        progress.push_back( p );
+    };
+    PricingHandle handle = pricer.priceAsync( c, model, control );
+    PricingResult result = handle.get();
+    ASSERT( result.nScenarios == 40000 );
+    ASSERT( result.completed );
+    ASSERT_APPROX_EQUAL( result.price, c->price( model ),
+        4*result.standardError );
+    ASSERT( !progress.empty() );
+    ASSERT( progress.back().nScenarios == 40000 );
+    ASSERT_APPROX_EQUAL( progress.back().price, result.price, 1e-8 );
+    ASSERT( progress.front().standardError > result.standardError );
+
+    // a deadline stops a long calculation early
+    pricer.nScenarios = 100000000;
+    SPPricingControl deadline = make_shared<PricingControl>();
+    deadline->setDeadline( 0.1 );
+    PricingResult partial = pricer.priceAsync( c, model, deadline ).get();
+    ASSERT( partial.nScenarios > 0 );
+    ASSERT( partial.nScenarios < pricer.nScenarios );
+    ASSERT_APPROX_EQUAL( partial.price, c->price( model ),
+        4*partial.standardError );
+    ASSERT( !partial.completed );
+
+    // as does cancelling
+    PricingHandle cancelled = pricer.priceAsync( c, model );
+    cancelled.cancel();
+    ASSERT( cancelled.waitFor( 60.0 ) );
+    ASSERT( cancelled.get().nScenarios < pricer.nScenarios );
+    ASSERT( !cancelled.get().completed );
+}
+
+static void testAnytime() {
+    CallOption c;
+    c.setStrike( 110 );
+    c.setMaturity( 1 );
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+    MultiStockModel msm( m );
+    double expected = c.price( msm );
+
+    MonteCarloPricer pricer;
+    for (int nTasks : { 1, 4 }) {
+        pricer.nTasks = nTasks;
+        PricingResult result = pricer.evaluateWithin( c, msm, 0.02 );
+        INFO( "Anytime pricing with " << nTasks << " tasks simulated "
+            << result.nScenarios << " scenarios in "
+            << result.elapsedSeconds << "s" );
+        ASSERT( result.nScenarios > 0 );
+        // running to the time allowed completes the calculation
+        ASSERT( result.completed );
+        // generous bounds, as a loaded machine can deschedule a
+        // task for far longer than a batch takes
+        ASSERT( result.elapsedSeconds >= 0.01 );
+        ASSERT( result.elapsedSeconds < 1.0 );
+        ASSERT_APPROX_EQUAL( result.price, expected,
+            4*result.standardError );
+    }
+
+    // a longer budget gives a more accurate estimate
+    pricer.nTasks = 1;
+    PricingResult quick = pricer.evaluateWithin( c, msm, 0.01 );
+    PricingResult slow = pricer.evaluateWithin( c, msm, 0.1 );
+    ASSERT( slow.nScenarios > quick.nScenarios );
+    ASSERT( slow.standardError < quick.standardError );
+
+    // stratified batches keep whole blocks of strata
+    pricer.sampling.method = STRATIFIED;
+    pricer.sampling.nStrata = 10;
+    PricingResult stratified = pricer.evaluateWithin( c, msm, 0.02 );
+    ASSERT( stratified.nScenarios % 10 == 0 );
+    ASSERT_APPROX_EQUAL( stratified.price, expected,
+        4*stratified.standardError );
+
+    // the scenarios run depend on the time, so can't be reproduced
+    pricer.reproducible = true;
+    pricer.anytimeSeconds = 0.02;
+    ASSERT( evaluateThrows( pricer, c, msm ) );
+}
+
 void testMonteCarloPricer() {
     TEST( testPriceCallOption );
+    TEST( testStratifiedSampling );
+    TEST( testLatinHypercubeSampling );
+    TEST( testMomentMatching );
+    TEST( testImportanceSampling );
+    TEST( testPricingResult );
+    TEST( testAdaptiveStopping );
+    TEST( testStreamingPathDependentOption );
+    TEST( testChunkedScheduling );
+    TEST( testBatchSize );
+    TEST( testReproducible );
+    TEST( testGreeks );
+    TEST( testAdjoints );
+    TEST( testAdjointsRejected );
+    TEST( testPriceMany );
+    TEST( testReuseUnitPaths );
+    TEST( testSharedUnitPaths );
+    TEST( testPriceAsync );
+    TEST( testAnytime );
 }
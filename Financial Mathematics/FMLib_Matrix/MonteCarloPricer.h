@@ -3,23 +3,177 @@
 #include "stdafx.h"
 #include "ContinuousTimeOption.h"
 #include "MultiStockModel.h"
+#include "SamplingOptions.h"
+#include "PricingResult.h"
+#include "PricingHandle.h"
+#include "UnitPathCache.h"
 
 class MonteCarloPricer {
 public:
     /*  Constructor */
     MonteCarloPricer();
-    /*  Number of scenarios */
+    /*  Number of scenarios, or the maximum number of
+        scenarios when a target error is set */
     int nScenarios;
-    /*  The number of steps in the calculation */
+    /*  The number of steps in the calculation for options
+        which are monitored continuously */
     int nSteps;
     /*  The number of concurrent tasks to run */
     int nTasks;
+    /*  The scenarios are divided into chunks of this many
+        scenarios, handed to the tasks as they become free.
+        Each chunk draws from its own stream of random numbers */
+    int chunkSize;
+    /*  The number of scenarios each task simulates at once,
+        or zero to choose it automatically. Batches never exceed
+        a chunk, so raise chunkSize too for larger batches. When
+        stratifying it is rounded up to whole blocks of strata */
+    int batchSize;
+    /*  Give bit for bit the same price whatever the number of
+        tasks or the host. Each chunk is then simulated in one
+        batch unless batchSize is set, and the chunks are
+        combined in order. Only a time limit can change
+        the result */
+    bool reproducible;
+    /*  Compute the delta and vega of each stock and the rho
+        of the option from the same paths as the price. These
+        are pathwise derivatives, through the adjoint payoff,
+        if the payoff is a continuous function of the final
+        prices with an adjoint payoff, otherwise likelihood
+        ratio estimates */
+    bool computeGreeks;
+    /*  Compute the delta and vega of each stock, the rho and the
+        sensitivity to each covariance by adjoint differentiation.
+        Each batch is simulated on a tape and swept back through
+        before the next, so the cost is a small multiple of pricing
+        whatever the number of stocks. Needs an option with an
+        adjoint payoff and pseudo random sampling */
+    bool computeAdjoints;
+    /*  Keep the paths simulated, with unit stock prices, in
+        unitPaths and rescale them by the stock prices when only
+        these have changed. Each batch then draws from its own
+        stream of random numbers, and its stored steps count
+        against memoryBudget when the batch size is chosen */
+    bool reuseUnitPaths;
+    /*  Where the unit paths are kept. Copies of the
+        pricer share the cache */
+    SPUnitPathCache unitPaths;
+    /*  The memory in bytes the batches being simulated may
+        use, when the batch size is chosen automatically. Only
+        a budget which allows batches smaller than chunkSize
+        changes the batches simulated */
+    double memoryBudget;
+    /*  How the random numbers are sampled */
+    SamplingOptions sampling;
+    /*  Log an estimate of the bias introduced by
+        moment matching whenever we price */
+    bool reportMomentMatchingBias;
+    /*  Choose a drift shift for importance sampling
+        using a pilot run */
+    bool chooseDriftShift;
+    /*  The number of scenarios in each pilot run */
+    int nPilotScenarios;
+    /*  The confidence level of the confidence interval */
+    double confidenceLevel;
+    /*  Stop once the standard error is below this, if positive */
+    double targetStandardError;
+    /*  Stop once the standard error relative to the price
+        is below this, if positive */
+    double targetRelativeError;
+    /*  Stop after this many seconds, if positive */
+    double maxSeconds;
+    /*  The number of scenarios to simulate on each task
+        between checks of the error */
+    int adaptiveBatchSize;
+    /*  If positive, simulate as many scenarios as fit in this many
+        seconds, ignoring nScenarios, and return the estimate at
+        the deadline. Each task measures the cost of a scenario
+        and sizes its batches so that they take a small fraction
+        of the time, cutting the last to the time left, so the
+        deadline is overshot by little more than one small batch.
+        Can't be combined with reproducible */
+    double anytimeSeconds;
+    /*  If set, lets other threads cancel the calculation, bounds
+        it by a deadline and receives its progress */
+    SPPricingControl control;
     /*  Price a path dependent option */
     double price( const ContinuousTimeOption& option,
                   const BlackScholesModel& model ) const;
     /*  Price a path dependent option */
     double price(const ContinuousTimeOption& option,
         const MultiStockModel& model) const;
+    /*  Price a path dependent option returning the price
+        together with an estimate of its accuracy */
+    PricingResult evaluate(const ContinuousTimeOption& option,
+        const MultiStockModel& model) const;
+    /*  Start pricing the option on the shared thread pool,
+        returning at once. The pricer and model are copied, so
+        may be changed while the price is computed. The control,
+        if given, sets the deadline and progress callback */
+    PricingHandle priceAsync(SPCContinuousTimeOption option,
+        const MultiStockModel& model,
+        SPPricingControl control = SPPricingControl()) const;
+    /*  Price the option with as many scenarios as
+        fit in the given number of seconds */
+    PricingResult evaluateWithin(const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        double seconds) const;
+    /*  Price several options on one set of paths, returning a
+        price and standard error for each. The paths are simulated
+        once for all the stocks up to the longest maturity, so
+        this costs little more than pricing the slowest option */
+    std::vector<PricingResult> priceMany(
+        const std::vector<SPCContinuousTimeOption>& options,
+        const MultiStockModel& model) const;
+    /*  The number of scenarios each task simulates at once.
+        Unless batchSize is set, this keeps the prices of every
+        path in the batch in the cache when simulating step by
+        step, and keeps the stored paths within the memory budget
+        for options that need them. The batches simulated are
+        then capped at chunkSize, since the chunks fix the random
+        numbers each scenario receives, so that the price doesn't
+        depend on the number of tasks */
+    int chooseBatchSize(const ContinuousTimeOption& option,
+        const MultiStockModel& model) const;
+    /*  Is the error small enough that we can stop
+        adding scenarios? */
+    bool isAccurateEnough(double price,
+        double standardError) const;
+    /*  Estimate the bias in the price introduced by moment
+        matching by comparing prices with and without moment
+        matching on the same random numbers */
+    double momentMatchingBias(const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        int nReplications,
+        double& standardError) const;
+    /*  Choose a drift shift for the independent Brownian motions
+        driving the given option's stocks which makes the
+        payoff less rare */
+    std::vector<double> optimalDriftShift(
+        const ContinuousTimeOption& option,
+        const MultiStockModel& model) const;
+};
+
+/**
+ *  While one of these exists, the pricers which
+ *  ContinuousTimeOptionBase::price builds on the same thread,
+ *  and so those of Portfolio::price, reuse unit paths from the
+ *  given cache. This lets them share paths between options
+ *  and between calls. Pricers built elsewhere are unaffected,
+ *  and the previous cache, if any, is restored when it is
+ *  destroyed
+ */
+class UnitPathScope {
+public:
+    explicit UnitPathScope(SPUnitPathCache cache);
+    ~UnitPathScope();
+    /*  The cache of the innermost scope on this thread,
+        or null if there is none */
+    static SPUnitPathCache current();
+private:
+    SPUnitPathCache previous;
+    UnitPathScope(const UnitPathScope&) = delete;
+    UnitPathScope& operator=(const UnitPathScope&) = delete;
 };
 
 void testMonteCarloPricer();
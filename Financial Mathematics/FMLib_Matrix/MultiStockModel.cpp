@@ -8,7 +8,7 @@ using namespace std;
 string const MultiStockModel::DEFAULT_STOCK = "Acme";
 
 MultiStockModel::MultiStockModel(
-    const BlackScholesModel& bsm) {
+    const BlackScholesModel& bsm) : factorModel(false) {
 
     int nStocks = 1;
     stockCodeToIndex[DEFAULT_STOCK] = 0;
@@ -22,13 +22,17 @@ MultiStockModel::MultiStockModel(
     stockPrices(0) = bsm.stockPrice;
     riskFreeRate = bsm.riskFreeRate;
     date = bsm.date;
+    invalidateFactors();
 }
 
 
 MultiStockModel::MultiStockModel(std::vector<std::string> stocks,
         Matrix stockPrices,
         Matrix drifts,
-        Matrix covarianceMatrix) : riskFreeRate(1.0), date(0.0) {
+        Matrix covarianceMatrix) :
+    factorModel(false),
+    riskFreeRate(1.0),
+    date(0.0) {
     int n = stocks.size();
     ASSERT(stockPrices.nRows() == n);
     ASSERT(stockPrices.nCols() == 1);
@@ -44,40 +48,268 @@ MultiStockModel::MultiStockModel(std::vector<std::string> stocks,
     for (auto& s : stocks) {
         stockCodeToIndex[s] = i++;
     }
+    invalidateFactors();
 }
 
-/*  Get a sub model that uses only the given stocks */
-MultiStockModel MultiStockModel::getSubmodel(
-    set<string> stocks) const {
-
+MultiStockModel::MultiStockModel(std::vector<std::string> stocks,
+        Matrix stockPrices,
+        Matrix drifts,
+        Matrix factorLoadings,
+        Matrix specificVariances) :
+    factorModel(true),
+    riskFreeRate(1.0),
+    date(0.0) {
     int n = stocks.size();
-    Matrix drifts(n, 1);
-    Matrix stockPrices(n, 1);
-    vector<string> newStocks(stocks.begin(), stocks.end());
-    Matrix cov(n, n);
+    ASSERT(stockPrices.nRows() == n);
+    ASSERT(stockPrices.nCols() == 1);
+    ASSERT(drifts.nRows() == n);
+    ASSERT(drifts.nCols() == 1);
+    ASSERT(factorLoadings.nRows() == n);
+    ASSERT(specificVariances.nRows() == n);
+    ASSERT(specificVariances.nCols() == 1);
+    this->stockNames = stocks;
+    this->stockPrices = stockPrices;
+    this->drifts = drifts;
+    this->factorLoadings = factorLoadings;
+    this->specificVariances = specificVariances;
+    int i = 0;
+    for (auto& s : stocks) {
+        stockCodeToIndex[s] = i++;
+    }
+    invalidateFactors();
+}
+
+/*  An entry of the covariance matrix */
+double MultiStockModel::covariance(int i, int j) const {
+    if (!factorModel) {
+        return covarianceMatrix(i, j);
+    }
+    double ret = (i == j) ? specificVariances(i) : 0.0;
+    int nFactors = factorLoadings.nCols();
+    for (int f = 0; f < nFactors; f++) {
+        ret += factorLoadings(i, f)*factorLoadings(j, f);
+    }
+    return ret;
+}
+
+/*  The covariance matrix, computed from
+    the factors for a factor model */
+Matrix MultiStockModel::getCovarianceMatrix() const {
+    if (!factorModel) {
+        return covarianceMatrix;
+    }
+    Matrix ret = factorLoadings*transpose(factorLoadings);
+    for (int j = 0; j < ret.nRows(); j++) {
+        ret(j, j) += specificVariances(j);
+    }
+    return ret;
+}
 
-    int newIndex = 0;
+/*  The Cholesky factor, computed the first time
+    it is needed */
+const Matrix& MultiStockModel::getCholeskyFactor() const {
+    Factors& f = *factors;
+    call_once(f.choleskyComputed, [&]() {
+        f.cholesky = chol(getCovarianceMatrix());
+        f.hasCholesky = true;
+    });
+    return f.cholesky;
+}
+
+/*  The hash of the parameters which give the covariances,
+    computed the first time it is needed. Factor models
+    hash their factors, never forming the covariance matrix */
+unsigned long long MultiStockModel::getCovarianceHash() const {
+    Factors& f = *factors;
+    call_once(f.hashComputed, [&]() {
+        unsigned long long hash = hashBytes(&factorModel, sizeof(bool));
+        for (auto& stock : stockNames) {
+            // include the terminating null to separate the names
+            hash = hashBytes(stock.c_str(), stock.size() + 1, hash);
+        }
+        auto hashMatrix = [&hash](const Matrix& m) {
+            int size[2] = { m.nRows(), m.nCols() };
+            hash = hashBytes(size, sizeof(size), hash);
+            hash = hashBytes(m.begin(),
+                (m.end() - m.begin())*sizeof(double), hash);
+        };
+        if (factorModel) {
+            hashMatrix(factorLoadings);
+            hashMatrix(specificVariances);
+        } else {
+            hashMatrix(covarianceMatrix);
+        }
+        f.covarianceHash = hash;
+        f.hasCovarianceHash = true;
+    });
+    return f.covarianceHash;
+}
+
+/*  Apply a low rank shock to the covariance matrix */
+void MultiStockModel::updateCovariance(const Matrix& shocks,
+        bool downdate) {
+    ASSERT(!factorModel);
+    int n = stockPrices.nRows();
+    ASSERT(shocks.nRows() == n);
+    double sign = downdate ? -1.0 : 1.0;
+    Matrix cholesky = getCholeskyFactor();
+    for (int c = 0; c < shocks.nCols(); c++) {
+        Matrix x = shocks.col(c);
+        cholesky = cholUpdate(cholesky, x, downdate);
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                covarianceMatrix(i, j) += sign*x(i)*x(j);
+            }
+        }
+    }
+    invalidateFactors(cholesky);
+}
+
+/*  Add a stock, bordering the covariance matrix */
+void MultiStockModel::addStock(const std::string& stock,
+        double stockPrice,
+        double drift,
+        const Matrix& covariances,
+        double variance) {
+    ASSERT(!factorModel);
+    ASSERT(stockCodeToIndex.find(stock) == stockCodeToIndex.end());
+    int n = stockPrices.nRows();
+    ASSERT(covariances.nRows() == n && covariances.nCols() == 1);
+    Matrix cholesky = cholAppend(getCholeskyFactor(), covariances,
+        variance);
+    Matrix newPrices(n + 1, 1, false);
+    Matrix newDrifts(n + 1, 1, false);
+    Matrix newCovariance(n + 1, n + 1, false);
+    for (int j = 0; j < n; j++) {
+        newPrices(j) = stockPrices(j);
+        newDrifts(j) = drifts(j);
+        for (int i = 0; i < n; i++) {
+            newCovariance(i, j) = covarianceMatrix(i, j);
+        }
+        newCovariance(n, j) = covariances(j);
+        newCovariance(j, n) = covariances(j);
+    }
+    newPrices(n) = stockPrice;
+    newDrifts(n) = drift;
+    newCovariance(n, n) = variance;
+    stockPrices = newPrices;
+    drifts = newDrifts;
+    covarianceMatrix = newCovariance;
+    stockCodeToIndex[stock] = n;
+    stockNames.push_back(stock);
+    invalidateFactors(cholesky);
+}
+
+/*  Get the factors, computing them the first time
+    they are needed */
+const MultiStockModel::Factors& MultiStockModel::getFactors() const {
+    Factors& f = *factors;
+    call_once(f.computed, [&]() {
+        int nStocks = stockPrices.nRows();
+        f.logStockPrices = Matrix(nStocks, 1, false);
+        f.logDrifts = Matrix(nStocks, 1, false);
+        f.riskNeutralLogDrifts = Matrix(nStocks, 1, false);
+        for (int j = 0; j < nStocks; j++) {
+            double halfVariance = 0.5*covariance(j, j);
+            f.logStockPrices(j) = log(stockPrices(j));
+            f.logDrifts(j) = drifts(j) - halfVariance;
+            f.riskNeutralLogDrifts(j) = riskFreeRate - halfVariance;
+        }
+    });
+    return f;
+}
+
+/*  Get a sub model that uses only the given stocks */
+SPCMultiStockModel MultiStockModel::getSubmodel(
+        const set<string>& stocks) const {
+    vector<int> indices;
+    indices.reserve(stocks.size());
     for (auto& stock : stocks) {
-        int idx = getIndex(stock);
-        drifts(newIndex) = this->drifts(idx);
-        stockPrices(newIndex) = this->stockPrices(idx);
-        newIndex++;
+        indices.push_back(getIndex(stock));
+    }
+    Factors& f = *factors;
+    lock_guard<mutex> lock(f.submodelMutex);
+    SPCMultiStockModel& ret = f.submodels[indices];
+    if (!ret) {
+        ret = createSubmodel(indices);
     }
+    return ret;
+}
 
-    int i = 0;
-    for (auto& stockI : stocks) {
-        int j = 0;
-        for (auto& stockJ : stocks) {
-            int oldI = getIndex(stockI);
-            int oldJ = getIndex(stockJ);
-            cov(i, j) = covarianceMatrix(oldI, oldJ);
-            j++;
-        }
-        i++;
-    }
-    MultiStockModel ret(newStocks, stockPrices, drifts, cov);
-    ret.setDate(getDate());
-    ret.setRiskFreeRate(getRiskFreeRate());
+/*  Create a sub model. The indices are in the order of the
+    stock names, which is the order of the stocks in the sub
+    model. The factors of the sub model are the corresponding
+    entries of our factors. The Cholesky factor of a leading
+    block of the covariance matrix is the leading block of
+    ours, so it is sliced rather than refactored when we know
+    it; otherwise the sub model computes its own when needed.
+    The sub model of a factor model is a factor model */
+SPCMultiStockModel MultiStockModel::createSubmodel(
+        const vector<int>& indices) const {
+    int n = indices.size();
+    Matrix drifts(n, 1, false);
+    Matrix stockPrices(n, 1, false);
+    vector<string> newStocks(n);
+    for (int j = 0; j < n; j++) {
+        int oldJ = indices[j];
+        newStocks[j] = stockNames[oldJ];
+        drifts(j) = this->drifts(oldJ);
+        stockPrices(j) = this->stockPrices(oldJ);
+    }
+    shared_ptr<MultiStockModel> ret;
+    if (factorModel) {
+        int nFactors = factorLoadings.nCols();
+        Matrix loadings(n, nFactors, false);
+        Matrix specific(n, 1, false);
+        for (int j = 0; j < n; j++) {
+            specific(j) = specificVariances(indices[j]);
+            for (int f = 0; f < nFactors; f++) {
+                loadings(j, f) = factorLoadings(indices[j], f);
+            }
+        }
+        ret = make_shared<MultiStockModel>(
+            newStocks, stockPrices, drifts, loadings, specific);
+    } else {
+        Matrix cov(n, n, false);
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                cov(i, j) = covarianceMatrix(indices[i], indices[j]);
+            }
+        }
+        ret = make_shared<MultiStockModel>(
+            newStocks, stockPrices, drifts, cov);
+    }
+    ret->setDate(getDate());
+    ret->setRiskFreeRate(getRiskFreeRate());
+
+    bool leadingBlock = true;
+    for (int j = 0; j < n && leadingBlock; j++) {
+        leadingBlock = indices[j] == j;
+    }
+    if (leadingBlock && factors->hasCholesky) {
+        const Matrix& cholesky = factors->cholesky;
+        Matrix block(n, n, false);
+        for (int j = 0; j < n; j++) {
+            for (int i = 0; i < n; i++) {
+                block(i, j) = cholesky(i, j);
+            }
+        }
+        ret->invalidateFactors(block);
+    }
+
+    const Factors& parent = getFactors();
+    Factors& f = *ret->factors;
+    call_once(f.computed, [&]() {
+        f.logStockPrices = Matrix(n, 1, false);
+        f.logDrifts = Matrix(n, 1, false);
+        f.riskNeutralLogDrifts = Matrix(n, 1, false);
+        for (int j = 0; j < n; j++) {
+            f.logStockPrices(j) = parent.logStockPrices(indices[j]);
+            f.logDrifts(j) = parent.logDrifts(indices[j]);
+            f.riskNeutralLogDrifts(j) =
+                parent.riskNeutralLogDrifts(indices[j]);
+        }
+    });
     return ret;
 }
 
@@ -87,13 +319,120 @@ BlackScholesModel MultiStockModel::getBlackScholesModel(
     int idx = getIndex(stockCode);
     BlackScholesModel bsm;
     bsm.drift = drifts(idx, 0);
-    bsm.volatility = sqrt(covarianceMatrix(idx, idx));
+    bsm.volatility = sqrt(covariance(idx, idx));
     bsm.riskFreeRate = riskFreeRate;
     bsm.stockPrice = stockPrices(idx, 0);
     bsm.date = date;
     return bsm;
 }
 
+/*  Replace the columns of m by an orthonormal basis
+    for their span, by modified Gram-Schmidt */
+static void orthonormalise(Matrix& m) {
+    int n = m.nRows();
+    for (int j = 0; j < m.nCols(); j++) {
+        double* v = m.begin() + m.offset(0, j);
+        for (int k = 0; k < j; k++) {
+            const double* u = m.begin() + m.offset(0, k);
+            double dot = 0.0;
+            for (int i = 0; i < n; i++) {
+                dot += u[i] * v[i];
+            }
+            for (int i = 0; i < n; i++) {
+                v[i] -= dot*u[i];
+            }
+        }
+        double norm = 0.0;
+        for (int i = 0; i < n; i++) {
+            norm += v[i] * v[i];
+        }
+        norm = sqrt(norm);
+        ASSERT(norm > 0);
+        for (int i = 0; i < n; i++) {
+            v[i] /= norm;
+        }
+    }
+}
+
+/*  The leading principal components of a covariance matrix,
+    found by orthogonal iteration with a Rayleigh-Ritz step,
+    so that each iteration costs O(n^2*nComponents) rather
+    than diagonalising the whole matrix */
+static void principalComponents(const Matrix& cov,
+        int nComponents,
+        Matrix& values,
+        Matrix& vectors) {
+    int n = cov.nRows();
+    if (nComponents == n) {
+        eigSymmetric(cov, values, vectors);
+        return;
+    }
+    mt19937 rng;
+    Matrix q = randn(rng, n, nComponents);
+    orthonormalise(q);
+    for (int iter = 0; iter < 1000; iter++) {
+        Matrix z = cov*q;
+        Matrix newValues;
+        Matrix u;
+        eigSymmetric(transpose(q)*z, newValues, u);
+        vectors = q*u;
+        bool converged = iter > 0;
+        for (int j = 0; j < nComponents && converged; j++) {
+            converged = fabs(newValues(j) - values(j))
+                <= 1e-12*fabs(newValues(0));
+        }
+        values = newValues;
+        if (converged) {
+            return;
+        }
+        q = z*u;
+        orthonormalise(q);
+    }
+}
+
+/*  Approximate by a factor model built
+    from the principal components */
+MultiStockModel MultiStockModel::getFactorModel(int nFactors) const {
+    int n = stockPrices.nRows();
+    ASSERT(nFactors >= 1 && nFactors <= n);
+    Matrix cov = getCovarianceMatrix();
+    Matrix values;
+    Matrix vectors;
+    principalComponents(cov, nFactors, values, vectors);
+    Matrix loadings(n, nFactors, false);
+    Matrix specific(n, 1, false);
+    for (int f = 0; f < nFactors; f++) {
+        double scale = sqrt(max(values(f), 0.0));
+        for (int i = 0; i < n; i++) {
+            loadings(i, f) = scale*vectors(i, f);
+        }
+    }
+    for (int i = 0; i < n; i++) {
+        double explained = 0.0;
+        for (int f = 0; f < nFactors; f++) {
+            explained += loadings(i, f)*loadings(i, f);
+        }
+        specific(i) = max(cov(i, i) - explained, 0.0);
+    }
+    MultiStockModel ret(stockNames, stockPrices, drifts,
+        loadings, specific);
+    ret.setDate(date);
+    ret.setRiskFreeRate(riskFreeRate);
+    return ret;
+}
+
+/*  The dates of nSteps equal steps between two dates */
+static vector<double> uniformGrid(double fromDate, double toDate,
+        int nSteps) {
+    ASSERT(nSteps >= 1);
+    vector<double> dates(nSteps);
+    double dt = (toDate - fromDate) / nSteps;
+    for (int i = 0; i < nSteps; i++) {
+        dates[i] = fromDate + (i + 1)*dt;
+    }
+    dates[nSteps - 1] = toDate;
+    return dates;
+}
 
 /*  Returns a simulation up to the given date
 in the P measure */
@@ -102,7 +441,10 @@ MarketSimulation MultiStockModel::generatePricePaths(
     double toDate,
     int nPaths,
     int nSteps) const {
-    return generatePricePaths(rng, toDate,nPaths,nSteps,drifts);
+    PathRecorder recorder(stockNames, nPaths, nSteps);
+    simulatePricePaths(rng, uniformGrid(date, toDate, nSteps), nPaths,
+        getFactors().logDrifts, SamplingOptions(), recorder);
+    return recorder.getSimulation();
 }
 
 /*  Returns a simulation up to the given date
@@ -112,68 +454,453 @@ MarketSimulation MultiStockModel::generateRiskNeutralPricePaths(
     double toDate,
     int nPaths,
     int nSteps) const {
-    Matrix riskNeutralDrifts = ones(drifts.nRows(), 1)*riskFreeRate;
-    return generatePricePaths(rng, toDate, nPaths, nSteps, riskNeutralDrifts);
+    return generateRiskNeutralPricePaths(rng, toDate, nPaths, nSteps,
+        SamplingOptions());
 }
 
+/*  Returns a simulation up to the given date
+in the Q measure using the given sampling */
+MarketSimulation MultiStockModel::generateRiskNeutralPricePaths(
+    mt19937& rng,
+    double toDate,
+    int nPaths,
+    int nSteps,
+    const SamplingOptions& sampling) const {
+    return generateRiskNeutralPricePaths(rng,
+        uniformGrid(date, toDate, nSteps), nPaths, sampling);
+}
 
-/**
-*  Creates a price path according to the model parameters
-*/
-MarketSimulation MultiStockModel::generatePricePaths(
+/*  Returns a simulation on the given dates
+in the Q measure using the given sampling */
+MarketSimulation MultiStockModel::generateRiskNeutralPricePaths(
+    mt19937& rng,
+    const vector<double>& dates,
+    int nPaths,
+    const SamplingOptions& sampling) const {
+    PathRecorder recorder(stockNames, nPaths, dates.size());
+    SPCMatrix weights = simulateRiskNeutralPricePaths(rng, dates,
+        nPaths, sampling, recorder);
+    MarketSimulation sim = recorder.getSimulation();
+    sim.setWeights(weights);
+    return sim;
+}
+
+/*  Simulates paths in the Q measure passing the prices
+at each step to the accumulator */
+SPCMatrix MultiStockModel::simulateRiskNeutralPricePaths(
     mt19937& rng,
     double toDate,
     int nPaths,
     int nSteps,
-    Matrix drifts) const {
+    const SamplingOptions& sampling,
+    PathAccumulator& accumulator) const {
+    return simulateRiskNeutralPricePaths(rng,
+        uniformGrid(date, toDate, nSteps), nPaths, sampling,
+        accumulator);
+}
+
+/*  Simulates paths in the Q measure on the given dates
+passing the prices at each date to the accumulator */
+SPCMatrix MultiStockModel::simulateRiskNeutralPricePaths(
+    mt19937& rng,
+    const vector<double>& dates,
+    int nPaths,
+    const SamplingOptions& sampling,
+    PathAccumulator& accumulator) const {
+    ASSERT(!dates.empty() && dates[0] > date);
+    const Matrix& logDrifts = getFactors().riskNeutralLogDrifts;
+    if (sampling.method == PSEUDO_RANDOM) {
+        return simulatePricePaths(rng, dates, nPaths,
+            logDrifts, sampling, accumulator);
+    }
+    return simulateBridgedPricePaths(rng, dates, nPaths,
+        logDrifts, sampling, accumulator);
+}
 
-    int nStocks = stockPrices.nRows();
-    double dt = (toDate - date) / nSteps;
-    double rootDt = sqrt(dt);
 
-    // initialize matrices of simulations for
-    // each stock
-    std::vector< SPMatrix> simulations;
+/*  The number of paths advanced together by the time
+    step kernel, small enough for the block to stay in
+    the cache */
+static const int STEP_BLOCK_SIZE = 64;
+
+/**
+*  Computes the likelihood ratio of the risk neutral measure
+*  with respect to a measure where the independent Brownian
+*  motions have the given additional drift, given their
+*  terminal values under the shifted measure
+*/
+static SPMatrix likelihoodRatios(
+    const Matrix& terminalW,
+    double T,
+    const vector<double>& driftShift) {
+    int nPaths = terminalW.nRows();
+    int nStocks = terminalW.nCols();
+    ASSERT((int)driftShift.size() == nStocks);
+    double normSq = 0.0;
     for (int j = 0; j < nStocks; j++) {
-        SPMatrix matrix(new Matrix(nPaths, nSteps));
-        simulations.push_back(matrix);
+        normSq += driftShift[j] * driftShift[j];
+    }
+    SPMatrix weights(new Matrix(nPaths, 1, false));
+    for (int p = 0; p < nPaths; p++) {
+        double exponent = 0.5*normSq*T;
+        for (int j = 0; j < nStocks; j++) {
+            exponent -= driftShift[j] * terminalW(p, j);
+        }
+        (*weights)(p) = exp(exponent);
+    }
+    return weights;
+}
+
+/**
+*  Simulates price paths according to the model parameters,
+*  one time step at a time
+*/
+SPCMatrix MultiStockModel::simulatePricePaths(
+    mt19937& rng,
+    const vector<double>& dates,
+    int nPaths,
+    const Matrix& logDrifts,
+    const SamplingOptions& sampling,
+    PathAccumulator& accumulator) const {
+
+    if (usesFactorPaths(sampling)) {
+        return simulateFactorPricePaths(rng, dates, nPaths,
+            logDrifts, accumulator);
     }
 
-    Matrix A = chol(covarianceMatrix);
+    int nStocks = stockPrices.nRows();
+    int nSteps = dates.size();
 
+    const Factors& factors = getFactors();
+    const Matrix& A = getCholeskyFactor();
 
     // create a matrix containing current log stock prices
-    // and a matrix contianing the drift term to add each
-    // time step
-    Matrix currentLogStock(nPaths, nStocks);
-    Matrix driftTerm(nPaths, nStocks);
-    Matrix oneV = ones(nPaths, 1);
+    Matrix currentLogStock(nPaths, nStocks, false);
     for (int j = 0; j < nStocks; j++) {
-        double S0 = stockPrices(j);
-        currentLogStock.setCol(j, oneV*log(S0), 0);
-        double logDrift = drifts(j) - 0.5*covarianceMatrix(j,j);
-        driftTerm.setCol(j, oneV*logDrift*dt, 0);
+        double logS0 = factors.logStockPrices(j);
+        double* p = currentLogStock.begin() + currentLogStock.offset(0, j);
+        for (int k = 0; k < nPaths; k++) {
+            p[k] = logS0;
+        }
     }
+    Matrix currentStock(nPaths, nStocks, false);
+
+    // when importance sampling we need the terminal value
+    // of the shifted Brownian motion
+    bool shifted = !sampling.driftShift.empty();
+    Matrix brownian(nPaths, shifted ? nStocks : 1);
+
+    // the normals for a block of paths, stored by stock
+    vector<double> z(STEP_BLOCK_SIZE*nStocks);
+    Matrix matched;
+
+    // accumulators which only compare prices can
+    // work with log prices, saving the exponentials
+    bool logPrices = accumulator.usesLogPrices();
 
     // comute paths at subsequent time steps
     for (int i = 0; i < nSteps; i++) {
-        Matrix epsilons = randn(rng, nPaths, nStocks);
-        Matrix W = rootDt * epsilons * transpose(A);
-        currentLogStock += driftTerm + W;
-        Matrix currentStock = exp( currentLogStock );
-        for (int j = 0; j < nStocks; j++) {
-            auto stockPaths = simulations[j];
-            stockPaths->setCol(i, currentStock, j);
+        // the log prices are normal, so we can step exactly
+        // between dates however far apart they are
+        double dt = dates[i] - (i == 0 ? date : dates[i - 1]);
+        ASSERT(dt > 0);
+        double rootDt = sqrt(dt);
+        // prices are only computed on the steps that are needed
+        bool needed = accumulator.needsStep(i, nSteps);
+        if (sampling.momentMatching) {
+            // the whole step must be drawn before it can be matched
+            matched = drawNormals(rng, nPaths, sampling);
+        }
+        for (int start = 0; start < nPaths; start += STEP_BLOCK_SIZE) {
+            int n = min(STEP_BLOCK_SIZE, nPaths - start);
+            // draw in the same order as randn, one path at a time
+            for (int b = 0; b < n; b++) {
+                for (int k = 0; k < nStocks; k++) {
+                    z[k*STEP_BLOCK_SIZE + b] = sampling.momentMatching
+                        ? matched(start + b, k)
+                        : norminv(randuniform(rng));
+                }
+            }
+            if (shifted) {
+                for (int k = 0; k < nStocks; k++) {
+                    double shift = sampling.driftShift[k];
+                    double* zk = &z[k*STEP_BLOCK_SIZE];
+                    double* w = brownian.begin() + brownian.offset(start, k);
+                    for (int b = 0; b < n; b++) {
+                        zk[b] += shift*rootDt;
+                        w[b] += rootDt*zk[b];
+                    }
+                }
+            }
+            // apply the lower triangular factor, add the drift
+            // and exponentiate while the block is in the cache
+            for (int j = 0; j < nStocks; j++) {
+                double increment[STEP_BLOCK_SIZE];
+                double driftTerm = logDrifts(j)*dt;
+                for (int b = 0; b < n; b++) {
+                    increment[b] = driftTerm;
+                }
+                for (int k = 0; k <= j; k++) {
+                    double a = rootDt*A(j, k);
+                    const double* zk = &z[k*STEP_BLOCK_SIZE];
+                    for (int b = 0; b < n; b++) {
+                        increment[b] += a*zk[b];
+                    }
+                }
+                double* logS = currentLogStock.begin()
+                    + currentLogStock.offset(start, j);
+                double* S = currentStock.begin()
+                    + currentStock.offset(start, j);
+                for (int b = 0; b < n; b++) {
+                    logS[b] += increment[b];
+                }
+                if (needed && !logPrices) {
+                    for (int b = 0; b < n; b++) {
+                        S[b] = exp(logS[b]);
+                    }
+                }
+            }
+        }
+        if (needed && logPrices) {
+            accumulator.observeLogPrices(i, currentLogStock);
+        } else if (needed) {
+            accumulator.observe(i, currentStock);
         }
     }
 
-    // store the results in a Market Simulation
-    MarketSimulation sim;
+    if (shifted) {
+        return likelihoodRatios(brownian, dates.back() - date,
+            sampling.driftShift);
+    }
+    return SPCMatrix();
+}
+
+/**
+*  Simulates price paths with the factor model. Each step
+*  draws a normal for each factor and for each stock, so
+*  costs O(nStocks*nFactors) per path rather than the
+*  O(nStocks^2) of multiplying by the Cholesky factor
+*/
+SPCMatrix MultiStockModel::simulateFactorPricePaths(
+    mt19937& rng,
+    const vector<double>& dates,
+    int nPaths,
+    const Matrix& logDrifts,
+    PathAccumulator& accumulator) const {
+
+    int nStocks = stockPrices.nRows();
+    int nFactors = factorLoadings.nCols();
+    int nSteps = dates.size();
+
+    const Factors& factors = getFactors();
+    // the loadings of each stock are contiguous
+    Matrix loadings = transpose(factorLoadings);
+    vector<double> specificVols(nStocks);
     for (int j = 0; j < nStocks; j++) {
-        auto stockPaths = simulations[j];
-        sim.addSimulation(stockNames[j], stockPaths);
+        specificVols[j] = sqrt(specificVariances(j));
     }
-    return sim;
+
+    Matrix currentLogStock(nPaths, nStocks, false);
+    for (int j = 0; j < nStocks; j++) {
+        double logS0 = factors.logStockPrices(j);
+        double* p = currentLogStock.begin() + currentLogStock.offset(0, j);
+        for (int k = 0; k < nPaths; k++) {
+            p[k] = logS0;
+        }
+    }
+    Matrix currentStock(nPaths, nStocks, false);
+
+    // the factor normals for a block of paths, stored by factor
+    vector<double> z(STEP_BLOCK_SIZE*nFactors);
+    bool logPrices = accumulator.usesLogPrices();
+
+    for (int i = 0; i < nSteps; i++) {
+        double dt = dates[i] - (i == 0 ? date : dates[i - 1]);
+        ASSERT(dt > 0);
+        double rootDt = sqrt(dt);
+        bool needed = accumulator.needsStep(i, nSteps);
+        for (int start = 0; start < nPaths; start += STEP_BLOCK_SIZE) {
+            int n = min(STEP_BLOCK_SIZE, nPaths - start);
+            for (int b = 0; b < n; b++) {
+                for (int f = 0; f < nFactors; f++) {
+                    z[f*STEP_BLOCK_SIZE + b] = norminv(randuniform(rng));
+                }
+            }
+            for (int j = 0; j < nStocks; j++) {
+                double increment[STEP_BLOCK_SIZE];
+                double driftTerm = logDrifts(j)*dt;
+                double specificVol = rootDt*specificVols[j];
+                for (int b = 0; b < n; b++) {
+                    increment[b] = driftTerm
+                        + specificVol*norminv(randuniform(rng));
+                }
+                const double* bj = loadings.begin() + loadings.offset(0, j);
+                for (int f = 0; f < nFactors; f++) {
+                    double a = rootDt*bj[f];
+                    const double* zf = &z[f*STEP_BLOCK_SIZE];
+                    for (int b = 0; b < n; b++) {
+                        increment[b] += a*zf[b];
+                    }
+                }
+                double* logS = currentLogStock.begin()
+                    + currentLogStock.offset(start, j);
+                double* S = currentStock.begin()
+                    + currentStock.offset(start, j);
+                for (int b = 0; b < n; b++) {
+                    logS[b] += increment[b];
+                }
+                if (needed && !logPrices) {
+                    for (int b = 0; b < n; b++) {
+                        S[b] = exp(logS[b]);
+                    }
+                }
+            }
+        }
+        if (needed && logPrices) {
+            accumulator.observeLogPrices(i, currentLogStock);
+        } else if (needed) {
+            accumulator.observe(i, currentStock);
+        }
+    }
+    return SPCMatrix();
+}
+
+/**
+*  Draws the independent normals needed for one time step,
+*  moment matching them if requested
+*/
+Matrix MultiStockModel::drawNormals(
+    mt19937& rng,
+    int nPaths,
+    const SamplingOptions& sampling) const {
+    Matrix epsilons = randn(rng, nPaths, stockPrices.nRows());
+    if (sampling.momentMatching) {
+        return matchMoments(epsilons, sampling.matchCovariance);
+    }
+    return epsilons;
+}
+
+/**
+*  Simulates price paths by sampling the terminal value of
+*  the independent Brownian motions first, stratifying as
+*  requested, and then filling in the intermediate values
+*  with a Brownian bridge
+*/
+SPCMatrix MultiStockModel::simulateBridgedPricePaths(
+    mt19937& rng,
+    const vector<double>& dates,
+    int nPaths,
+    const Matrix& logDrifts,
+    const SamplingOptions& sampling,
+    PathAccumulator& accumulator) const {
+
+    int nStocks = stockPrices.nRows();
+    int nSteps = dates.size();
+    int nStrata = sampling.nStrata;
+    ASSERT(nStrata >= 1);
+    double T = dates.back() - date;
+
+    // choose uniform random numbers for the terminal
+    // value of each Brownian motion
+    Matrix u = randuniform(rng, nPaths, nStocks);
+    if (sampling.method == STRATIFIED) {
+        for (int p = 0; p < nPaths; p++) {
+            u(p, 0) = (p % nStrata + u(p, 0)) / nStrata;
+        }
+    } else {
+        ASSERT(sampling.method == LATIN_HYPERCUBE);
+        int nDimensions = min(sampling.nDimensions, nStocks);
+        Matrix keys = randuniform(rng, nPaths, nDimensions);
+        vector<int> order;
+        for (int start = 0; start < nPaths; start += nStrata) {
+            int blockSize = min(nStrata, nPaths - start);
+            for (int d = 0; d < nDimensions; d++) {
+                // sorting random keys gives a random
+                // permutation of the strata in the block
+                order.resize(blockSize);
+                for (int k = 0; k < blockSize; k++) {
+                    order[k] = k;
+                }
+                sort(order.begin(), order.end(), [&](int a, int b) {
+                    return keys(start + a, d) < keys(start + b, d);
+                });
+                for (int k = 0; k < blockSize; k++) {
+                    int p = start + order[k];
+                    u(p, d) = (k + u(p, d)) / blockSize;
+                }
+            }
+        }
+    }
+    double rootT = sqrt(T);
+    Matrix terminalW(nPaths, nStocks, false);
+    for (int j = 0; j < nStocks; j++) {
+        for (int p = 0; p < nPaths; p++) {
+            terminalW(p, j) = rootT*norminv(u(p, j));
+        }
+    }
+    bool shifted = !sampling.driftShift.empty();
+    if (shifted) {
+        for (int j = 0; j < nStocks; j++) {
+            double shift = sampling.driftShift[j] * T;
+            for (int p = 0; p < nPaths; p++) {
+                terminalW(p, j) += shift;
+            }
+        }
+    }
+
+    const Factors& factors = getFactors();
+    const Matrix& A = getCholeskyFactor();
+
+    // walk forward, bridging from the current value
+    // of the Brownian motion to its terminal value
+    Matrix W(nPaths, nStocks);
+    Matrix currentStock(nPaths, nStocks, false);
+    bool logPrices = accumulator.usesLogPrices();
+    for (int i = 0; i < nSteps; i++) {
+        double t = i == 0 ? 0.0 : dates[i - 1] - date;
+        double tNext = dates[i] - date;
+        double dt = tNext - t;
+        if (i == nSteps - 1) {
+            W = terminalW;
+        } else {
+            double weight = dt / (T - t);
+            double sd = sqrt(dt*(T - tNext) / (T - t));
+            Matrix epsilons = drawNormals(rng, nPaths, sampling);
+            W += weight*(terminalW - W) + sd*epsilons;
+        }
+        if (!accumulator.needsStep(i, nSteps)) {
+            continue;
+        }
+        for (int j = 0; j < nStocks; j++) {
+            double mean = factors.logStockPrices(j) + tNext*logDrifts(j);
+            double* S = currentStock.begin() + currentStock.offset(0, j);
+            for (int p = 0; p < nPaths; p++) {
+                S[p] = mean;
+            }
+            for (int k = 0; k <= j; k++) {
+                double a = A(j, k);
+                const double* w = W.begin() + W.offset(0, k);
+                for (int p = 0; p < nPaths; p++) {
+                    S[p] += a*w[p];
+                }
+            }
+            if (!logPrices) {
+                for (int p = 0; p < nPaths; p++) {
+                    S[p] = exp(S[p]);
+                }
+            }
+        }
+        if (logPrices) {
+            accumulator.observeLogPrices(i, currentStock);
+        } else {
+            accumulator.observe(i, currentStock);
+        }
+    }
+
+    if (shifted) {
+        return likelihoodRatios(terminalW, T, sampling.driftShift);
+    }
+    return SPCMatrix();
 }
 
 /*
@@ -224,10 +951,452 @@ static void testCorrectCovarianceMatrix() {
     }
 }
 
+static void testStratifiedSampling() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    SamplingOptions sampling;
+    sampling.method = STRATIFIED;
+    sampling.nStrata = 50;
+    int nPaths = 1000;
+    int nSteps = 4;
+    mt19937 rng;
+    MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+        rng, 1.0, nPaths, nSteps, sampling);
+
+    // the first stock is driven by the stratified Brownian motion
+    // alone, so each stratum contains exactly one quantile range
+    // of its terminal price
+    auto stocks = msm.getStocks();
+    SPCMatrix prices = sim.getStockPrices(stocks[0]);
+    Matrix finalPrices = prices->col(nSteps - 1);
+    Matrix sorted = sortCols(finalPrices);
+    for (int p = 0; p < nPaths; p++) {
+        // path p lies in stratum p % nStrata, which holds the
+        // nPaths/nStrata sorted prices starting from that
+        // fraction of the way through
+        ASSERT(finalPrices(p)
+            >= sorted(p % sampling.nStrata * nPaths / sampling.nStrata));
+        ASSERT(finalPrices(p)
+            <= sorted((p % sampling.nStrata + 1) * nPaths
+                / sampling.nStrata - 1));
+    }
+}
+
+static void testLatinHypercubeSampling() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    SamplingOptions sampling;
+    sampling.method = LATIN_HYPERCUBE;
+    sampling.nStrata = 100;
+    sampling.nDimensions = 3;
+    int nPaths = 100000;
+    int nSteps = 3;
+    mt19937 rng;
+    double T = 1.0;
+    MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+        rng, T, nPaths, nSteps, sampling);
+    auto stocks = msm.getStocks();
+    for (auto& stock : stocks) {
+        SPCMatrix prices = sim.getStockPrices(stock);
+        // the mean terminal price relative to the forward
+        ASSERT_APPROX_EQUAL(
+            meanCols(prices->col(nSteps - 1)).asScalar()
+                / (exp(msm.getRiskFreeRate()*T)*msm.getStockPrice(stock)),
+            1.0, 0.005);
+    }
+}
+
+static void testMomentMatching() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    SamplingOptions sampling;
+    sampling.momentMatching = true;
+    sampling.matchCovariance = true;
+    int nPaths = 1000;
+    double T = 0.5;
+    mt19937 rng;
+    MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+        rng, T, nPaths, 1, sampling);
+    auto cov = msm.getCovarianceMatrix();
+
+    // with a single step the sample covariance of the
+    // log prices matches the model exactly
+    auto stocks = msm.getStocks();
+    int n = stocks.size();
+    Matrix logPrices(nPaths, n);
+    for (int i = 0; i < n; i++) {
+        logPrices.setCol(i, *sim.getStockPrices(stocks[i]), 0);
+    }
+    logPrices.log();
+    Matrix means = meanCols(logPrices);
+    for (int i = 0; i < n; i++) {
+        ASSERT_APPROX_EQUAL(means(i), log(msm.getStockPrice(stocks[i]))
+            + (msm.getRiskFreeRate() - 0.5*cov(i, i))*T, 1e-10);
+    }
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+            double sumProd = 0.0;
+            for (int p = 0; p < nPaths; p++) {
+                sumProd += (logPrices(p, i) - means(i))
+                    *(logPrices(p, j) - means(j));
+            }
+            ASSERT_APPROX_EQUAL(cov(i, j)*T, sumProd / nPaths, 1e-10);
+        }
+    }
+}
+
+static void testDriftShift() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    msm.setRiskFreeRate(0.05);
+    SamplingOptions sampling;
+    sampling.driftShift = vector<double>({ 1.0, -0.5, 0.5 });
+    int nPaths = 100000;
+    int nSteps = 2;
+    double T = 1.0;
+    auto stocks = msm.getStocks();
+    for (int method = PSEUDO_RANDOM; method <= STRATIFIED; method++) {
+        sampling.method = (SamplingMethod)method;
+        mt19937 rng;
+        MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+            rng, T, nPaths, nSteps, sampling);
+        SPCMatrix weights = sim.getWeights();
+        ASSERT(weights);
+        ASSERT_APPROX_EQUAL(meanCols(*weights).asScalar(), 1.0, 0.02);
+        // weighted prices are still martingales
+        for (auto& stock : stocks) {
+            Matrix finalPrices = sim.getStockPrices(stock)->col(nSteps - 1);
+            finalPrices.times(*weights);
+            ASSERT_APPROX_EQUAL(meanCols(finalPrices).asScalar()
+                / (exp(0.05*T)*msm.getStockPrice(stock)), 1.0, 0.02);
+        }
+    }
+}
+
+static void testStreamingMatchesStoredPaths() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    int nPaths = 1000;
+    int nSteps = 50;
+    int idx = msm.getIndex("Bigbank");
+    SamplingOptions sampling;
+    for (int method = PSEUDO_RANDOM; method <= LATIN_HYPERCUBE; method++) {
+        sampling.method = (SamplingMethod)method;
+        mt19937 rng1;
+        MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+            rng1, 1.0, nPaths, nSteps, sampling);
+        SPCMatrix prices = sim.getStockPrices("Bigbank");
+
+        mt19937 rng2;
+        RunningMaximum maximum(idx, nPaths);
+        SPCMatrix weights = msm.simulateRiskNeutralPricePaths(
+            rng2, 1.0, nPaths, nSteps, sampling, maximum);
+        ASSERT(!weights);
+        maxOverRows(*prices).assertEquals(maximum.getValues(), 1e-10);
+    }
+}
+
+static void testFactorsAreCached() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    // compute the factors from several threads at once
+    vector<const Matrix*> factors(4);
+    vector<thread> threads;
+    for (int i = 0; i < 4; i++) {
+        threads.push_back(thread([&msm, &factors, i]() {
+            factors[i] = &msm.getCholeskyFactor();
+        }));
+    }
+    for (auto& t : threads) {
+        t.join();
+    }
+    for (int i = 1; i < 4; i++) {
+        ASSERT(factors[i] == factors[0]);
+    }
+    Matrix A = msm.getCholeskyFactor();
+    Matrix cov = msm.getCovarianceMatrix();
+    cov.assertEquals(A*transpose(A), 1e-10);
+
+    // copies share the factors
+    MultiStockModel copy = msm;
+    ASSERT(&copy.getCholeskyFactor() == factors[0]);
+
+    // changing the risk free rate changes the simulation
+    copy.setRiskFreeRate(0.5);
+    mt19937 rng1;
+    MarketSimulation before = msm.generateRiskNeutralPricePaths(
+        rng1, 1.0, 1000, 1);
+    mt19937 rng2;
+    MarketSimulation after = copy.generateRiskNeutralPricePaths(
+        rng2, 1.0, 1000, 1);
+    ASSERT_APPROX_EQUAL(after.getStockPrices("Acme")->get(0, 0)
+        / before.getStockPrices("Acme")->get(0, 0),
+        exp(0.5 - msm.getRiskFreeRate()), 1e-8);
+
+    // changes which leave the covariance alone keep the
+    // Cholesky factor rather than refactoring
+    Matrix kept = copy.getCholeskyFactor();
+    copy.setStockPrice("Acme", 2*copy.getStockPrice("Acme"));
+    copy.setRiskFreeRate(0.1);
+    copy.setDate(0.5);
+    kept.assertEquals(copy.getCholeskyFactor(), 0.0);
+}
+
+static void testSubmodelIsShared() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    msm.setRiskFreeRate(0.05);
+    set<string> stocks({ "Acme", "Chumhum" });
+    SPCMultiStockModel sub = msm.getSubmodel(stocks);
+    ASSERT(msm.getSubmodel(stocks) == sub);
+    ASSERT(sub->getStocks() == vector<string>({ "Acme", "Chumhum" }));
+    Matrix("0.05,0.01;0.01,0.07").assertEquals(
+        sub->getCovarianceMatrix(), 1e-10);
+    ASSERT_APPROX_EQUAL(sub->getStockPrice("Chumhum"), 300, 1e-10);
+    ASSERT_APPROX_EQUAL(sub->getRiskFreeRate(), 0.05, 1e-10);
+    Matrix A = sub->getCholeskyFactor();
+    sub->getCovarianceMatrix().assertEquals(A*transpose(A), 1e-10);
+
+    // the sub model simulates the same marginal distributions
+    mt19937 rng1;
+    MarketSimulation subSim = sub->generateRiskNeutralPricePaths(
+        rng1, 1.0, 10000, 1);
+    Matrix finalPrices = subSim.getStockPrices(1);
+    ASSERT_APPROX_EQUAL(meanCols(finalPrices)(0),
+        300*exp(0.05), 1.0);
+
+    // changing the parameters forgets the sub models
+    msm.setDate(0.5);
+    SPCMultiStockModel after = msm.getSubmodel(stocks);
+    ASSERT(after != sub);
+    ASSERT_APPROX_EQUAL(after->getDate(), 0.5, 1e-10);
+
+    // a leading block of stocks takes its Cholesky factor
+    // from ours
+    const Matrix& L = msm.getCholeskyFactor();
+    Matrix block(2, 2);
+    for (int j = 0; j < 2; j++) {
+        for (int i = 0; i < 2; i++) {
+            block(i, j) = L(i, j);
+        }
+    }
+    SPCMultiStockModel leading = msm.getSubmodel(
+        set<string>({ "Acme", "Bigbank" }));
+    block.assertEquals(leading->getCholeskyFactor(), 0.0);
+    leading->getCovarianceMatrix().assertEquals(
+        block*transpose(block), 1e-10);
+}
+
+static void testTimeStepKernel() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    msm.setRiskFreeRate(0.05);
+    // not a multiple of the block size
+    int nPaths = 200;
+    int nSteps = 3;
+    double dt = 1.0 / nSteps;
+    vector<string> stocks = msm.getStocks();
+    mt19937 rng1;
+    MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+        rng1, 1.0, nPaths, nSteps);
+
+    // compare with the same step computed by whole matrix operations
+    mt19937 rng2;
+    Matrix cov = msm.getCovarianceMatrix();
+    Matrix At = transpose(chol(cov));
+    Matrix logStock(nPaths, 3);
+    Matrix driftTerm(nPaths, 3);
+    for (int j = 0; j < 3; j++) {
+        logStock.setCol(j, ones(nPaths, 1)*log(msm.getStockPrice(stocks[j])), 0);
+        driftTerm.setCol(j, ones(nPaths, 1)*(0.05 - 0.5*cov(j, j))*dt, 0);
+    }
+    for (int i = 0; i < nSteps; i++) {
+        logStock += driftTerm + sqrt(dt)*randn(rng2, nPaths, 3)*At;
+        Matrix expected = exp(logStock);
+        for (int j = 0; j < 3; j++) {
+            Matrix actual = sim.getStockPrices(stocks[j])->col(i);
+            actual.assertEquals(expected.col(j), 1e-9);
+        }
+    }
+}
+
+static void testNonUniformGrid() {
+    BlackScholesModel bsm;
+    bsm.stockPrice = 100.0;
+    bsm.volatility = 0.2;
+    bsm.riskFreeRate = 0.05;
+    bsm.date = 0.5;
+    MultiStockModel msm(bsm);
+    vector<double> dates({ 0.6, 1.0, 3.0 });
+    int nPaths = 100000;
+    for (int method = PSEUDO_RANDOM; method <= STRATIFIED; method++) {
+        SamplingOptions sampling;
+        sampling.method = (SamplingMethod)method;
+        mt19937 rng;
+        MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+            rng, dates, nPaths, sampling);
+        SPCMatrix prices = sim.getStockPrices(MultiStockModel::DEFAULT_STOCK);
+        ASSERT(prices->nCols() == 3);
+        for (int i = 0; i < 3; i++) {
+            ASSERT_APPROX_EQUAL(meanCols(prices->col(i)).asScalar()
+                / (100.0*exp(0.05*(dates[i] - bsm.date))), 1.0, 0.01);
+            // log returns over each interval have the right variance
+            Matrix logReturns = prices->col(i);
+            if (i == 0) {
+                logReturns *= 0.01;
+            } else {
+                Matrix before = prices->col(i - 1);
+                for (int p = 0; p < nPaths; p++) {
+                    logReturns(p) /= before(p);
+                }
+            }
+            logReturns.log();
+            // the volatility implied by each interval
+            ASSERT_APPROX_EQUAL(stdCols(logReturns).asScalar()
+                / sqrt(dates[i] - (i == 0 ? bsm.date : dates[i - 1])),
+                0.2, 0.004);
+        }
+    }
+}
+
+/*  A factor model of many stocks for testing */
+static MultiStockModel createTestFactorModel(int nStocks) {
+    vector<string> stocks;
+    Matrix loadings(nStocks, 2);
+    Matrix specific(nStocks, 1);
+    for (int i = 0; i < nStocks; i++) {
+        stocks.push_back("Stock" + to_string(i));
+        loadings(i, 0) = 0.2;
+        loadings(i, 1) = 0.1*(i % 3 - 1);
+        specific(i) = 0.01*(1 + i % 2);
+    }
+    Matrix prices = 100.0*ones(nStocks, 1);
+    Matrix drifts(nStocks, 1);
+    MultiStockModel msm(stocks, prices, drifts, loadings, specific);
+    msm.setRiskFreeRate(0.05);
+    return msm;
+}
+
+static void testFactorModel() {
+    int nStocks = 30;
+    MultiStockModel msm = createTestFactorModel(nStocks);
+    ASSERT(msm.isFactorModel());
+    // one normal per stock and factor
+    ASSERT(msm.randSize(1, 1) == nStocks + 2);
+    Matrix cov = msm.getCovarianceMatrix();
+    ASSERT_APPROX_EQUAL(cov(0, 0), 0.04 + 0.01 + 0.01, 1e-10);
+    ASSERT_APPROX_EQUAL(cov(0, 1), 0.04, 1e-10);
+    ASSERT_APPROX_EQUAL(cov(0, 3), 0.04 + 0.01, 1e-10);
+
+    int nPaths = 20000;
+    mt19937 rng;
+    MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+        rng, 1.0, nPaths, 1);
+    vector<Matrix> logReturns;
+    for (int j = 0; j < 4; j++) {
+        Matrix x = sim.getStockPrices(j);
+        x *= 0.01;
+        x.log();
+        logReturns.push_back(x);
+    }
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j <= i; j++) {
+            Matrix xy = logReturns[i];
+            xy.times(logReturns[j]);
+            ASSERT_APPROX_EQUAL(meanCols(xy).asScalar()
+                - meanCols(logReturns[i]).asScalar()
+                * meanCols(logReturns[j]).asScalar(), cov(i, j), 0.005);
+        }
+    }
+    ASSERT_APPROX_EQUAL(meanCols(sim.getStockPrices(0)).asScalar(),
+        100.0*exp(0.05), 1.0);
+
+    // sub models are factor models too
+    SPCMultiStockModel sub = msm.getSubmodel({ "Stock0", "Stock3" });
+    ASSERT(sub->isFactorModel());
+    Matrix subCov = sub->getCovarianceMatrix();
+    ASSERT_APPROX_EQUAL(subCov(0, 1), cov(0, 3), 1e-10);
+}
+
+static void testPrincipalComponents() {
+    // a model whose covariance is exactly a two factor model
+    MultiStockModel factorModel = createTestFactorModel(10);
+    MultiStockModel dense(factorModel.getStocks(),
+        100.0*ones(10, 1), Matrix(10, 1),
+        factorModel.getCovarianceMatrix());
+    ASSERT(!dense.isFactorModel());
+    MultiStockModel pca = dense.getFactorModel(2);
+    ASSERT(pca.getFactorLoadings().nCols() == 2);
+    Matrix expected = factorModel.getCovarianceMatrix();
+    Matrix actual = pca.getCovarianceMatrix();
+    for (int i = 0; i < 10; i++) {
+        // the variances are preserved exactly
+        ASSERT_APPROX_EQUAL(actual(i, i), expected(i, i), 1e-10);
+        for (int j = 0; j < i; j++) {
+            // the specific variances are small
+            ASSERT_APPROX_EQUAL(actual(i, j), expected(i, j), 0.02);
+        }
+    }
+    // with every factor the model is exact
+    dense.getFactorModel(10).getCovarianceMatrix()
+        .assertEquals(expected, 1e-8);
+}
+
+static void testCovarianceUpdates() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    Matrix original = msm.getCholeskyFactor();
+    Matrix shocks("0.1,0.02;0.05,-0.03;-0.02,0.04");
+
+    MultiStockModel stressed = msm;
+    stressed.updateCovariance(shocks);
+    Matrix expected = msm.getCovarianceMatrix()
+        + shocks*transpose(shocks);
+    expected.assertEquals(stressed.getCovarianceMatrix(), 1e-10);
+    chol(expected).assertEquals(stressed.getCholeskyFactor(), 1e-10);
+    // the original model is unchanged
+    original.assertEquals(msm.getCholeskyFactor(), 1e-10);
+
+    stressed.updateCovariance(shocks, true);
+    original.assertEquals(stressed.getCholeskyFactor(), 1e-10);
+
+    stressed.addStock("Dunder", 50.0, 0.1, Matrix("0.01;0;-0.01"), 0.08);
+    ASSERT(stressed.getIndex("Dunder") == 3);
+    ASSERT_APPROX_EQUAL(stressed.getStockPrice("Dunder"), 50.0, 1e-10);
+    Matrix cov = stressed.getCovarianceMatrix();
+    ASSERT_APPROX_EQUAL(cov(3, 0), 0.01, 1e-10);
+    ASSERT_APPROX_EQUAL(cov(3, 3), 0.08, 1e-10);
+    chol(cov).assertEquals(stressed.getCholeskyFactor(), 1e-10);
+    mt19937 rng;
+    MarketSimulation sim = stressed.generateRiskNeutralPricePaths(
+        rng, 1.0, 10, 1);
+    ASSERT(sim.nStocks() == 4);
+}
+
+static void testCovarianceHash() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    MultiStockModel copy = msm;
+    ASSERT(copy.getCovarianceHash() == msm.getCovarianceHash());
+    // the hash ignores the prices, rate and date
+    copy.setStockPrice("Acme", 2*copy.getStockPrice("Acme"));
+    copy.setRiskFreeRate(0.1);
+    copy.setDate(0.5);
+    ASSERT(copy.getCovarianceHash() == msm.getCovarianceHash());
+    copy.updateCovariance(Matrix("0.1;0.02;0.05"));
+    ASSERT(copy.getCovarianceHash() != msm.getCovarianceHash());
+    // models with the same parameters have the same hash
+    ASSERT(MultiStockModel::createTestModel().getCovarianceHash()
+        == msm.getCovarianceHash());
+}
+
 void testMultiStockModel() {
     // our tests of the BlackScholesModel perform a great deal
     // of testing of this class already. This is because
     // BlackScholesModel has been refactored to use a
     // MultiStockModel to generate stock prices.
     testCorrectCovarianceMatrix();
+    TEST(testStratifiedSampling);
+    TEST(testLatinHypercubeSampling);
+    TEST(testMomentMatching);
+    TEST(testDriftShift);
+    TEST(testStreamingMatchesStoredPaths);
+    TEST(testFactorsAreCached);
+    TEST(testSubmodelIsShared);
+    TEST(testTimeStepKernel);
+    TEST(testNonUniformGrid);
+    TEST(testFactorModel);
+    TEST(testPrincipalComponents);
+    TEST(testCovarianceUpdates);
+    TEST(testCovarianceHash);
 }
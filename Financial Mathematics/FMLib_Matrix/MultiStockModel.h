@@ -7,6 +7,12 @@
 #include "Matrix.h"
 #include "BlackScholesModel.h"
 #include "MarketSimulation.h"
+#include "SamplingOptions.h"
+#include "PathAccumulator.h"
+
+class MultiStockModel;
+
+typedef std::shared_ptr<const MultiStockModel> SPCMultiStockModel;
 
 /**
  *   A model for a collection of stocks that uses
@@ -23,6 +29,16 @@ public:
         Matrix drifts,
         Matrix covarianceMatrix);
 
+    /*  Create a factor model, where the covariance matrix is
+        B*transpose(B) + D for an nStocks by nFactors matrix of
+        factor loadings B and a diagonal matrix D whose diagonal
+        is the column vector of specific variances */
+    MultiStockModel(std::vector<std::string> stocks,
+        Matrix stockPrices,
+        Matrix drifts,
+        Matrix factorLoadings,
+        Matrix specificVariances);
+
     /*  The risk free rate */
     double getRiskFreeRate() const {
         return riskFreeRate;
@@ -34,22 +50,82 @@ public:
     /*  Setter */
     void setRiskFreeRate(double riskFreeRate) {
         this->riskFreeRate = riskFreeRate;
+        invalidateFactorsKeepingCholesky();
     }
     /*  Setter */
     void setDate(double date ) {
         this->date = date;
+        invalidateFactorsKeepingCholesky();
     }
     /*  Get the names of the stocks */
-    std::vector<std::string> getStocks() {
+    std::vector<std::string> getStocks() const {
         return stockNames;
     }
 
-    double getStockPrice(const std::string& stock) {
+    double getStockPrice(const std::string& stock) const {
         return stockPrices(getIndex(stock),0);
     }
+    /*  Setter */
+    void setStockPrice(const std::string& stock, double price) {
+        stockPrices(getIndex(stock), 0) = price;
+        invalidateFactorsKeepingCholesky();
+    }
 
-    Matrix getCovarianceMatrix() {
-        return covarianceMatrix;
+    Matrix getCovarianceMatrix() const;
+
+    /*  The lower triangular Cholesky factor of the
+        covariance matrix */
+    const Matrix& getCholeskyFactor() const;
+
+    /*  A hash of the stocks and of the parameters giving their
+        covariances, computed once for each set of parameters.
+        Models with the same hash, risk free rate and date draw
+        the same paths for unit stock prices */
+    unsigned long long getCovarianceHash() const;
+
+    /*  Is the covariance given by a factor model? */
+    bool isFactorModel() const {
+        return factorModel;
+    }
+    /*  The factor loadings of a factor model */
+    const Matrix& getFactorLoadings() const {
+        ASSERT(factorModel);
+        return factorLoadings;
+    }
+    /*  The specific variances of a factor model */
+    const Matrix& getSpecificVariances() const {
+        ASSERT(factorModel);
+        return specificVariances;
+    }
+    /*  Add shocks*transpose(shocks) to the covariance matrix,
+        or subtract it if downdate is set. The Cholesky factor
+        is updated by one rank one update for each column of
+        shocks, costing O(nStocks^2) per column rather than
+        refactoring. Only for models which aren't factor models */
+    void updateCovariance(const Matrix& shocks, bool downdate=0);
+    /*  Add a stock to the model, given its covariances with the
+        existing stocks as a column vector in the order of
+        getStocks. The Cholesky factor is extended by a new row
+        in O(nStocks^2). Only for models which aren't factor
+        models */
+    void addStock(const std::string& stock,
+        double stockPrice,
+        double drift,
+        const Matrix& covariances,
+        double variance);
+    /*  Approximate this model by a factor model with the given
+        number of factors, taken from the principal components
+        of the covariance matrix. The specific variances make up
+        the rest of the variance of each stock */
+    MultiStockModel getFactorModel(int nFactors) const;
+
+    /*  Gets the index of a given stock in the matrices */
+    int getIndex(const std::string&  stockCode)
+            const {
+        auto pos = stockCodeToIndex.find(stockCode);
+        ASSERT(pos != stockCodeToIndex.end());
+        int idx = pos->second;
+        return idx;
     }
 
     /*  Extract the 1-d sub model for a given
@@ -57,9 +133,12 @@ public:
     BlackScholesModel getBlackScholesModel(
         const std::string& stockCode) const;
 
-    /*  Get a sub model that uses only the given stocks */
-    MultiStockModel getSubmodel(
-        std::set<std::string> stocks) const;
+    /*  Get a sub model that uses only the given stocks.
+        Sub models are remembered until the parameters of this
+        model change, so asking again for the same stocks
+        returns the same model, with its factors computed */
+    SPCMultiStockModel getSubmodel(
+        const std::set<std::string>& stocks) const;
 
     /*  Returns a simulation up to the given date
         in the P measure */
@@ -75,11 +154,63 @@ public:
         double toDate,
         int nPaths,
         int nSteps) const;
+    /*  Returns a simulation up to the given date
+        in the Q measure using the given sampling */
+    MarketSimulation generateRiskNeutralPricePaths(
+        std::mt19937& rng,
+        double toDate,
+        int nPaths,
+        int nSteps,
+        const SamplingOptions& sampling) const;
+    /*  Returns a simulation in the Q measure on the given
+        increasing dates, which may be unevenly spaced */
+    MarketSimulation generateRiskNeutralPricePaths(
+        std::mt19937& rng,
+        const std::vector<double>& dates,
+        int nPaths,
+        const SamplingOptions& sampling) const;
+    /*  Simulates paths up to the given date in the Q measure
+        one time step at a time, passing the prices at each step
+        to the accumulator rather than storing them. Returns the
+        likelihood ratios of the paths if they were importance
+        sampled, otherwise an empty pointer */
+    SPCMatrix simulateRiskNeutralPricePaths(
+        std::mt19937& rng,
+        double toDate,
+        int nPaths,
+        int nSteps,
+        const SamplingOptions& sampling,
+        PathAccumulator& accumulator) const;
+    /*  Simulates paths in the Q measure on the given increasing
+        dates, passing the prices on each date to the accumulator */
+    SPCMatrix simulateRiskNeutralPricePaths(
+        std::mt19937& rng,
+        const std::vector<double>& dates,
+        int nPaths,
+        const SamplingOptions& sampling,
+        PathAccumulator& accumulator) const;
     /* How many random numbers are needed
        to generate the given paths? */
     long long randSize(long long nPaths,
-                       long long nSteps) {
-        return stockNames.size()*nPaths*nSteps;
+                       long long nSteps) const {
+        return randSize(nPaths, nSteps, SamplingOptions());
+    }
+    /* How many random numbers are needed
+       to generate the given paths with the given sampling? */
+    long long randSize(long long nPaths,
+                       long long nSteps,
+                       const SamplingOptions& sampling) const {
+        long long nNormals = stockNames.size();
+        if (usesFactorPaths(sampling)) {
+            nNormals += factorLoadings.nCols();
+        }
+        long long ret = nNormals*nPaths*nSteps;
+        if (sampling.method == LATIN_HYPERCUBE) {
+            // extra draws are used to permute the strata
+            ret += nPaths*std::min<long long>(
+                sampling.nDimensions, stockNames.size());
+        }
+        return ret;
     }
     /*  For testing it is useful to have a standard
         dummy name for stocks */
@@ -98,28 +229,143 @@ private:
     Matrix drifts;
     /*  A column vector of current stock prices */
     Matrix stockPrices;
-    /*  The covariance matrix */
+    /*  The covariance matrix, unused by factor models */
     Matrix covarianceMatrix;
+    /*  Is the covariance given by a factor model? */
+    bool factorModel;
+    /*  The factor loadings of a factor model */
+    Matrix factorLoadings;
+    /*  A column vector of the specific variances
+        of a factor model */
+    Matrix specificVariances;
     /*  The risk free rate */
     double riskFreeRate;
     /*  The current date */
     double date;
-    /*  Generate price paths with the given drifts */
-    MarketSimulation generatePricePaths(
+
+    /*  Quantities derived from the parameters that every
+        simulation needs. They are computed once, when first
+        needed, and are shared read only by copies of the
+        model, so they can be used from many threads */
+    class Factors {
+    public:
+        /*  Ensures the factors are only computed once */
+        std::once_flag computed;
+        /*  The Cholesky factor is computed separately, only if
+            needed, as factor models rarely need it */
+        std::once_flag choleskyComputed;
+        /*  The Cholesky factor of the covariance matrix */
+        Matrix cholesky;
+        /*  Has the Cholesky factor been computed? */
+        std::atomic<bool> hasCholesky{ false };
+        /*  Ensures the covariance hash is only computed once */
+        std::once_flag hashComputed;
+        /*  The hash of the stocks and their covariances */
+        unsigned long long covarianceHash;
+        /*  Has the hash been computed? */
+        std::atomic<bool> hasCovarianceHash{ false };
+        /*  A column vector of the log stock prices */
+        Matrix logStockPrices;
+        /*  A column vector of the drifts of the log stock
+            prices in the P measure */
+        Matrix logDrifts;
+        /*  A column vector of the drifts of the log stock
+            prices in the Q measure */
+        Matrix riskNeutralLogDrifts;
+        /*  Guards the sub models */
+        std::mutex submodelMutex;
+        /*  The sub models created so far, keyed by the
+            indices of their stocks in this model */
+        std::map<std::vector<int>, SPCMultiStockModel> submodels;
+    };
+    /*  The cached factors */
+    std::shared_ptr<Factors> factors;
+    /*  Get the factors, computing them if necessary */
+    const Factors& getFactors() const;
+    /*  Create the sub model for the given stock indices,
+        taking its factors from ours, and its Cholesky factor
+        too if the stocks are a leading block of ours */
+    SPCMultiStockModel createSubmodel(
+        const std::vector<int>& indices) const;
+    /*  An entry of the covariance matrix */
+    double covariance(int i, int j) const;
+    /*  Should paths be simulated with the factor model rather
+        than the Cholesky factor? Each step then needs a normal
+        for each factor and each stock but only
+        nStocks*nFactors multiplications, so this is done when
+        there are many fewer factors than stocks and the
+        sampling needs no more than independent draws */
+    bool usesFactorPaths(const SamplingOptions& sampling) const {
+        return factorModel
+            && sampling.method == PSEUDO_RANDOM
+            && sampling.driftShift.empty()
+            && !sampling.momentMatching
+            && 2 * (factorLoadings.nCols() + 1) < stockPrices.nRows();
+    }
+    /*  Discard the factors after the parameters change */
+    void invalidateFactors() {
+        factors = std::make_shared<Factors>();
+    }
+    /*  Discard the factors, keeping a Cholesky
+        factor that is already known */
+    void invalidateFactors(const Matrix& cholesky) {
+        invalidateFactors();
+        Factors& f = *factors;
+        std::call_once(f.choleskyComputed, [&]() {
+            f.cholesky = cholesky;
+            f.hasCholesky = true;
+        });
+    }
+    /*  Discard the factors after a change that leaves the
+        covariance alone, keeping the Cholesky factor and
+        the covariance hash if they have been computed */
+    void invalidateFactorsKeepingCholesky() {
+        std::shared_ptr<Factors> old = factors;
+        if (old && old->hasCholesky) {
+            invalidateFactors(old->cholesky);
+        } else {
+            invalidateFactors();
+        }
+        if (old && old->hasCovarianceHash) {
+            Factors& f = *factors;
+            std::call_once(f.hashComputed, [&]() {
+                f.covarianceHash = old->covarianceHash;
+                f.hasCovarianceHash = true;
+            });
+        }
+    }
+    /*  Simulate price paths on the given dates with
+        the given drifts of the log stock prices */
+    SPCMatrix simulatePricePaths(
         std::mt19937& rng,
-        double toDate,
+        const std::vector<double>& dates,
         int nPaths,
-        int nSteps,
-        Matrix drifts) const;
+        const Matrix& logDrifts,
+        const SamplingOptions& sampling,
+        PathAccumulator& accumulator) const;
+    /*  Simulate price paths with the factor model */
+    SPCMatrix simulateFactorPricePaths(
+        std::mt19937& rng,
+        const std::vector<double>& dates,
+        int nPaths,
+        const Matrix& logDrifts,
+        PathAccumulator& accumulator) const;
+    /*  Draw the normals for one time step */
+    Matrix drawNormals(
+        std::mt19937& rng,
+        int nPaths,
+        const SamplingOptions& sampling) const;
+    /*  Simulate price paths by first sampling the terminal
+        value of the Brownian motion and then filling in the
+        path with a Brownian bridge */
+    SPCMatrix simulateBridgedPricePaths(
+        std::mt19937& rng,
+        const std::vector<double>& dates,
+        int nPaths,
+        const Matrix& logDrifts,
+        const SamplingOptions& sampling,
+        PathAccumulator& accumulator) const;
 
-    /*  Gets the index of a given stock in the matrices */
-    int getIndex(const std::string&  stockCode)
-            const {
-        auto pos = stockCodeToIndex.find(stockCode);
-        ASSERT(pos != stockCodeToIndex.end());
-        int idx = pos->second;
-        return idx;
-    }
 };
 
 
@@ -0,0 +1,305 @@
+#include "MultilevelPricer.h"
+
+#include "matlib.h"
+#include "CallOption.h"
+#include "UpAndOutOption.h"
+
+using namespace std;
+
+MultilevelPricer::MultilevelPricer() :
+    targetRmse(0.01),
+    initialSteps(1),
+    refinement(2),
+    nInitialScenarios(10000),
+    maxLevels(12),
+    confidenceLevel(0.95) {
+}
+
+/*  Statistics of the payoff differences on one level */
+class LevelStatistics {
+public:
+    LevelStatistics() :
+        nScenarios(0),
+        total(0.0),
+        totalSq(0.0) {
+    }
+    /*  The number of scenarios simulated */
+    long long nScenarios;
+    /*  The sum of the differences */
+    double total;
+    /*  The sum of the squared differences */
+    double totalSq;
+    /*  The mean difference */
+    double mean() const {
+        return total / nScenarios;
+    }
+    /*  The sample variance of the differences */
+    double variance() const {
+        if (nScenarios < 2) {
+            return 0.0;
+        }
+        double ret = (totalSq - total*total / nScenarios)
+            / (nScenarios - 1);
+        return max(ret, 0.0);
+    }
+};
+
+/**
+ *  Create a coarse simulation from a fine one by only
+ *  keeping every refinement'th time point. Since the log
+ *  prices are simulated exactly, this is the same as driving
+ *  the coarse path with the sum of the fine increments.
+ *  The fine simulation's handles follow the order of stocks.
+ */
+static MarketSimulation coarsen(
+        const MarketSimulation& fine,
+        const vector<string>& stocks,
+        int refinement) {
+    MarketSimulation coarse;
+    for (int j = 0; j < (int)stocks.size(); j++) {
+        const Matrix& finePrices = fine.getStockPrices(j);
+        int nSteps = finePrices.nCols() / refinement;
+        SPMatrix prices(new Matrix(finePrices.nRows(), nSteps, false));
+        for (int i = 0; i < nSteps; i++) {
+            prices->setCol(i, finePrices, (i + 1)*refinement - 1);
+        }
+        coarse.addSimulation(stocks[j], prices);
+    }
+    return coarse;
+}
+
+/**
+ *  Simulate more scenarios on a level, recording the
+ *  difference between the fine and coarse payoffs
+ */
+static void sampleLevel(
+        mt19937& rng,
+        const ContinuousTimeOption& option,
+        const MultiStockModel& model,
+        const vector<string>& stocks,
+        int nSteps,
+        int refinement,
+        bool coupled,
+        long long nScenarios,
+        LevelStatistics& statistics) {
+    // We price at most one million steps at a time to avoid running out of memory
+    long long batchSize = max(1, 1000000 / nSteps);
+    while (nScenarios > 0) {
+        int thisBatch = (int)min(nScenarios, batchSize);
+        MarketSimulation fine = model.generateRiskNeutralPricePaths(
+            rng, option.getMaturity(), thisBatch, nSteps);
+        Matrix differences = option.payoff(fine);
+        if (coupled) {
+            differences -= option.payoff(
+                coarsen(fine, stocks, refinement));
+        }
+        for (int p = 0; p < thisBatch; p++) {
+            double x = differences(p);
+            statistics.total += x;
+            statistics.totalSq += x*x;
+        }
+        statistics.nScenarios += thisBatch;
+        nScenarios -= thisBatch;
+    }
+}
+
+double MultilevelPricer::price(
+    const ContinuousTimeOption& option,
+    const MultiStockModel& model) const {
+    return evaluate(option, model).price;
+}
+
+/**
+ *   Price the option following Giles' adaptive algorithm.
+ *   Given the variance V_l and the cost C_l of a sample on each
+ *   level, the variance of the estimate is below half the target
+ *   mean square error when level l has
+ *      2/eps^2 * sqrt(V_l/C_l) * sum_k sqrt(V_k C_k)
+ *   samples. Once every level has enough samples, we estimate
+ *   the remaining bias from the last two levels and add a
+ *   level if it exceeds eps/sqrt(2).
+ */
+PricingResult MultilevelPricer::evaluate(
+    const ContinuousTimeOption& option,
+    const MultiStockModel& model) const {
+    ASSERT(targetRmse > 0);
+    ASSERT(initialSteps >= 1);
+    ASSERT(refinement >= 2);
+    ASSERT(maxLevels >= 2);
+    set<double> monitoringDates;
+    if (option.isPathDependent()
+            && option.getMonitoringDates(monitoringDates)) {
+        // each level simulates its own equally spaced dates, so
+        // payoff would monitor the prices on the wrong dates
+        throw runtime_error(
+            "MultilevelPricer can't price discretely monitored options");
+    }
+
+    SPCMultiStockModel subModel = model.getSubmodel(option.getStocks());
+    vector<string> stocks = subModel->getStocks();
+    double r = model.getRiskFreeRate();
+    double T = option.getMaturity() - model.getDate();
+    double discount = exp(-r*T);
+    // we work with undiscounted payoffs
+    double epsilon = targetRmse / discount;
+
+    auto start = chrono::steady_clock::now();
+    mt19937 rng;
+    vector<LevelStatistics> levels(2);
+    vector<long long> extra(2, nInitialScenarios);
+    vector<int> steps({ initialSteps, initialSteps*refinement });
+
+    bool converged = false;
+    while (!converged) {
+        int nLevels = levels.size();
+        for (int l = 0; l < nLevels; l++) {
+            if (extra[l] > 0) {
+                sampleLevel(rng, option, *subModel, stocks, steps[l],
+                    refinement, l > 0, extra[l], levels[l]);
+                extra[l] = 0;
+            }
+        }
+
+        double sumRootVC = 0.0;
+        for (int l = 0; l < nLevels; l++) {
+            sumRootVC += sqrt(levels[l].variance()*steps[l]);
+        }
+        bool enoughSamples = true;
+        for (int l = 0; l < nLevels; l++) {
+            double optimal = 2.0 / (epsilon*epsilon)
+                * sqrt(levels[l].variance() / steps[l]) * sumRootVC;
+            extra[l] = max(0LL,
+                (long long)ceil(optimal) - levels[l].nScenarios);
+            if (extra[l] > 0.01*levels[l].nScenarios) {
+                enoughSamples = false;
+            }
+        }
+        if (!enoughSamples) {
+            continue;
+        }
+
+        // estimate the weak order of convergence from the
+        // last two levels, assuming it is at least 1/2
+        double last = fabs(levels[nLevels - 1].mean());
+        double previous = fabs(levels[nLevels - 2].mean());
+        double alpha = 0.5;
+        if (nLevels > 2 && last > 0 && previous > last) {
+            alpha = max(alpha, log(previous / last) / log(refinement));
+        }
+        double factor = pow(refinement, alpha);
+        double bias = max(last, previous / factor) / (factor - 1);
+        if (bias <= epsilon / sqrt(2.0)) {
+            converged = true;
+        } else if (nLevels >= maxLevels) {
+            DEBUG_PRINT("Multilevel Monte Carlo did not converge, "
+                << "estimated bias " << bias*discount);
+            converged = true;
+        } else {
+            levels.push_back(LevelStatistics());
+            extra.push_back(nInitialScenarios);
+            steps.push_back(steps.back()*refinement);
+        }
+    }
+
+    PricingResult result;
+    double total = 0.0;
+    double variance = 0.0;
+    for (auto& level : levels) {
+        total += level.mean();
+        variance += level.variance() / level.nScenarios;
+        result.nScenarios += level.nScenarios;
+    }
+    result.setPrice(discount*total, discount*sqrt(variance),
+        confidenceLevel);
+    chrono::duration<double> elapsed = chrono::steady_clock::now() - start;
+    result.elapsedSeconds = elapsed.count();
+    return result;
+}
+
+//////////////////////////////////////
+//
+//   Tests
+//
+//////////////////////////////////////
+
+/*  Price of a continuously monitored up and out call
+    with barrier above the strike */
+static double upAndOutCallPrice(double S, double K, double H,
+        double sigma, double r, double T) {
+    double rootT = sqrt(T);
+    double lambda = (r + 0.5*sigma*sigma) / (sigma*sigma);
+    double x1 = log(S / H) / (sigma*rootT) + lambda*sigma*rootT;
+    double y = log(H*H / (S*K)) / (sigma*rootT) + lambda*sigma*rootT;
+    double y1 = log(H / S) / (sigma*rootT) + lambda*sigma*rootT;
+    double df = exp(-r*T);
+    double upAndIn = S*normcdf(x1) - K*df*normcdf(x1 - sigma*rootT)
+        - S*pow(H / S, 2 * lambda)*(normcdf(-y) - normcdf(-y1))
+        + K*df*pow(H / S, 2 * lambda - 2)
+            *(normcdf(-y + sigma*rootT) - normcdf(-y1 + sigma*rootT));
+    double d1 = (log(S / K) + (r + 0.5*sigma*sigma)*T) / (sigma*rootT);
+    double d2 = d1 - sigma*rootT;
+    double call = S*normcdf(d1) - K*df*normcdf(d2);
+    return call - upAndIn;
+}
+
+static void testPriceBarrierOption() {
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+    MultiStockModel msm(m);
+
+    UpAndOutOption o;
+    o.setStrike(100);
+    o.setBarrier(130);
+    o.setMaturity(1.0);
+
+    MultilevelPricer pricer;
+    pricer.targetRmse = 0.05;
+    PricingResult result = pricer.evaluate(o, msm);
+    double expected = upAndOutCallPrice(100, 100, 130, 0.2, 0.05, 1.0);
+    ASSERT(result.standardError < pricer.targetRmse);
+    ASSERT_APPROX_EQUAL(result.price, expected, 3 * pricer.targetRmse);
+}
+
+static void testPricePathIndependentOption() {
+    BlackScholesModel m;
+    m.volatility = 0.2;
+    m.riskFreeRate = 0.05;
+    m.stockPrice = 100.0;
+    MultiStockModel msm(m);
+
+    CallOption c;
+    c.setStrike(100);
+    c.setMaturity(1.0);
+
+    MultilevelPricer pricer;
+    pricer.targetRmse = 0.05;
+    double price = pricer.price(c, msm);
+    ASSERT_APPROX_EQUAL(price, c.price(msm), 3 * pricer.targetRmse);
+}
+
+static void testRefuseDiscreteMonitoring() {
+    UpAndOutOption o;
+    o.setStrike(100);
+    o.setBarrier(120);
+    o.setMaturity(1.0);
+    o.setMonitoringDates(vector<double>({ 0.5 }));
+    BlackScholesModel bsm;
+    bsm.stockPrice = 100;
+    MultiStockModel msm(bsm);
+    MultilevelPricer pricer;
+    bool thrown = false;
+    try {
+        pricer.price(o, msm);
+    } catch (const runtime_error&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testMultilevelPricer() {
+    TEST(testPriceBarrierOption);
+    TEST(testRefuseDiscreteMonitoring);
+    TEST(testPricePathIndependentOption);
+}
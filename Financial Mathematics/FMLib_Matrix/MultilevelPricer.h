@@ -0,0 +1,50 @@
+#ifndef MULTILEVELPRICER_H_INCLUDED
+#define MULTILEVELPRICER_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+#include "ContinuousTimeOption.h"
+#include "MultiStockModel.h"
+#include "PricingResult.h"
+
+/**
+ *   Prices path dependent options by multilevel Monte Carlo.
+ *
+ *   Level l simulates paths with initialSteps*refinement^l
+ *   steps. Each level after the first estimates the difference
+ *   between the payoff on the fine path and on a coarse path
+ *   with refinement times fewer steps driven by the same
+ *   Brownian motion. The number of levels and the number of
+ *   paths on each level are chosen from the estimated variances
+ *   so that the root mean square error is below targetRmse.
+ */
+class MultilevelPricer {
+public:
+    /*  Constructor */
+    MultilevelPricer();
+    /*  The target root mean square error */
+    double targetRmse;
+    /*  The number of steps on the coarsest level */
+    int initialSteps;
+    /*  The factor by which the steps increase on each level */
+    int refinement;
+    /*  The number of scenarios used to first estimate
+        the variance on a level */
+    int nInitialScenarios;
+    /*  The maximum number of levels */
+    int maxLevels;
+    /*  The confidence level of the confidence interval */
+    double confidenceLevel;
+    /*  Price a path dependent option */
+    double price(const ContinuousTimeOption& option,
+        const MultiStockModel& model) const;
+    /*  Price a path dependent option returning the price
+        together with an estimate of its accuracy */
+    PricingResult evaluate(const ContinuousTimeOption& option,
+        const MultiStockModel& model) const;
+};
+
+void testMultilevelPricer();
+
+#endif // MULTILEVELPRICER_H_INCLUDED
@@ -0,0 +1,182 @@
+#include "PathAccumulator.h"
+
+#include "matlib.h"
+
+using namespace std;
+
+LastValue::LastValue(int stockIndex, int nPaths) :
+    stockIndex(stockIndex),
+    values(nPaths, 1) {
+}
+
+void LastValue::observe(int step, const Matrix& prices) {
+    values.setCol(0, prices, stockIndex);
+}
+
+RunningMaximum::RunningMaximum(int stockIndex, int nPaths) :
+    stockIndex(stockIndex),
+    values(nPaths, 1, false) {
+    for (double* p = values.begin(); p != values.end(); p++) {
+        *p = -numeric_limits<double>::infinity();
+    }
+}
+
+void RunningMaximum::observe(int step, const Matrix& prices) {
+    const double* s = prices.begin() + prices.offset(0, stockIndex);
+    double* v = values.begin();
+    int nPaths = values.nRows();
+    for (int p = 0; p < nPaths; p++) {
+        v[p] = max(v[p], s[p]);
+    }
+}
+
+RunningMinimum::RunningMinimum(int stockIndex, int nPaths) :
+    stockIndex(stockIndex),
+    values(nPaths, 1, false) {
+    for (double* p = values.begin(); p != values.end(); p++) {
+        *p = numeric_limits<double>::infinity();
+    }
+}
+
+void RunningMinimum::observe(int step, const Matrix& prices) {
+    const double* s = prices.begin() + prices.offset(0, stockIndex);
+    double* v = values.begin();
+    int nPaths = values.nRows();
+    for (int p = 0; p < nPaths; p++) {
+        v[p] = min(v[p], s[p]);
+    }
+}
+
+RunningSum::RunningSum(int stockIndex, int nPaths) :
+    stockIndex(stockIndex),
+    count(0),
+    values(nPaths, 1) {
+}
+
+void RunningSum::observe(int step, const Matrix& prices) {
+    const double* s = prices.begin() + prices.offset(0, stockIndex);
+    double* v = values.begin();
+    int nPaths = values.nRows();
+    for (int p = 0; p < nPaths; p++) {
+        v[p] += s[p];
+    }
+    count++;
+}
+
+BarrierHit::BarrierHit(int stockIndex, int nPaths,
+        double barrier, bool up) :
+    stockIndex(stockIndex),
+    barrier(barrier),
+    up(up),
+    values(nPaths, 1) {
+}
+
+void BarrierHit::observe(int step, const Matrix& prices) {
+    const double* s = prices.begin() + prices.offset(0, stockIndex);
+    double* v = values.begin();
+    int nPaths = values.nRows();
+    for (int p = 0; p < nPaths; p++) {
+        if (up ? s[p] >= barrier : s[p] <= barrier) {
+            v[p] = 1.0;
+        }
+    }
+}
+
+PathRecorder::PathRecorder(const vector<string>& stocks,
+        int nPaths, int nSteps) :
+    stocks(stocks) {
+    for (int j = 0; j < (int)stocks.size(); j++) {
+        paths.push_back(SPMatrix(new Matrix(nPaths, nSteps, false)));
+    }
+}
+
+void PathRecorder::observe(int step, const Matrix& prices) {
+    for (int j = 0; j < (int)stocks.size(); j++) {
+        paths[j]->setCol(step, prices, j);
+    }
+}
+
+MarketSimulation PathRecorder::getSimulation() const {
+    MarketSimulation sim;
+    for (int j = 0; j < (int)stocks.size(); j++) {
+        sim.addSimulation(stocks[j], paths[j]);
+    }
+    return sim;
+}
+
+//////////////////////////////////////
+//
+//   Tests
+//
+//////////////////////////////////////
+
+static void testRunningStatistics() {
+    // two paths of two stocks, we watch the second stock
+    Matrix step0("1,10;2,20");
+    Matrix step1("1,30;2,5");
+    Matrix step2("1,15;2,12");
+
+    LastValue last(1, 2);
+    RunningMaximum maximum(1, 2);
+    RunningMinimum minimum(1, 2);
+    RunningSum sum(1, 2);
+    BarrierHit up(1, 2, 25, true);
+    BarrierHit down(1, 2, 5, false);
+    vector<PathAccumulator*> accumulators(
+        { &last, &maximum, &minimum, &sum, &up, &down });
+    int step = 0;
+    for (auto prices : { step0, step1, step2 }) {
+        for (auto a : accumulators) {
+            a->observe(step, prices);
+        }
+        step++;
+    }
+    Matrix("15;12").assertEquals(last.getValues(), 0.001);
+    Matrix("30;20").assertEquals(maximum.getValues(), 0.001);
+    Matrix("10;5").assertEquals(minimum.getValues(), 0.001);
+    Matrix("55;37").assertEquals(sum.getValues(), 0.001);
+    ASSERT(sum.getCount() == 3);
+    Matrix("1;0").assertEquals(up.getValues(), 0.001);
+    Matrix("0;1").assertEquals(down.getValues(), 0.001);
+}
+
+static void testPathRecorder() {
+    PathRecorder recorder(vector<string>({ "A", "B" }), 2, 2);
+    recorder.observe(0, Matrix("1,10;2,20"));
+    recorder.observe(1, Matrix("3,30;4,40"));
+    MarketSimulation sim = recorder.getSimulation();
+    Matrix("1,3;2,4").assertEquals(*sim.getStockPrices("A"), 0.001);
+    Matrix("10,30;20,40").assertEquals(*sim.getStockPrices("B"), 0.001);
+    // handles follow the order of the stocks
+    ASSERT(sim.nStocks() == 2);
+    ASSERT(sim.getStockIndex("A") == 0);
+    ASSERT(sim.getStockIndex("B") == 1);
+    Matrix("10,30;20,40").assertEquals(sim.getStockPrices(1), 0.001);
+}
+
+/*  Claims to use log prices but doesn't observe them */
+class LogPricesNotObserved : public PathAccumulator {
+public:
+    void observe(int step, const Matrix& prices) {
+    }
+    bool usesLogPrices() const {
+        return true;
+    }
+};
+
+static void testLogPricesNotObserved() {
+    LogPricesNotObserved accumulator;
+    bool thrown = false;
+    try {
+        accumulator.observeLogPrices(0, Matrix("0;1"));
+    } catch (const runtime_error&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testPathAccumulator() {
+    TEST(testRunningStatistics);
+    TEST(testPathRecorder);
+    TEST(testLogPricesNotObserved);
+}
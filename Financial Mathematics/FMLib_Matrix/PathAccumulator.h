@@ -0,0 +1,159 @@
+#ifndef PATHACCUMULATOR_H_INCLUDED
+#define PATHACCUMULATOR_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+#include "Matrix.h"
+#include "MarketSimulation.h"
+
+/**
+ *   Receives the prices of every path one time step at a time
+ *   as a simulation proceeds and keeps whatever running
+ *   statistics it needs, so that the full paths never have
+ *   to be stored.
+ */
+class PathAccumulator {
+public:
+    /*  Virtual destructor */
+    virtual ~PathAccumulator() {}
+    /*  Observe the prices at the given time step. Row p, column j
+        of prices is the price of the j'th stock of the model on
+        path p */
+    virtual void observe(int step, const Matrix& prices) = 0;
+    /*  Are the prices at the given step of nSteps needed?
+        The simulation skips computing prices nobody needs */
+    virtual bool needsStep(int step, int nSteps) const {
+        return true;
+    }
+    /*  Should the simulation pass the log prices to
+        observeLogPrices instead of the prices to observe? This
+        saves computing exponentials when prices are only
+        compared, since log preserves the order of prices */
+    virtual bool usesLogPrices() const {
+        return false;
+    }
+    /*  Observe the log prices at the given time step.
+        Accumulators that use log prices must override this,
+        otherwise it throws */
+    virtual void observeLogPrices(int step, const Matrix& logPrices) {
+        throw std::runtime_error(
+            "The accumulator doesn't observe log prices");
+    }
+};
+
+/**
+ *   An accumulator which can compute the payoff of an option
+ *   once every time step has been observed
+ */
+class PayoffAccumulator : public PathAccumulator {
+public:
+    /*  Virtual destructor */
+    virtual ~PayoffAccumulator() {}
+    /*  The payoff of each path */
+    virtual Matrix payoff() const = 0;
+    /*  Does the accumulator store the whole of each path? */
+    virtual bool storesPaths() const {
+        return false;
+    }
+};
+
+typedef std::shared_ptr<PayoffAccumulator> SPPayoffAccumulator;
+
+/*  Records the last price of one stock */
+class LastValue : public PathAccumulator {
+public:
+    LastValue(int stockIndex, int nPaths);
+    void observe(int step, const Matrix& prices);
+    /*  The most recent price on each path */
+    const Matrix& getValues() const {
+        return values;
+    }
+private:
+    int stockIndex;
+    Matrix values;
+};
+
+/*  Records the maximum price of one stock */
+class RunningMaximum : public PathAccumulator {
+public:
+    RunningMaximum(int stockIndex, int nPaths);
+    void observe(int step, const Matrix& prices);
+    /*  The maximum price on each path so far */
+    const Matrix& getValues() const {
+        return values;
+    }
+private:
+    int stockIndex;
+    Matrix values;
+};
+
+/*  Records the minimum price of one stock */
+class RunningMinimum : public PathAccumulator {
+public:
+    RunningMinimum(int stockIndex, int nPaths);
+    void observe(int step, const Matrix& prices);
+    /*  The minimum price on each path so far */
+    const Matrix& getValues() const {
+        return values;
+    }
+private:
+    int stockIndex;
+    Matrix values;
+};
+
+/*  Records the sum of the prices of one stock, for example
+    to compute an average price */
+class RunningSum : public PathAccumulator {
+public:
+    RunningSum(int stockIndex, int nPaths);
+    void observe(int step, const Matrix& prices);
+    /*  The sum of the prices on each path so far */
+    const Matrix& getValues() const {
+        return values;
+    }
+    /*  The number of time steps observed */
+    int getCount() const {
+        return count;
+    }
+private:
+    int stockIndex;
+    int count;
+    Matrix values;
+};
+
+/*  Records whether the price of one stock has reached a
+    barrier, from below if up is set, otherwise from above */
+class BarrierHit : public PathAccumulator {
+public:
+    BarrierHit(int stockIndex, int nPaths, double barrier, bool up);
+    void observe(int step, const Matrix& prices);
+    /*  One on the paths that have hit the barrier,
+        zero elsewhere */
+    const Matrix& getValues() const {
+        return values;
+    }
+private:
+    int stockIndex;
+    double barrier;
+    bool up;
+    Matrix values;
+};
+
+/*  Stores every price so that a MarketSimulation
+    can be created at the end */
+class PathRecorder : public PathAccumulator {
+public:
+    PathRecorder(const std::vector<std::string>& stocks,
+        int nPaths, int nSteps);
+    void observe(int step, const Matrix& prices);
+    /*  The recorded simulation */
+    MarketSimulation getSimulation() const;
+private:
+    std::vector<std::string> stocks;
+    std::vector<SPMatrix> paths;
+};
+
+void testPathAccumulator();
+
+#endif // PATHACCUMULATOR_H_INCLUDED
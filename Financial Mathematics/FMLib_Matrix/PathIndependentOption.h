@@ -16,6 +16,20 @@ public:
         of scenarios */
     virtual Matrix payoffAtMaturity( const Matrix& finalStockPrice) const
         = 0;
+    /*  Record the payoff at maturity on a tape */
+    virtual AdjointMatrix adjointPayoffAtMaturity(
+            const AdjointMatrix& finalStockPrice) const {
+        ASSERT(false);
+        return finalStockPrice;
+    }
+    /*  Record the payoff from the column of our stock */
+    AdjointMatrix adjointPayoff(const AdjointMatrix& finalPrices,
+            const std::vector<std::string>& stocks) const {
+        auto pos = std::find(stocks.begin(), stocks.end(), getStock());
+        ASSERT(pos != stocks.end());
+        return adjointPayoffAtMaturity(
+            col(finalPrices, pos - stocks.begin()));
+    }
     /*  Compute the payoff from a price path */
     Matrix payoff(
             const Matrix& stockPrices ) const {
@@ -25,4 +39,21 @@ public:
     bool isPathDependent() const {
         return false;
     };
+    /*  Only the price at maturity is monitored */
+    bool getMonitoringDates(std::set<double>& dates) const {
+        dates.insert(getMaturity());
+        return true;
+    }
+    /*  Only the final price is needed */
+    bool getPathRequirements(
+            PathRequirements& requirements) const {
+        requirements.require(getStock(), TERMINAL_VALUE);
+        return true;
+    }
+    /*  Compute the payoff from the final price */
+    Matrix payoffFromStatistics(
+            const PathStatistics& statistics) const {
+        return payoffAtMaturity(
+            statistics.get(getStock(), TERMINAL_VALUE));
+    }
 };
@@ -0,0 +1,288 @@
+#include "PathRequirements.h"
+
+#include "matlib.h"
+
+using namespace std;
+
+void PathRequirements::add(const PathRequirements& other) {
+    for (auto& entry : other.statistics) {
+        statistics[entry.first].insert(
+            entry.second.begin(), entry.second.end());
+    }
+    for (auto& entry : other.dates) {
+        dates[entry.first].insert(
+            entry.second.begin(), entry.second.end());
+    }
+}
+
+bool PathRequirements::needsEveryStep() const {
+    for (auto& entry : statistics) {
+        for (PathStatistic statistic : entry.second) {
+            if (statistic != TERMINAL_VALUE) {
+                return true;
+            }
+        }
+    }
+    return false;
+}
+
+/*  The statistics being computed for one stock */
+class StatisticsAccumulator::StockStatistics {
+public:
+    StockStatistics(const string& stock, int index, int nPaths) :
+        stock(stock),
+        index(index),
+        nPaths(nPaths) {
+    }
+    string stock;
+    int index;
+    int nPaths;
+    shared_ptr<LastValue> terminal;
+    shared_ptr<RunningMaximum> maximum;
+    shared_ptr<RunningMinimum> minimum;
+    shared_ptr<RunningSum> sum;
+    /*  The prices on the required dates */
+    Matrix values;
+    /*  The step at which each column of values is recorded */
+    vector<int> valueSteps;
+
+    void observe(int step, const Matrix& prices) {
+        for (auto a : { (PathAccumulator*)terminal.get(),
+                (PathAccumulator*)maximum.get(),
+                (PathAccumulator*)minimum.get(),
+                (PathAccumulator*)sum.get() }) {
+            if (a) {
+                a->observe(step, prices);
+            }
+        }
+        for (int d = 0; d < (int)valueSteps.size(); d++) {
+            if (valueSteps[d] == step) {
+                values.setCol(d, prices, index);
+            }
+        }
+    }
+};
+
+StatisticsAccumulator::StatisticsAccumulator(
+        const PathRequirements& requirements,
+        const MultiStockModel& model,
+        const vector<double>& dates,
+        int nPaths) :
+    everyStep(requirements.needsEveryStep()),
+    logSpace(false),
+    dateSteps(dates.size(), false) {
+    map<string, shared_ptr<StockStatistics> > byStock;
+    auto getStock = [&](const string& stock) {
+        auto& ret = byStock[stock];
+        if (!ret) {
+            ret = make_shared<StockStatistics>(stock,
+                model.getIndex(stock), nPaths);
+            stocks.push_back(ret);
+        }
+        return ret;
+    };
+    for (auto& entry : requirements.getStatistics()) {
+        auto s = getStock(entry.first);
+        int index = s->index;
+        for (PathStatistic statistic : entry.second) {
+            switch (statistic) {
+            case TERMINAL_VALUE:
+                s->terminal = make_shared<LastValue>(index, nPaths);
+                break;
+            case RUNNING_MAXIMUM:
+                s->maximum = make_shared<RunningMaximum>(index, nPaths);
+                break;
+            case RUNNING_MINIMUM:
+                s->minimum = make_shared<RunningMinimum>(index, nPaths);
+                break;
+            case RUNNING_AVERAGE:
+                s->sum = make_shared<RunningSum>(index, nPaths);
+                break;
+            }
+        }
+    }
+    // a date is observed at the first simulated date on or after
+    // it. Dates which have passed or are after the last simulated
+    // date are dropped, as in ContinuousTimeOption::getTimeGrid
+    double lastDate = dates.empty() ? model.getDate() : dates.back();
+    for (auto& entry : requirements.getDates()) {
+        auto s = getStock(entry.first);
+        for (double date : entry.second) {
+            if (date <= model.getDate() + DATE_TOLERANCE
+                    || date > lastDate + DATE_TOLERANCE) {
+                continue;
+            }
+            auto pos = lower_bound(dates.begin(), dates.end(),
+                date - DATE_TOLERANCE);
+            int step = pos - dates.begin();
+            s->valueSteps.push_back(step);
+            dateSteps[step] = true;
+        }
+        if (!s->valueSteps.empty()) {
+            s->values = Matrix(nPaths, s->valueSteps.size());
+        }
+    }
+}
+
+void StatisticsAccumulator::observe(int step, const Matrix& prices) {
+    for (auto& s : stocks) {
+        s->observe(step, prices);
+    }
+}
+
+bool StatisticsAccumulator::usesLogPrices() const {
+    for (auto& s : stocks) {
+        if (s->sum) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void StatisticsAccumulator::observeLogPrices(int step,
+        const Matrix& logPrices) {
+    // the maximum and minimum of the log prices are the
+    // logs of the maximum and minimum prices
+    logSpace = true;
+    observe(step, logPrices);
+}
+
+bool StatisticsAccumulator::needsStep(int step, int nSteps) const {
+    return everyStep || step == nSteps - 1 || dateSteps[step];
+}
+
+PathStatistics StatisticsAccumulator::getStatistics() const {
+    // only now do we need the price levels
+    auto prices = [this](const Matrix& values) {
+        return logSpace ? exp(values) : values;
+    };
+    PathStatistics ret;
+    for (auto& s : stocks) {
+        if (s->terminal) {
+            ret.set(s->stock, TERMINAL_VALUE,
+                prices(s->terminal->getValues()));
+        }
+        if (s->maximum) {
+            ret.set(s->stock, RUNNING_MAXIMUM,
+                prices(s->maximum->getValues()));
+        }
+        if (s->minimum) {
+            ret.set(s->stock, RUNNING_MINIMUM,
+                prices(s->minimum->getValues()));
+        }
+        if (s->sum) {
+            Matrix average = s->sum->getValues();
+            average *= 1.0 / s->sum->getCount();
+            ret.set(s->stock, RUNNING_AVERAGE, average);
+        }
+        if (!s->valueSteps.empty()) {
+            ret.setValues(s->stock, prices(s->values));
+        }
+    }
+    return ret;
+}
+
+//////////////////////////////////////
+//
+//   Tests
+//
+//////////////////////////////////////
+
+static void testStatisticsMatchPaths() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    int nPaths = 100;
+    int nSteps = 12;
+    PathRequirements requirements;
+    requirements.require("Acme", TERMINAL_VALUE);
+    requirements.require("Bigbank", RUNNING_MAXIMUM);
+    requirements.require("Bigbank", RUNNING_AVERAGE);
+    requirements.require("Chumhum", RUNNING_MINIMUM);
+    requirements.requireDates("Acme", vector<double>({ 0.25, 0.5 }));
+    ASSERT(requirements.needsEveryStep());
+
+    mt19937 rng1;
+    MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+        rng1, 1.0, nPaths, nSteps);
+    mt19937 rng2;
+    vector<double> dates;
+    for (int i = 1; i <= nSteps; i++) {
+        dates.push_back(i / (double)nSteps);
+    }
+    StatisticsAccumulator accumulator(requirements, msm, dates, nPaths);
+    msm.simulateRiskNeutralPricePaths(rng2, dates, nPaths,
+        SamplingOptions(), accumulator);
+    PathStatistics statistics = accumulator.getStatistics();
+
+    SPCMatrix acme = sim.getStockPrices("Acme");
+    SPCMatrix bigbank = sim.getStockPrices("Bigbank");
+    SPCMatrix chumhum = sim.getStockPrices("Chumhum");
+    acme->col(nSteps - 1).assertEquals(
+        statistics.get("Acme", TERMINAL_VALUE), 1e-10);
+    maxOverRows(*bigbank).assertEquals(
+        statistics.get("Bigbank", RUNNING_MAXIMUM), 1e-10);
+    meanRows(*bigbank).assertEquals(
+        statistics.get("Bigbank", RUNNING_AVERAGE), 1e-10);
+    minOverRows(*chumhum).assertEquals(
+        statistics.get("Chumhum", RUNNING_MINIMUM), 1e-10);
+    const Matrix& values = statistics.getValues("Acme");
+    acme->col(2).assertEquals(values.col(0), 1e-10);
+    acme->col(5).assertEquals(values.col(1), 1e-10);
+}
+
+static void testOnlyNeededStepsObserved() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    PathRequirements requirements;
+    requirements.require("Acme", TERMINAL_VALUE);
+    requirements.requireDates("Bigbank", vector<double>({ 0.5 }));
+    ASSERT(!requirements.needsEveryStep());
+    vector<double> dates({ 0.25, 0.5, 0.75, 1.0 });
+    StatisticsAccumulator accumulator(requirements, msm, dates, 10);
+    ASSERT(!accumulator.needsStep(0, 4));
+    ASSERT(accumulator.needsStep(1, 4));
+    ASSERT(!accumulator.needsStep(2, 4));
+    ASSERT(accumulator.needsStep(3, 4));
+}
+
+static void testLogPrices() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    int nPaths = 100;
+    int nSteps = 12;
+    PathRequirements requirements;
+    requirements.require("Acme", TERMINAL_VALUE);
+    requirements.require("Bigbank", RUNNING_MAXIMUM);
+    requirements.require("Chumhum", RUNNING_MINIMUM);
+    requirements.requireDates("Acme", vector<double>({ 0.5 }));
+    vector<double> dates;
+    for (int i = 1; i <= nSteps; i++) {
+        dates.push_back(i / (double)nSteps);
+    }
+    StatisticsAccumulator accumulator(requirements, msm, dates, nPaths);
+    ASSERT(accumulator.usesLogPrices());
+
+    mt19937 rng1;
+    MarketSimulation sim = msm.generateRiskNeutralPricePaths(
+        rng1, 1.0, nPaths, nSteps);
+    mt19937 rng2;
+    msm.simulateRiskNeutralPricePaths(rng2, dates, nPaths,
+        SamplingOptions(), accumulator);
+    PathStatistics statistics = accumulator.getStatistics();
+    SPCMatrix acme = sim.getStockPrices("Acme");
+    acme->col(nSteps - 1).assertEquals(
+        statistics.get("Acme", TERMINAL_VALUE), 1e-9);
+    acme->col(5).assertEquals(statistics.getValues("Acme"), 1e-9);
+    maxOverRows(*sim.getStockPrices("Bigbank")).assertEquals(
+        statistics.get("Bigbank", RUNNING_MAXIMUM), 1e-9);
+    minOverRows(*sim.getStockPrices("Chumhum")).assertEquals(
+        statistics.get("Chumhum", RUNNING_MINIMUM), 1e-9);
+
+    // averages need the price levels
+    requirements.require("Acme", RUNNING_AVERAGE);
+    StatisticsAccumulator withAverage(requirements, msm, dates, nPaths);
+    ASSERT(!withAverage.usesLogPrices());
+}
+
+void testPathRequirements() {
+    TEST(testStatisticsMatchPaths);
+    TEST(testOnlyNeededStepsObserved);
+    TEST(testLogPrices);
+}
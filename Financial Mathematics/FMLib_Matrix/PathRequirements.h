@@ -0,0 +1,126 @@
+#ifndef PATHREQUIREMENTS_H_INCLUDED
+#define PATHREQUIREMENTS_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+#include "Matrix.h"
+#include "MultiStockModel.h"
+#include "PathAccumulator.h"
+
+/*  Dates closer than this are treated as equal */
+const double DATE_TOLERANCE = 1e-9;
+
+/*  The statistics of the path of a stock
+    that a payoff may need */
+enum PathStatistic {
+    /*  The price at maturity */
+    TERMINAL_VALUE,
+    /*  The maximum price over the simulated dates */
+    RUNNING_MAXIMUM,
+    /*  The minimum price over the simulated dates */
+    RUNNING_MINIMUM,
+    /*  The average price over the simulated dates */
+    RUNNING_AVERAGE
+};
+
+/**
+ *   Describes what a payoff needs to know about the
+ *   simulated paths, so that the simulation can compute
+ *   just that and need never store the paths.
+ */
+class PathRequirements {
+public:
+    /*  Require a statistic of the path of a stock */
+    void require(const std::string& stock, PathStatistic statistic) {
+        statistics[stock].insert(statistic);
+    }
+    /*  Require the prices of a stock on the given dates */
+    void requireDates(const std::string& stock,
+            const std::vector<double>& dates) {
+        this->dates[stock].insert(dates.begin(), dates.end());
+    }
+    /*  Require everything another payoff requires */
+    void add(const PathRequirements& other);
+    /*  The statistics required for each stock */
+    const std::map<std::string, std::set<PathStatistic> >&
+            getStatistics() const {
+        return statistics;
+    }
+    /*  The dates on which prices are required for each stock */
+    const std::map<std::string, std::set<double> >&
+            getDates() const {
+        return dates;
+    }
+    /*  Is any statistic computed from the whole path needed? */
+    bool needsEveryStep() const;
+private:
+    std::map<std::string, std::set<PathStatistic> > statistics;
+    std::map<std::string, std::set<double> > dates;
+};
+
+/**
+ *   The statistics computed by a simulation
+ *   to meet some PathRequirements
+ */
+class PathStatistics {
+public:
+    /*  A column vector containing a statistic for each path */
+    const Matrix& get(const std::string& stock,
+            PathStatistic statistic) const {
+        auto pos = statistics.find(stock);
+        ASSERT(pos != statistics.end());
+        auto stat = pos->second.find(statistic);
+        ASSERT(stat != pos->second.end());
+        return stat->second;
+    }
+    /*  The prices of a stock on the required dates, with one
+        row per path and one column per date in date order */
+    const Matrix& getValues(const std::string& stock) const {
+        auto pos = values.find(stock);
+        ASSERT(pos != values.end());
+        return pos->second;
+    }
+    /*  Store a statistic */
+    void set(const std::string& stock, PathStatistic statistic,
+            const Matrix& value) {
+        statistics[stock][statistic] = value;
+    }
+    /*  Store the prices on the required dates */
+    void setValues(const std::string& stock, const Matrix& value) {
+        values[stock] = value;
+    }
+private:
+    std::map<std::string, std::map<PathStatistic, Matrix> > statistics;
+    std::map<std::string, Matrix> values;
+};
+
+/**
+ *   Computes the statistics needed to meet some requirements
+ *   as the paths of a model are simulated on the given dates
+ */
+class StatisticsAccumulator : public PathAccumulator {
+public:
+    StatisticsAccumulator(const PathRequirements& requirements,
+        const MultiStockModel& model,
+        const std::vector<double>& dates,
+        int nPaths);
+    void observe(int step, const Matrix& prices);
+    bool needsStep(int step, int nSteps) const;
+    /*  Log prices are used unless an average is required */
+    bool usesLogPrices() const;
+    void observeLogPrices(int step, const Matrix& logPrices);
+    /*  The statistics once every step has been observed */
+    PathStatistics getStatistics() const;
+private:
+    class StockStatistics;
+    std::vector<std::shared_ptr<StockStatistics> > stocks;
+    bool everyStep;
+    /*  Were log prices observed? */
+    bool logSpace;
+    std::vector<bool> dateSteps;
+};
+
+void testPathRequirements();
+
+#endif // PATHREQUIREMENTS_H_INCLUDED
@@ -28,6 +28,14 @@ public:
     /*  Price this portfolio using one consistent set of monte carlo simulations */
     double monteCarloPrice(
         const MultiStockModel& model, const MonteCarloPricer& pricer) const;
+    /*  Start pricing this portfolio on the shared thread pool */
+    PricingHandle monteCarloPriceAsync(
+        const MultiStockModel& model, const MonteCarloPricer& pricer,
+        SPPricingControl control) const;
+    /*  Price this portfolio as monteCarloPrice does, returning
+        the price together with an estimate of its accuracy */
+    PricingResult monteCarloEvaluate(
+        const MultiStockModel& model, const MonteCarloPricer& pricer) const;
 //private:
     vector<double> quantities;
     vector< shared_ptr<ContinuousTimeOption> > securities;
@@ -84,6 +92,15 @@ public:
         return false;
     }
 
+    bool isPayoffContinuous() const {
+        for (auto& sec : securities) {
+            if (!sec->isPayoffContinuous()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
     set<string> getStocks() const {
         set<string> ret;
         for (auto& sec : securities) {
@@ -108,6 +125,22 @@ public:
         return current;
     }
 
+    SPPayoffAccumulator createAccumulator(
+            const MultiStockModel& model,
+            int nPaths,
+            const vector<double>& dates) const;
+
+    /*  The union of the monitoring dates of the securities */
+    bool getMonitoringDates(set<double>& dates) const {
+        bool discrete = true;
+        for (auto& sec : securities) {
+            if (!sec->getMonitoringDates(dates)) {
+                discrete = false;
+            }
+        }
+        return discrete;
+    }
+
     void add( double quantity, SPContinuousTimeOption o ) {
         quantities.push_back(quantity);
         securities.push_back(o);
@@ -119,10 +152,94 @@ private:
 
 };
 
+/*  Passes each time step to the accumulators of all
+    the securities in a grouping */
+class GroupingAccumulator : public PayoffAccumulator {
+public:
+    void observe(int step, const Matrix& prices) {
+        for (auto& accumulator : accumulators) {
+            accumulator->observe(step, prices);
+        }
+    }
+
+    Matrix payoff() const {
+        ASSERT(accumulators.size() > 0);
+        Matrix current = quantities[0]*accumulators[0]->payoff();
+        for (int i = 1; i < (int)accumulators.size(); i++) {
+            current += quantities[i] * accumulators[i]->payoff();
+        }
+        return current;
+    }
+
+    bool needsStep(int step, int nSteps) const {
+        for (auto& accumulator : accumulators) {
+            if (accumulator->needsStep(step, nSteps)) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    /*  Log prices can only be used if every security uses them */
+    bool usesLogPrices() const {
+        for (auto& accumulator : accumulators) {
+            if (!accumulator->usesLogPrices()) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    void observeLogPrices(int step, const Matrix& logPrices) {
+        for (auto& accumulator : accumulators) {
+            accumulator->observeLogPrices(step, logPrices);
+        }
+    }
+
+    bool storesPaths() const {
+        for (auto& accumulator : accumulators) {
+            if (accumulator->storesPaths()) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void add(double quantity, SPPayoffAccumulator accumulator) {
+        quantities.push_back(quantity);
+        accumulators.push_back(accumulator);
+    }
+private:
+    vector<SPPayoffAccumulator> accumulators;
+    vector<double> quantities;
+};
+
+SPPayoffAccumulator MaturityGrouping::createAccumulator(
+        const MultiStockModel& model,
+        int nPaths,
+        const vector<double>& dates) const {
+    shared_ptr<GroupingAccumulator> ret(new GroupingAccumulator());
+    for (int i = 0; i < (int)securities.size(); i++) {
+        ret->add(quantities[i], securities[i]->createAccumulator(
+            model, nPaths, dates));
+    }
+    return ret;
+}
+
 typedef shared_ptr<MaturityGrouping> SPMaturityGrouping;
 
 /*  Price this portfolio using one consistent set of monte carlo simulations */
 double PortfolioImpl::monteCarloPrice(
+    const MultiStockModel& model, const MonteCarloPricer& pricer) const {
+    return monteCarloEvaluate(model, pricer).price;
+}
+
+/**
+ *  Each maturity is priced on its own run. The runs share their
+ *  random numbers, so the standard error of the total is bounded
+ *  by the sum of the standard errors of each run
+ */
+PricingResult PortfolioImpl::monteCarloEvaluate(
     const MultiStockModel& model, const MonteCarloPricer& pricer) const {
     map<double, SPMaturityGrouping> maturityGroupings;
     for (int i = 0; i < (int)securities.size(); i++) {
@@ -138,14 +255,34 @@ double PortfolioImpl::monteCarloPrice(
         pairPtr->second->add(quantity, security);
     }
 
-    double ret = 0;
+    PricingResult ret;
+    double price = 0.0;
+    double standardError = 0.0;
     for (auto& pair : maturityGroupings) {
         MaturityGrouping& grouping = *pair.second;
-        ret += pricer.price( grouping, model );
+        PricingResult result = pricer.evaluate( grouping, model );
+        price += result.price;
+        standardError += result.standardError;
+        ret.nScenarios += result.nScenarios;
+        ret.elapsedSeconds += result.elapsedSeconds;
+        ret.completed = ret.completed && result.completed;
     }
+    ret.setPrice(price, standardError, pricer.confidenceLevel);
     return ret;
 }
 
+PricingHandle PortfolioImpl::monteCarloPriceAsync(
+        const MultiStockModel& model, const MonteCarloPricer& pricer,
+        SPPricingControl control) const {
+    MonteCarloPricer taskPricer = pricer;
+    taskPricer.control = control ? control : make_shared<PricingControl>();
+    PortfolioImpl portfolio = *this;
+    return PricingHandle::start(taskPricer.control,
+        [portfolio, model, taskPricer]() {
+        return portfolio.monteCarloEvaluate(model, taskPricer);
+    });
+}
+
 
 /**
  *   Create a Portfolio
@@ -246,6 +383,45 @@ void testMultiStockPortfolio() {
     ASSERT_APPROX_EQUAL(calculatedDifferently, actual, 0.3);
 }
 
+static void testMonteCarloPriceAsync() {
+    auto model = MultiStockModel::createTestModel();
+    auto p = Portfolio::newInstance();
+    auto stocks = model.getStocks();
+    for (int i = 0; i < 2; i++) {
+        SPUpAndOutOption o = make_shared<UpAndOutOption>();
+        o->setStock(stocks[i]);
+        o->setStrike(model.getStockPrice(stocks[i]));
+        o->setBarrier(2 * model.getStockPrice(stocks[i]));
+        o->setMaturity(1.0 + i);
+        p->add(1.0 + i, o);
+    }
+
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 20000;
+    pricer.nTasks = 2;
+    double expected = p->monteCarloPrice(model, pricer);
+    PricingHandle handle = p->monteCarloPriceAsync(model, pricer);
+    // changing the portfolio doesn't affect the price in progress
+    p->setQuantity(0, 100.0);
+    PricingResult result = handle.get();
+    ASSERT_APPROX_EQUAL(result.price, expected, 1e-8);
+    ASSERT(handle.isReady());
+    ASSERT(result.completed);
+    // each maturity is priced with every scenario
+    ASSERT(result.nScenarios == 2 * pricer.nScenarios);
+    ASSERT(result.standardError > 0);
+    ASSERT(result.lowerBound < result.price);
+
+    // a cancelled price stops early, and says so
+    pricer.nScenarios = 100000000;
+    PricingHandle cancelled = p->monteCarloPriceAsync(model, pricer);
+    cancelled.cancel();
+    ASSERT(cancelled.waitFor(60.0));
+    PricingResult partial = cancelled.get();
+    ASSERT(!partial.completed);
+    ASSERT(partial.nScenarios < 2 * pricer.nScenarios);
+}
+
 void testPerformanceImprovement() {
     shared_ptr<Portfolio> portfolio
         = Portfolio::newInstance();
@@ -290,5 +466,6 @@ void testPortfolio() {
     TEST( testSingleSecurity );
     TEST( testPutCallParity );
     TEST( testMultiStockPortfolio );
+    TEST( testMonteCarloPriceAsync );
     TEST(testPerformanceImprovement);
 }
@@ -27,6 +27,15 @@ public:
     /*  Price this portfolio using one consistent set of monte carlo simulations */
     virtual double monteCarloPrice(
         const MultiStockModel& model, const MonteCarloPricer& pricer) const = 0;
+    /*  Start pricing this portfolio by monteCarloPrice on the
+        shared thread pool, returning at once. The portfolio, model
+        and pricer are copied, though not the securities. The result
+        totals the scenarios of each maturity and bounds the
+        standard error by the sum of theirs. Progress is that
+        of the maturity currently being priced */
+    virtual PricingHandle monteCarloPriceAsync(
+        const MultiStockModel& model, const MonteCarloPricer& pricer,
+        SPPricingControl control = SPPricingControl()) const = 0;
     /*  Creates a Portfolio */
     static std::shared_ptr<Portfolio> newInstance();
 };
@@ -0,0 +1,143 @@
+#include "PricingHandle.h"
+
+#include "testing.h"
+
+using namespace std;
+
+void PricingControl::setDeadline(double seconds) {
+    auto duration = chrono::duration_cast<chrono::steady_clock::duration>(
+        chrono::duration<double>(seconds));
+    deadline = chrono::steady_clock::now() + duration;
+    hasDeadline = true;
+}
+
+bool PricingControl::shouldStop() const {
+    return cancelled
+        || (hasDeadline && chrono::steady_clock::now() >= deadline);
+}
+
+/**
+ *  What the copies of a handle share. The executor joins when
+ *  it is destroyed, so the calculation never outlives its state
+ */
+class PricingHandle::State {
+public:
+    ~State() {
+        control->cancel();
+        executor->join();
+    }
+    SPPricingControl control;
+    SPExecutor executor;
+    shared_future<PricingResult> result;
+};
+
+/**
+ *  Computes the result and hands it to the waiting threads
+ */
+class PricingHandleTask : public Task {
+public:
+    PricingHandleTask(function<PricingResult()> calculation) :
+        calculation(calculation) {
+    }
+
+    void execute() {
+        try {
+            promise.set_value(calculation());
+        } catch (...) {
+            promise.set_exception(current_exception());
+        }
+    }
+
+    function<PricingResult()> calculation;
+    std::promise<PricingResult> promise;
+};
+
+PricingHandle::PricingHandle(shared_ptr<State> state) :
+    state(state) {
+}
+
+PricingHandle PricingHandle::start(SPPricingControl control,
+        function<PricingResult()> calculation) {
+    shared_ptr<State> state = make_shared<State>();
+    state->control = control ? control : make_shared<PricingControl>();
+    auto task = make_shared<PricingHandleTask>(calculation);
+    state->result = task->promise.get_future().share();
+    state->executor = Executor::newPooledInstance();
+    state->executor->addTask(task);
+    return PricingHandle(state);
+}
+
+PricingResult PricingHandle::get() const {
+    // run the calculation here if no thread of the pool is free
+    state->executor->join();
+    return state->result.get();
+}
+
+bool PricingHandle::waitFor(double seconds) const {
+    return state->result.wait_for(chrono::duration<double>(seconds))
+        == future_status::ready;
+}
+
+bool PricingHandle::isReady() const {
+    return waitFor(0.0);
+}
+
+void PricingHandle::cancel() const {
+    state->control->cancel();
+}
+
+SPPricingControl PricingHandle::getControl() const {
+    return state->control;
+}
+
+//////////////////////////////
+//
+//  Tests
+//
+//////////////////////////////
+
+static void testCancelCalculation() {
+    SPPricingControl control = make_shared<PricingControl>();
+    PricingHandle handle = PricingHandle::start(control, [control]() {
+        PricingResult result;
+        while (!control->shouldStop()) {
+            result.nScenarios++;
+            this_thread::yield();
+        }
+        return result;
+    });
+    ASSERT(!handle.waitFor(0.01));
+    handle.cancel();
+    ASSERT(control->isCancelled());
+    handle.get();
+    ASSERT(handle.isReady());
+}
+
+static void testDeadline() {
+    SPPricingControl control = make_shared<PricingControl>();
+    control->setDeadline(0.02);
+    ASSERT(!control->shouldStop());
+    this_thread::sleep_for(chrono::milliseconds(30));
+    ASSERT(control->shouldStop());
+    ASSERT(!control->isCancelled());
+}
+
+static void testExceptionsRethrown() {
+    PricingHandle handle = PricingHandle::start(SPPricingControl(), []() {
+        throw runtime_error("Pricing failed");
+        return PricingResult();
+    });
+    bool thrown = false;
+    try {
+        handle.get();
+    } catch (const runtime_error&) {
+        thrown = true;
+    }
+    ASSERT(thrown);
+}
+
+void testPricingHandle() {
+    TEST(testCancelCalculation);
+    TEST(testDeadline);
+    TEST(testExceptionsRethrown);
+}
@@ -0,0 +1,100 @@
+#ifndef PRICINGHANDLE_H_INCLUDED
+#define PRICINGHANDLE_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+#include "Executor.h"
+#include "PricingResult.h"
+
+/*  How far a pricing calculation has got */
+class PricingProgress {
+public:
+    PricingProgress() :
+        nScenarios(0),
+        price(0.0),
+        standardError(0.0),
+        elapsedSeconds(0.0) {
+    }
+    /*  The number of scenarios simulated so far */
+    long long nScenarios;
+    /*  The current estimate of the price */
+    double price;
+    /*  The standard error of the current estimate */
+    double standardError;
+    /*  The wall clock time taken so far */
+    double elapsedSeconds;
+};
+
+/**
+ *   Lets other threads cancel a pricing calculation, bounds it
+ *   by a deadline and reports its progress. Pricers check it
+ *   between batches, so a calculation stops within a batch of
+ *   being cancelled and returns the price of the scenarios
+ *   simulated so far, which always include a first batch.
+ */
+class PricingControl {
+public:
+    PricingControl() :
+        cancelled(false),
+        hasDeadline(false) {
+    }
+    /*  Ask the calculation to stop */
+    void cancel() {
+        cancelled = true;
+    }
+    /*  Has the calculation been cancelled? */
+    bool isCancelled() const {
+        return cancelled;
+    }
+    /*  Stop the calculation the given number of seconds from
+        now. Call this before the calculation starts */
+    void setDeadline(double seconds);
+    /*  Has the calculation been cancelled or passed its
+        deadline? */
+    bool shouldStop() const;
+    /*  Called after each batch with the progress of the current
+        calculation, or the first option when several are priced
+        together. It is called while the pricing tasks wait,
+        so should return quickly. Set this before the
+        calculation starts */
+    std::function<void(const PricingProgress&)> onProgress;
+private:
+    std::atomic<bool> cancelled;
+    bool hasDeadline;
+    std::chrono::steady_clock::time_point deadline;
+};
+
+typedef std::shared_ptr<PricingControl> SPPricingControl;
+
+/**
+ *   A price being computed on the shared thread pool. Copies of
+ *   a handle refer to the same calculation, which is cancelled
+ *   once every copy has been destroyed.
+ */
+class PricingHandle {
+public:
+    /*  Run the calculation on the shared thread pool */
+    static PricingHandle start(SPPricingControl control,
+        std::function<PricingResult()> calculation);
+    /*  Wait for the result. Exceptions thrown by the
+        calculation are thrown here */
+    PricingResult get() const;
+    /*  Wait at most the given number of seconds, returning
+        whether the result is ready */
+    bool waitFor(double seconds) const;
+    /*  Is the result ready? */
+    bool isReady() const;
+    /*  Ask the calculation to stop early */
+    void cancel() const;
+    /*  The control of the calculation */
+    SPPricingControl getControl() const;
+private:
+    class State;
+    explicit PricingHandle(std::shared_ptr<State> state);
+    std::shared_ptr<State> state;
+};
+
+void testPricingHandle();
+
+#endif // PRICINGHANDLE_H_INCLUDED
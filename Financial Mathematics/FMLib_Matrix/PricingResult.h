@@ -0,0 +1,76 @@
+#ifndef PRICINGRESULT_H_INCLUDED
+#define PRICINGRESULT_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+#include "matlib.h"
+
+/**
+ *   The price computed by a simulation together with
+ *   an estimate of its accuracy
+ */
+class PricingResult {
+public:
+    PricingResult() :
+        price(0.0),
+        standardError(0.0),
+        confidenceLevel(0.95),
+        lowerBound(0.0),
+        upperBound(0.0),
+        nScenarios(0),
+        batchSize(0),
+        rho(0.0),
+        elapsedSeconds(0.0),
+        completed(true) {
+    }
+    /*  The estimated price */
+    double price;
+    /*  The standard error of the estimate */
+    double standardError;
+    /*  The confidence level of the interval */
+    double confidenceLevel;
+    /*  The lower end of the confidence interval */
+    double lowerBound;
+    /*  The upper end of the confidence interval */
+    double upperBound;
+    /*  The number of scenarios simulated */
+    long long nScenarios;
+    /*  The number of scenarios simulated together */
+    int batchSize;
+    /*  The derivative of the price with respect to the price of
+        each stock, if Greeks were computed */
+    std::map<std::string, double> deltas;
+    /*  The derivative of the price with respect to the
+        volatility of each stock, if Greeks were computed */
+    std::map<std::string, double> vegas;
+    /*  The derivative of the price with respect to the
+        risk free rate, if Greeks were computed */
+    double rho;
+    /*  The derivative of the price with respect to each entry of
+        the covariance matrix of the option's stocks, moving
+        off diagonal entries together with their transpose,
+        if adjoints were computed */
+    Matrix covarianceSensitivities;
+    /*  The wall clock time taken */
+    double elapsedSeconds;
+    /*  False if the calculation was cancelled, or stopped at a
+        deadline or time limit, before simulating every scenario
+        or reaching its target error */
+    bool completed;
+
+    /*  Set the price and standard error, computing a
+        normal confidence interval at the given level */
+    void setPrice(double price, double standardError,
+            double confidenceLevel) {
+        ASSERT(confidenceLevel > 0.0 && confidenceLevel < 1.0);
+        this->price = price;
+        this->standardError = standardError;
+        this->confidenceLevel = confidenceLevel;
+        double z = norminv(0.5 + 0.5*confidenceLevel);
+        lowerBound = price - z*standardError;
+        upperBound = price + z*standardError;
+    }
+};
+
+#endif // PRICINGRESULT_H_INCLUDED
@@ -8,6 +8,11 @@ Matrix PutOption::payoffAtMaturity( const Matrix& stockAtMaturity ) const {
     return val;
 }
 
+AdjointMatrix PutOption::adjointPayoffAtMaturity(
+        const AdjointMatrix& stockAtMaturity ) const {
+    return positivePart(getStrike() - stockAtMaturity);
+}
+
 double PutOption::price(
         const MultiStockModel& msm ) const {
     BlackScholesModel bsm =
@@ -10,6 +10,12 @@ public:
     /*  Returns the payoff at maturity given a column vector
         of scenarios */
     Matrix payoffAtMaturity( const Matrix& finalStockPrice) const;
+    /*  The payoff is differentiable almost everywhere */
+    bool hasAdjointPayoff() const {
+        return true;
+    }
+    AdjointMatrix adjointPayoffAtMaturity(
+        const AdjointMatrix& stockAtMaturity) const;
 
 
     double price( const MultiStockModel& bsm )
@@ -0,0 +1,66 @@
+#ifndef SAMPLINGOPTIONS_H_INCLUDED
+#define SAMPLINGOPTIONS_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+
+/*  How the random numbers driving a simulation are drawn */
+enum SamplingMethod {
+    /*  Independent pseudo random draws */
+    PSEUDO_RANDOM,
+    /*  Stratify the terminal value of the first
+        Brownian motion */
+    STRATIFIED,
+    /*  Latin hypercube sampling of the terminal values
+        of the first few Brownian motions */
+    LATIN_HYPERCUBE
+};
+
+/**
+ *   Options controlling how the normal draws for a
+ *   simulation are sampled.
+ *
+ *   Paths are grouped into consecutive blocks of nStrata
+ *   paths. When stratifying, path i of a simulation lies in
+ *   stratum i % nStrata. For latin hypercube sampling each
+ *   block is an independent latin hypercube design.
+ *
+ *   Moment matching rescales the pseudo random normal draws
+ *   of each time step so that their sample moments are exact.
+ *   The paths are then no longer independent, so the estimate
+ *   of the price has a small bias.
+ *
+ *   A drift shift adds a constant drift to each of the
+ *   independent Brownian motions driving the simulation. The
+ *   simulation then records the likelihood ratio of each path
+ *   so that weighted payoffs remain unbiased.
+ */
+class SamplingOptions {
+public:
+    SamplingOptions() :
+        method(PSEUDO_RANDOM),
+        nStrata(100),
+        nDimensions(1),
+        momentMatching(false),
+        matchCovariance(false) {
+    }
+    /*  The sampling method */
+    SamplingMethod method;
+    /*  The number of strata */
+    int nStrata;
+    /*  The number of dimensions used in latin
+        hypercube sampling */
+    int nDimensions;
+    /*  Rescale the draws to have exact mean zero
+        and variance one */
+    bool momentMatching;
+    /*  When moment matching, also decorrelate the draws so the
+        sample covariance equals the model covariance */
+    bool matchCovariance;
+    /*  The drift added to each independent Brownian motion,
+        empty for no shift */
+    std::vector<double> driftShift;
+};
+
+#endif // SAMPLINGOPTIONS_H_INCLUDED
@@ -0,0 +1,651 @@
+#include "UnitPathCache.h"
+
+#include "matlib.h"
+#include "PathRequirements.h"
+
+using namespace std;
+
+/**
+ *  The prices or log prices of paths with unit stock prices
+ *  on each date
+ */
+class UnitPathCache::UnitPaths {
+public:
+    /*  Are the log prices stored? */
+    bool logSpace;
+    /*  The prices on each date */
+    vector<Matrix> steps;
+    /*  The likelihood ratios of the paths, if any */
+    SPCMatrix weights;
+    /*  Everything which determines the paths, kept only if
+        they may be spilled */
+    string description;
+
+    /*  The memory used by the prices */
+    long long bytes() const {
+        long long ret = 0;
+        for (auto& step : steps) {
+            ret += (long long)step.nRows()*step.nCols()*sizeof(double);
+        }
+        if (weights) {
+            ret += (long long)weights->nRows()*weights->nCols()
+                *sizeof(double);
+        }
+        return ret;
+    }
+    /*  Write the paths to a file together with their
+        description, returning false if this fails */
+    bool write(const string& file) const;
+    /*  Read paths written by write, returning null if the
+        file can't be read or describes different paths, as
+        it will if the hashes of two keys collide */
+    static shared_ptr<UnitPaths> read(const string& file,
+        const string& description);
+};
+
+static void writeMatrix(ostream& out, const Matrix& m) {
+    int nRows = m.nRows();
+    int nCols = m.nCols();
+    out.write((const char*)&nRows, sizeof(int));
+    out.write((const char*)&nCols, sizeof(int));
+    out.write((const char*)m.begin(), sizeof(double)*nRows*nCols);
+}
+
+/*  Read a matrix written by writeMatrix, returning
+    false if the stream fails */
+static bool readMatrix(istream& in, Matrix& m) {
+    int nRows = -1;
+    int nCols = -1;
+    in.read((char*)&nRows, sizeof(int));
+    in.read((char*)&nCols, sizeof(int));
+    if (!in || nRows < 1 || nCols < 1) {
+        return false;
+    }
+    m = Matrix(nRows, nCols, false);
+    in.read((char*)m.begin(), sizeof(double)*nRows*nCols);
+    return (bool)in;
+}
+
+bool UnitPathCache::UnitPaths::write(const string& file) const {
+    ofstream out(file, ios::binary);
+    if (!out) {
+        return false;
+    }
+    int length = description.size();
+    int nSteps = steps.size();
+    char flags[2] = { logSpace, weights != 0 };
+    out.write((const char*)&length, sizeof(int));
+    out.write(description.data(), length);
+    out.write(flags, 2);
+    out.write((const char*)&nSteps, sizeof(int));
+    for (auto& step : steps) {
+        writeMatrix(out, step);
+    }
+    if (weights) {
+        writeMatrix(out, *weights);
+    }
+    out.close();
+    return !out.fail();
+}
+
+shared_ptr<UnitPathCache::UnitPaths> UnitPathCache::UnitPaths::read(
+        const string& file, const string& description) {
+    ifstream in(file, ios::binary);
+    int length = -1;
+    in.read((char*)&length, sizeof(int));
+    if (!in || length != (int)description.size()) {
+        return shared_ptr<UnitPaths>();
+    }
+    string fileDescription(length, ' ');
+    in.read(&fileDescription[0], length);
+    char flags[2];
+    int nSteps = -1;
+    in.read(flags, 2);
+    in.read((char*)&nSteps, sizeof(int));
+    if (!in || fileDescription != description || nSteps < 1) {
+        return shared_ptr<UnitPaths>();
+    }
+    shared_ptr<UnitPaths> ret = make_shared<UnitPaths>();
+    ret->logSpace = flags[0] != 0;
+    ret->description = description;
+    ret->steps.resize(nSteps);
+    for (int step = 0; step < nSteps; step++) {
+        if (!readMatrix(in, ret->steps[step])) {
+            return shared_ptr<UnitPaths>();
+        }
+    }
+    if (flags[1]) {
+        shared_ptr<Matrix> weights = make_shared<Matrix>();
+        if (!readMatrix(in, *weights)) {
+            return shared_ptr<UnitPaths>();
+        }
+        ret->weights = weights;
+    }
+    return ret;
+}
+
+/**
+ *  Records the steps of a simulation that an accumulator
+ *  needs, as log prices if it uses them
+ */
+class UnitPathRecorder : public PathAccumulator {
+public:
+    UnitPathRecorder(const PathAccumulator& accumulator,
+            vector<Matrix>& steps) :
+        accumulator(accumulator),
+        steps(steps) {
+    }
+    void observe(int step, const Matrix& prices) {
+        steps.push_back(prices);
+    }
+    bool needsStep(int step, int nSteps) const {
+        return accumulator.needsStep(step, nSteps);
+    }
+    bool usesLogPrices() const {
+        return accumulator.usesLogPrices();
+    }
+    void observeLogPrices(int step, const Matrix& logPrices) {
+        steps.push_back(logPrices);
+    }
+private:
+    const PathAccumulator& accumulator;
+    vector<Matrix>& steps;
+};
+
+mt19937 batchStream(int chunk, int batch) {
+    seed_seq seed({ (unsigned)chunk, (unsigned)batch });
+    return mt19937(seed);
+}
+
+bool UnitPathCache::PathKey::operator==(const PathKey& other) const {
+    return model == other.model && simulation == other.simulation
+        && riskFreeRate == other.riskFreeRate && date == other.date
+        && nPaths == other.nPaths && chunk == other.chunk
+        && batch == other.batch;
+}
+
+size_t UnitPathCache::PathKeyHash::operator()(const PathKey& key) const {
+    unsigned long long hash = hashBytes(&key.model, sizeof(key.model),
+        key.simulation);
+    hash = hashBytes(&key.riskFreeRate, sizeof(double), hash);
+    hash = hashBytes(&key.date, sizeof(double), hash);
+    int counts[3] = { key.nPaths, key.chunk, key.batch };
+    return (size_t)hashBytes(counts, sizeof(counts), hash);
+}
+
+/**
+ *  Identify everything but the stock prices which determines
+ *  the paths. The model hashes its covariances once for each
+ *  set of parameters, so this costs little more than hashing
+ *  the dates
+ */
+UnitPathCache::PathKey UnitPathCache::pathKey(
+        const MultiStockModel& model,
+        const vector<double>& dates,
+        int nPaths,
+        const SamplingOptions& sampling,
+        int chunk,
+        int batch,
+        bool logSpace,
+        const vector<bool>& neededSteps) {
+    PathKey key;
+    key.model = model.getCovarianceHash();
+    key.riskFreeRate = model.getRiskFreeRate();
+    key.date = model.getDate();
+    key.nPaths = nPaths;
+    key.chunk = chunk;
+    key.batch = batch;
+    int settings[6] = { sampling.method, sampling.nStrata,
+        sampling.nDimensions, sampling.momentMatching,
+        sampling.matchCovariance, logSpace };
+    unsigned long long hash = hashBytes(settings, sizeof(settings));
+    hash = hashBytes(dates.data(), dates.size()*sizeof(double), hash);
+    hash = hashBytes(sampling.driftShift.data(),
+        sampling.driftShift.size()*sizeof(double), hash);
+    for (bool needed : neededSteps) {
+        hash = hashBytes(&needed, sizeof(bool), hash);
+    }
+    // separate the lists of dates and shifts
+    int sizes[2] = { (int)dates.size(), (int)sampling.driftShift.size() };
+    key.simulation = hashBytes(sizes, sizeof(sizes), hash);
+    return key;
+}
+
+/**
+ *  Describe everything but the stock prices which determines
+ *  the paths. This is only needed by spilled paths, so is
+ *  written in binary and only when there is a spill directory
+ */
+static string describePaths(const MultiStockModel& model,
+        const vector<double>& dates,
+        int nPaths,
+        const SamplingOptions& sampling,
+        int chunk,
+        int batch,
+        bool logSpace,
+        const vector<bool>& neededSteps) {
+    string out;
+    auto append = [&out](const void* data, size_t nBytes) {
+        out.append((const char*)data, nBytes);
+    };
+    auto appendMatrix = [&append](const Matrix& m) {
+        int size[2] = { m.nRows(), m.nCols() };
+        append(size, sizeof(size));
+        append(m.begin(), (m.end() - m.begin())*sizeof(double));
+    };
+    for (auto& stock : model.getStocks()) {
+        append(stock.c_str(), stock.size() + 1);
+    }
+    if (model.isFactorModel()) {
+        appendMatrix(model.getFactorLoadings());
+        appendMatrix(model.getSpecificVariances());
+    } else {
+        appendMatrix(model.getCovarianceMatrix());
+    }
+    double times[2] = { model.getRiskFreeRate(), model.getDate() };
+    append(times, sizeof(times));
+    int nDates = dates.size();
+    append(&nDates, sizeof(int));
+    append(dates.data(), nDates*sizeof(double));
+    int settings[9] = { nPaths, sampling.method, sampling.nStrata,
+        sampling.nDimensions, sampling.momentMatching,
+        sampling.matchCovariance, chunk, batch, logSpace };
+    append(settings, sizeof(settings));
+    int nShifts = sampling.driftShift.size();
+    append(&nShifts, sizeof(int));
+    append(sampling.driftShift.data(), nShifts*sizeof(double));
+    for (bool needed : neededSteps) {
+        append(&needed, sizeof(bool));
+    }
+    return out;
+}
+
+/*  Distinguishes the caches created by this process */
+static atomic<int> nCachesCreated(0);
+
+UnitPathCache::UnitPathCache(long long maxBytes,
+        const string& spillDirectory) :
+    maxBytes(maxBytes),
+    spillDirectory(spillDirectory),
+    nFilesWritten(0) {
+    // other caches, in this process or others, may
+    // spill to the same directory
+    random_device device;
+    filePrefix = "unitpaths_" + to_string(device()) + "_"
+        + to_string(chrono::system_clock::now().time_since_epoch().count())
+        + "_" + to_string(nCachesCreated++) + "_";
+}
+
+UnitPathCache::~UnitPathCache() {
+    clear();
+}
+
+UnitPathCache::SPCUnitPaths UnitPathCache::find(const PathKey& key,
+        const string& description) {
+    auto pos = entries.find(key);
+    if (pos != entries.end()) {
+        order.splice(order.begin(), order, pos->second.position);
+        statistics.hits++;
+        return pos->second.paths;
+    }
+    auto file = spilled.find(key);
+    if (file == spilled.end()) {
+        statistics.misses++;
+        return SPCUnitPaths();
+    }
+    SPCUnitPaths paths = UnitPaths::read(file->second, description);
+    std::remove(file->second.c_str());
+    spilled.erase(file);
+    if (!paths) {
+        statistics.misses++;
+        return paths;
+    }
+    statistics.hits++;
+    statistics.diskReads++;
+    return insert(key, paths);
+}
+
+UnitPathCache::SPCUnitPaths UnitPathCache::insert(const PathKey& key,
+        SPCUnitPaths paths) {
+    auto pos = entries.find(key);
+    if (pos != entries.end()) {
+        // another thread stored the same paths first
+        return pos->second.paths;
+    }
+    if (paths->bytes() > maxBytes) {
+        // storing them would only evict everything, themselves
+        // included
+        statistics.uncached++;
+        return paths;
+    }
+    order.push_front(key);
+    Entry& entry = entries[key];
+    entry.paths = paths;
+    entry.position = order.begin();
+    statistics.bytes += paths->bytes();
+    while (statistics.bytes > maxBytes && !order.empty()) {
+        PathKey evicted = order.back();
+        order.pop_back();
+        auto victim = entries.find(evicted);
+        if (!spillDirectory.empty()) {
+            string file = spillDirectory + "/" + filePrefix
+                + to_string(nFilesWritten++) + ".bin";
+            if (victim->second.paths->write(file)) {
+                spilled[evicted] = file;
+            } else {
+                // the paths are simply dropped
+                std::remove(file.c_str());
+                statistics.failedSpills++;
+            }
+        }
+        statistics.bytes -= victim->second.paths->bytes();
+        statistics.evictions++;
+        entries.erase(victim);
+    }
+    return paths;
+}
+
+SPCMatrix UnitPathCache::simulate(const MultiStockModel& model,
+        const vector<double>& dates,
+        int nPaths,
+        const SamplingOptions& sampling,
+        int chunk,
+        int batch,
+        PathAccumulator& accumulator) {
+    bool logSpace = accumulator.usesLogPrices();
+    int nStocks = model.getStocks().size();
+    int nSteps = dates.size();
+    vector<bool> neededSteps(nSteps);
+    long long bytes = sampling.driftShift.empty() ? 0
+        : (long long)nPaths*sizeof(double);
+    for (int step = 0; step < nSteps; step++) {
+        neededSteps[step] = accumulator.needsStep(step, nSteps);
+        if (neededSteps[step]) {
+            bytes += (long long)nPaths*nStocks*sizeof(double);
+        }
+    }
+    if (bytes > maxBytes) {
+        // stream the paths rather than store them
+        {
+            lock_guard<mutex> lock(mtx);
+            statistics.uncached++;
+        }
+        mt19937 rng = batchStream(chunk, batch);
+        return model.simulateRiskNeutralPricePaths(rng, dates, nPaths,
+            sampling, accumulator);
+    }
+    PathKey key = pathKey(model, dates, nPaths, sampling, chunk, batch,
+        logSpace, neededSteps);
+    string description;
+    if (!spillDirectory.empty()) {
+        description = describePaths(model, dates, nPaths, sampling,
+            chunk, batch, logSpace, neededSteps);
+    }
+    SPCUnitPaths paths;
+    {
+        lock_guard<mutex> lock(mtx);
+        paths = find(key, description);
+    }
+    if (!paths) {
+        MultiStockModel unitModel = model;
+        for (auto& stock : model.getStocks()) {
+            unitModel.setStockPrice(stock, 1.0);
+        }
+        shared_ptr<UnitPaths> newPaths = make_shared<UnitPaths>();
+        newPaths->logSpace = logSpace;
+        newPaths->description = description;
+        UnitPathRecorder recorder(accumulator, newPaths->steps);
+        mt19937 rng = batchStream(chunk, batch);
+        newPaths->weights = unitModel.simulateRiskNeutralPricePaths(
+            rng, dates, nPaths, sampling, recorder);
+        lock_guard<mutex> lock(mtx);
+        paths = insert(key, newPaths);
+    }
+
+    vector<string> stocks = model.getStocks();
+    Matrix prices(nPaths, nStocks, false);
+    int recorded = 0;
+    for (int step = 0; step < nSteps; step++) {
+        if (!neededSteps[step]) {
+            continue;
+        }
+        const Matrix& unit = paths->steps[recorded++];
+        for (int j = 0; j < nStocks; j++) {
+            double s0 = model.getStockPrice(stocks[j]);
+            const double* u = unit.begin() + unit.offset(0, j);
+            double* s = prices.begin() + prices.offset(0, j);
+            if (logSpace) {
+                double logS0 = log(s0);
+                for (int p = 0; p < nPaths; p++) {
+                    s[p] = u[p] + logS0;
+                }
+            } else {
+                for (int p = 0; p < nPaths; p++) {
+                    s[p] = u[p] * s0;
+                }
+            }
+        }
+        if (logSpace) {
+            accumulator.observeLogPrices(step, prices);
+        } else {
+            accumulator.observe(step, prices);
+        }
+    }
+    return paths->weights;
+}
+
+int UnitPathCache::size() const {
+    lock_guard<mutex> lock(mtx);
+    return entries.size();
+}
+
+UnitPathCacheStatistics UnitPathCache::getStatistics() const {
+    lock_guard<mutex> lock(mtx);
+    UnitPathCacheStatistics ret = statistics;
+    ret.entries = entries.size();
+    return ret;
+}
+
+void UnitPathCache::clear() {
+    lock_guard<mutex> lock(mtx);
+    entries.clear();
+    order.clear();
+    for (auto& file : spilled) {
+        std::remove(file.second.c_str());
+    }
+    spilled.clear();
+    statistics.bytes = 0;
+}
+
+//////////////////////////////////////
+//
+//   Tests
+//
+//////////////////////////////////////
+
+static void testRescaledPaths() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    vector<double> dates({ 0.5, 1.0 });
+    UnitPathCache cache;
+
+    // the paths are the unit paths times the stock prices
+    vector<string> stocks = msm.getStocks();
+    PathRecorder first(stocks, 10, 2);
+    cache.simulate(msm, dates, 10, SamplingOptions(), 3, 1, first);
+    ASSERT(cache.size() == 1);
+    MultiStockModel moved = msm;
+    moved.setStockPrice(stocks[1], 2 * msm.getStockPrice(stocks[1]));
+    PathRecorder second(stocks, 10, 2);
+    cache.simulate(moved, dates, 10, SamplingOptions(), 3, 1, second);
+    ASSERT(cache.size() == 1);
+    MarketSimulation a = first.getSimulation();
+    MarketSimulation b = second.getSimulation();
+    Matrix(a.getStockPrices(0)).assertEquals(b.getStockPrices(0), 1e-10);
+    (2.0*a.getStockPrices(1)).assertEquals(b.getStockPrices(1), 1e-8);
+
+    // and equal to a simulation from the same stream
+    PathRecorder direct(stocks, 10, 2);
+    mt19937 rng = batchStream(3, 1);
+    msm.simulateRiskNeutralPricePaths(rng, dates, 10, SamplingOptions(),
+        direct);
+    Matrix(a.getStockPrices(2)).assertEquals(
+        direct.getSimulation().getStockPrices(2), 1e-8);
+
+    // changing anything else draws new paths
+    moved.setRiskFreeRate(0.1);
+    PathRecorder third(stocks, 10, 2);
+    cache.simulate(moved, dates, 10, SamplingOptions(), 3, 1, third);
+    ASSERT(cache.size() == 2);
+    cache.clear();
+    ASSERT(cache.size() == 0);
+}
+
+/*  A directory for temporary files */
+static string temporaryDirectory() {
+    for (const char* variable : { "TMPDIR", "TEMP", "TMP" }) {
+        const char* directory = getenv(variable);
+        if (directory && *directory) {
+            return directory;
+        }
+    }
+    return "/tmp";
+}
+
+static void testEviction() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    vector<double> dates({ 0.5, 1.0 });
+    vector<string> stocks = msm.getStocks();
+    // room for two sets of 100 paths of 3 stocks on 2 dates
+    long long pathBytes = 100 * 3 * 2 * sizeof(double);
+    for (string spillDirectory : { string(""), temporaryDirectory() }) {
+        UnitPathCache cache(2 * pathBytes, spillDirectory);
+        vector<Matrix> first;
+        for (int batch = 0; batch < 3; batch++) {
+            PathRecorder recorder(stocks, 100, 2);
+            cache.simulate(msm, dates, 100, SamplingOptions(), 0, batch,
+                recorder);
+            first.push_back(recorder.getSimulation().getStockPrices(0));
+        }
+        UnitPathCacheStatistics statistics = cache.getStatistics();
+        ASSERT(statistics.misses == 3);
+        ASSERT(statistics.hits == 0);
+        ASSERT(statistics.evictions == 1);
+        ASSERT(statistics.entries == 2);
+        ASSERT(statistics.bytes == 2 * pathBytes);
+
+        // the most recently used batch is still in memory, and
+        // the first is read back from disk if it was spilled
+        for (int batch : { 2, 0 }) {
+            PathRecorder recorder(stocks, 100, 2);
+            cache.simulate(msm, dates, 100, SamplingOptions(), 0, batch,
+                recorder);
+            first[batch].assertEquals(
+                recorder.getSimulation().getStockPrices(0), 1e-12);
+        }
+        statistics = cache.getStatistics();
+        ASSERT(statistics.hits == (spillDirectory.empty() ? 1 : 2));
+        ASSERT(statistics.diskReads == (spillDirectory.empty() ? 0 : 1));
+        ASSERT(statistics.evictions == 2);
+    }
+}
+
+static void testSharedSpillDirectory() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    vector<double> dates({ 0.5, 1.0 });
+    vector<string> stocks = msm.getStocks();
+    long long pathBytes = 100 * 3 * 2 * sizeof(double);
+    // two caches which spill different paths to one directory
+    UnitPathCache a(pathBytes, temporaryDirectory());
+    UnitPathCache b(pathBytes, temporaryDirectory());
+    vector<Matrix> expected;
+    for (int batch = 0; batch < 2; batch++) {
+        for (UnitPathCache* cache : { &a, &b }) {
+            int chunk = cache == &a ? 0 : 1;
+            PathRecorder recorder(stocks, 100, 2);
+            cache->simulate(msm, dates, 100, SamplingOptions(), chunk,
+                batch, recorder);
+            if (batch == 0) {
+                expected.push_back(
+                    recorder.getSimulation().getStockPrices(0));
+            }
+        }
+    }
+    // each reads back its own paths
+    for (UnitPathCache* cache : { &a, &b }) {
+        int chunk = cache == &a ? 0 : 1;
+        PathRecorder recorder(stocks, 100, 2);
+        cache->simulate(msm, dates, 100, SamplingOptions(), chunk, 0,
+            recorder);
+        expected[chunk].assertEquals(
+            recorder.getSimulation().getStockPrices(0), 1e-12);
+        ASSERT(cache->getStatistics().diskReads == 1);
+    }
+}
+
+static void testFailedSpill() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    vector<double> dates({ 0.5, 1.0 });
+    vector<string> stocks = msm.getStocks();
+    long long pathBytes = 100 * 3 * 2 * sizeof(double);
+    UnitPathCache cache(pathBytes,
+        temporaryDirectory() + "/no/such/directory");
+    vector<Matrix> first;
+    for (int batch : { 0, 1, 0 }) {
+        PathRecorder recorder(stocks, 100, 2);
+        cache.simulate(msm, dates, 100, SamplingOptions(), 0, batch,
+            recorder);
+        first.push_back(recorder.getSimulation().getStockPrices(0));
+    }
+    // the evicted paths were dropped and simulated again
+    first[0].assertEquals(first[2], 1e-12);
+    UnitPathCacheStatistics statistics = cache.getStatistics();
+    ASSERT(statistics.misses == 3);
+    ASSERT(statistics.diskReads == 0);
+    ASSERT(statistics.failedSpills == 2);
+    ASSERT(statistics.entries == 1);
+}
+
+static void testOnlyNeededStepsStored() {
+    MultiStockModel msm = MultiStockModel::createTestModel();
+    vector<double> dates;
+    for (int i = 1; i <= 100; i++) {
+        dates.push_back(i / 100.0);
+    }
+    // the terminal value needs only the last of the 100 steps
+    PathRequirements requirements;
+    requirements.require("Acme", TERMINAL_VALUE);
+    UnitPathCache cache;
+    StatisticsAccumulator first(requirements, msm, dates, 50);
+    cache.simulate(msm, dates, 50, SamplingOptions(), 0, 0, first);
+    ASSERT(cache.getStatistics().bytes == 50 * 3 * sizeof(double));
+    StatisticsAccumulator second(requirements, msm, dates, 50);
+    cache.simulate(msm, dates, 50, SamplingOptions(), 0, 0, second);
+    ASSERT(cache.getStatistics().hits == 1);
+    Matrix terminal = first.getStatistics().get("Acme", TERMINAL_VALUE);
+    terminal.assertEquals(
+        second.getStatistics().get("Acme", TERMINAL_VALUE), 1e-10);
+
+    // paths bigger than the whole budget are streamed instead
+    UnitPathCache small(50 * 3 * sizeof(double));
+    vector<string> stocks = msm.getStocks();
+    PathRecorder recorder(stocks, 50, 100);
+    small.simulate(msm, dates, 50, SamplingOptions(), 0, 0, recorder);
+    UnitPathCacheStatistics statistics = small.getStatistics();
+    ASSERT(statistics.uncached == 1);
+    ASSERT(statistics.entries == 0);
+    ASSERT(statistics.evictions == 0);
+    PathRecorder direct(stocks, 50, 100);
+    mt19937 rng = batchStream(0, 0);
+    msm.simulateRiskNeutralPricePaths(rng, dates, 50, SamplingOptions(),
+        direct);
+    Matrix(recorder.getSimulation().getStockPrices(0)).assertEquals(
+        direct.getSimulation().getStockPrices(0), 1e-12);
+}
+
+void testUnitPathCache() {
+    TEST(testRescaledPaths);
+    TEST(testOnlyNeededStepsStored);
+    TEST(testEviction);
+    TEST(testSharedSpillDirectory);
+    TEST(testFailedSpill);
+}
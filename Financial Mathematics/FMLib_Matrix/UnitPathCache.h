@@ -0,0 +1,160 @@
+#ifndef UNITPATHCACHE_H_INCLUDED
+#define UNITPATHCACHE_H_INCLUDED
+
+#pragma once
+
+#include "stdafx.h"
+#include "Matrix.h"
+#include "MultiStockModel.h"
+#include "PathAccumulator.h"
+#include "SamplingOptions.h"
+
+/*  Counters describing how a UnitPathCache has been used */
+class UnitPathCacheStatistics {
+public:
+    UnitPathCacheStatistics() :
+        hits(0),
+        misses(0),
+        diskReads(0),
+        evictions(0),
+        failedSpills(0),
+        uncached(0),
+        entries(0),
+        bytes(0) {
+    }
+    /*  Lookups that found paths, in memory or on disk */
+    long long hits;
+    /*  Lookups that had to simulate */
+    long long misses;
+    /*  Hits that read spilled paths back from disk */
+    long long diskReads;
+    /*  Entries evicted from memory */
+    long long evictions;
+    /*  Evicted entries which couldn't be written to disk */
+    long long failedSpills;
+    /*  Lookups whose paths alone would exceed the budget, so
+        were simulated without being stored */
+    long long uncached;
+    /*  The number of entries in memory */
+    int entries;
+    /*  The memory used by those entries */
+    long long bytes;
+};
+
+/**
+ *   Stores simulated paths of models whose stock prices are all
+ *   one. In the Q measure the paths of a model are its stock
+ *   prices times the paths of the same model with unit prices,
+ *   so when only the stock prices change, paths drawn before can
+ *   be rescaled rather than simulated again. Passing them to an
+ *   accumulator then needs no random numbers and no
+ *   exponentials.
+ *
+ *   Paths are identified by everything except the stock prices
+ *   that determines them: the stocks, the covariances, the risk
+ *   free rate and date, the dates simulated, the sampling and
+ *   the stream of random numbers. Only the steps the accumulator
+ *   needs are stored, so an option which looks at few dates of
+ *   a fine grid costs little memory.
+ *
+ *   The least recently used paths are evicted once the paths
+ *   held in memory exceed a budget. Paths which alone would
+ *   exceed it are passed straight to the accumulator as they
+ *   are simulated and not stored. If a spill directory is
+ *   given, evicted paths are written there and read back when
+ *   next needed. If they can't be written or read, they are
+ *   simply simulated again. The cache may be used from many
+ *   threads.
+ */
+class UnitPathCache {
+public:
+    /*  Create a cache holding at most maxBytes of paths in
+        memory, spilling to the given directory if it isn't
+        empty */
+    explicit UnitPathCache(long long maxBytes = 256LL * 1024 * 1024,
+        const std::string& spillDirectory = "");
+    /*  Deletes any spilled files */
+    ~UnitPathCache();
+    /*  Pass paths of the model on the given dates to the
+        accumulator, drawing them from the stream of random
+        numbers for the given chunk and batch unless they have
+        been drawn before. Returns the likelihood ratios of the
+        paths if they were importance sampled */
+    SPCMatrix simulate(const MultiStockModel& model,
+        const std::vector<double>& dates,
+        int nPaths,
+        const SamplingOptions& sampling,
+        int chunk,
+        int batch,
+        PathAccumulator& accumulator);
+    /*  The number of sets of paths stored in memory */
+    int size() const;
+    /*  The counters */
+    UnitPathCacheStatistics getStatistics() const;
+    /*  Forget every path, including spilled paths */
+    void clear();
+private:
+    class UnitPaths;
+    typedef std::shared_ptr<const UnitPaths> SPCUnitPaths;
+    /*  Identifies a set of paths in memory. The covariances are
+        given by the hash of the model, and the dates, sampling
+        and steps recorded by a hash of their own. Spilled files
+        hold a full description of the paths instead, so a
+        collision of the hashes can't read the wrong file */
+    struct PathKey {
+        unsigned long long model;
+        unsigned long long simulation;
+        double riskFreeRate;
+        double date;
+        int nPaths;
+        int chunk;
+        int batch;
+        bool operator==(const PathKey& other) const;
+    };
+    struct PathKeyHash {
+        size_t operator()(const PathKey& key) const;
+    };
+    /*  The paths in memory and their position in the order
+        of use, most recently used first */
+    struct Entry {
+        SPCUnitPaths paths;
+        std::list<PathKey>::iterator position;
+    };
+    mutable std::mutex mtx;
+    long long maxBytes;
+    std::string spillDirectory;
+    std::unordered_map<PathKey, Entry, PathKeyHash> entries;
+    std::list<PathKey> order;
+    /*  The files holding spilled paths */
+    std::unordered_map<PathKey, std::string, PathKeyHash> spilled;
+    /*  Makes the names of the spilled files unique */
+    std::string filePrefix;
+    int nFilesWritten;
+    UnitPathCacheStatistics statistics;
+    /*  Find paths, reading them back if they were spilled
+        and the description matches. Must be called with the
+        mutex held */
+    SPCUnitPaths find(const PathKey& key,
+        const std::string& description);
+    /*  Store paths, evicting others to stay within the budget.
+        Must be called with the mutex held */
+    SPCUnitPaths insert(const PathKey& key, SPCUnitPaths paths);
+    /*  The key of the paths of a simulation */
+    static PathKey pathKey(const MultiStockModel& model,
+        const std::vector<double>& dates,
+        int nPaths,
+        const SamplingOptions& sampling,
+        int chunk,
+        int batch,
+        bool logSpace,
+        const std::vector<bool>& neededSteps);
+};
+
+typedef std::shared_ptr<UnitPathCache> SPUnitPathCache;
+
+/*  The stream of random numbers for a batch of a chunk */
+std::mt19937 batchStream(int chunk, int batch);
+
+void testUnitPathCache();
+
+#endif // UNITPATHCACHE_H_INCLUDED
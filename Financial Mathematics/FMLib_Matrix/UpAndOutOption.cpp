@@ -16,6 +16,31 @@ Matrix UpAndOutOption::payoff(
     return p;
 }
 
+bool UpAndOutOption::getPathRequirements(
+        PathRequirements& requirements) const {
+    requirements.require(getStock(), TERMINAL_VALUE);
+    if (getMonitoringDates().empty()) {
+        requirements.require(getStock(), RUNNING_MAXIMUM);
+    } else {
+        requirements.requireDates(getStock(),
+            getMonitoringDatesToMaturity());
+    }
+    return true;
+}
+
+Matrix UpAndOutOption::payoffFromStatistics(
+        const PathStatistics& statistics) const {
+    Matrix max = getMonitoringDates().empty()
+        ? statistics.get(getStock(), RUNNING_MAXIMUM)
+        : maxOverRows(statistics.getValues(getStock()));
+    Matrix didntHit = max < getBarrier();
+    Matrix p = statistics.get(getStock(), TERMINAL_VALUE);
+    p -= getStrike();
+    p.positivePart();
+    p.times(didntHit);
+    return p;
+}
+
 /////////////////////////////////////
 //
 //   TESTS
@@ -58,7 +83,63 @@ static void testPerformance() {
 }
 
 
+static void testTimeGrid() {
+    UpAndOutOption o;
+    o.setMaturity(1.0);
+    vector<double> grid = o.getTimeGrid(0.0, 4);
+    ASSERT(grid.size() == 4);
+    ASSERT_APPROX_EQUAL(grid[0], 0.25, 1e-12);
+    ASSERT(grid[3] == 1.0);
+
+    o.setMonitoringDates(vector<double>({ 0.5, 0.1, 0.5, -1.0 }));
+    grid = o.getTimeGrid(0.0, 365);
+    ASSERT(grid.size() == 3);
+    ASSERT(grid[0] == 0.1);
+    ASSERT(grid[1] == 0.5);
+    ASSERT(grid[2] == 1.0);
+
+    // a maturity within the tolerance of the start is still simulated
+    o.setMaturity(1e-10);
+    grid = o.getTimeGrid(0.0, 365);
+    ASSERT(grid.size() == 1);
+    ASSERT(grid[0] == 1e-10);
+}
+
+static void testDiscreteMonitoring() {
+    BlackScholesModel model;
+    model.stockPrice = 100;
+    model.volatility = 0.2;
+    model.riskFreeRate = 0.05;
+
+    UpAndOutOption continuous;
+    continuous.setBarrier(120);
+    continuous.setStrike(100);
+    continuous.setMaturity(1.0);
+    UpAndOutOption monthly = continuous;
+    vector<double> dates;
+    for (int i = 1; i <= 12; i++) {
+        dates.push_back(i / 12.0);
+    }
+    monthly.setMonitoringDates(dates);
+
+    // a monthly barrier only needs 12 steps, which is
+    // the same as approximating a continuous barrier
+    // with monthly steps
+    MonteCarloPricer pricer;
+    pricer.nScenarios = 10000;
+    pricer.nSteps = 365;
+    double monthlyPrice = pricer.price( monthly, model );
+    pricer.nSteps = 12;
+    double approximatePrice = pricer.price( continuous, model );
+    ASSERT_APPROX_EQUAL( monthlyPrice, approximatePrice, 1e-8 );
+    // a continuous barrier is hit more often
+    pricer.nSteps = 365;
+    ASSERT( pricer.price( continuous, model ) < monthlyPrice );
+}
+
 void testUpAndOutOption() {
     TEST( testPayoff );
+    TEST( testTimeGrid );
+    TEST( testDiscreteMonitoring );
     TEST( testPerformance );
 }
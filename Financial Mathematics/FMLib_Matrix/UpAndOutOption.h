@@ -6,6 +6,13 @@ class UpAndOutOption : public KnockoutOption {
 public:
     Matrix payoff(
         const Matrix& prices ) const;
+    using KnockoutOption::getMonitoringDates;
+    /*  Only the final and maximum prices are needed */
+    bool getPathRequirements(
+        PathRequirements& requirements) const;
+    /*  Compute the payoff from the final and maximum prices */
+    Matrix payoffFromStatistics(
+        const PathStatistics& statistics) const;
 };
 
 typedef std::shared_ptr<UpAndOutOption> SPUpAndOutOption;
@@ -17,6 +17,13 @@
 #include "ThreadingExamples.h"
 #include "MargrabeOption.h"
 #include "RectangleRulePricer.h"
+#include "MultilevelPricer.h"
+#include "PathAccumulator.h"
+#include "PathRequirements.h"
+#include "GreeksAccumulator.h"
+#include "AdjointMatrix.h"
+#include "UnitPathCache.h"
+#include "PricingHandle.h"
 
 using namespace std;
 
@@ -24,6 +31,10 @@ int main() {
 
     testMatrix();
     testMatlib();
+    testAdjointMatrix();
+    testPathAccumulator();
+    testPathRequirements();
+    testUnitPathCache();
     testMultiStockModel();
     testBlackScholesModel();
     testGeometry();
@@ -33,15 +44,18 @@ int main() {
     testLineChart();
     testTextFunctions();
     testHistogram();
+    testGreeksAccumulator();
     testMonteCarloPricer();
     testDownAndOutOption();
     testContinuousTimeOptionBase();
     testPortfolio();
     testPutOption();
     testExecutor();
+    testPricingHandle();
     testThreadingExamples();
     testUpAndOutOption();
     testMargrabeOption();
     testRectangleRulePricer();
+    testMultilevelPricer();
     return 0;
 }
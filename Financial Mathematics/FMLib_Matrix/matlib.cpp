@@ -214,7 +214,7 @@ Matrix randuniform(mt19937& random, int rows, int cols) {
     Matrix ret(rows, cols, 0);
     for (int i = 0; i<rows; i++) {
         for (int j = 0; j<cols; j++) {
-            ret(i, j) = (random() + 0.5) / (random.max() + 1.0);
+            ret(i, j) = randuniform(random);
         }
     }
     return ret;
@@ -544,6 +544,202 @@ Matrix chol(const Matrix& A) {
     }
     return L;
 }
+/**
+ *  Update a Cholesky factor by a sequence of rotations, one
+ *  for each column, as in LINPACK's dchud and dchdd
+ */
+Matrix cholUpdate(const Matrix& L, const Matrix& x, bool downdate) {
+    int n = L.nRows();
+    ASSERT(n == L.nCols());
+    ASSERT(x.nRows() == n && x.nCols() == 1);
+    double sign = downdate ? -1.0 : 1.0;
+    Matrix ret = L;
+    Matrix v = x;
+    for (int k = 0; k < n; k++) {
+        double lkk = ret(k, k);
+        double rSq = lkk*lkk + sign*v(k)*v(k);
+        ASSERT(rSq > 0); /* the result must be positive definite */
+        double r = sqrt(rSq);
+        double c = r / lkk;
+        double s = v(k) / lkk;
+        ret(k, k) = r;
+        for (int i = k + 1; i < n; i++) {
+            ret(i, k) = (ret(i, k) + sign*s*v(i)) / c;
+            v(i) = c*v(i) - s*ret(i, k);
+        }
+    }
+    return ret;
+}
+
+/**
+ *  The new row of the Cholesky factor solves L*l = b,
+ *  found by forward substitution
+ */
+Matrix cholAppend(const Matrix& L, const Matrix& b, double d) {
+    int n = L.nRows();
+    ASSERT(n == L.nCols());
+    ASSERT(b.nRows() == n && b.nCols() == 1);
+    Matrix ret(n + 1, n + 1);
+    for (int j = 0; j < n; j++) {
+        for (int i = j; i < n; i++) {
+            ret(i, j) = L(i, j);
+        }
+    }
+    double s = d;
+    for (int j = 0; j < n; j++) {
+        double l = b(j);
+        for (int k = 0; k < j; k++) {
+            l -= L(j, k)*ret(n, k);
+        }
+        l /= L(j, j);
+        ret(n, j) = l;
+        s -= l*l;
+    }
+    ASSERT(s > 0); /* the result must be positive definite */
+    ret(n, n) = sqrt(s);
+    return ret;
+}
+
+/**
+ *  Diagonalise a symmetric matrix by the cyclic Jacobi method,
+ *  rotating away each off diagonal entry in turn until they
+ *  are negligible. Intended for small matrices.
+ */
+void eigSymmetric(const Matrix& m,
+        Matrix& eigenvalues,
+        Matrix& eigenvectors) {
+    int n = m.nRows();
+    ASSERT(n == m.nCols());
+    Matrix a = m;
+    Matrix v(n, n);
+    for (int i = 0; i < n; i++) {
+        v(i, i) = 1.0;
+    }
+    for (int sweep = 0; sweep < 100; sweep++) {
+        double offDiagonal = 0.0;
+        double total = 0.0;
+        for (int p = 0; p < n; p++) {
+            for (int q = 0; q < n; q++) {
+                double sq = a(p, q)*a(p, q);
+                total += sq;
+                if (p != q) {
+                    offDiagonal += sq;
+                }
+            }
+        }
+        if (offDiagonal <= 1e-30*total) {
+            break;
+        }
+        for (int p = 0; p < n; p++) {
+            for (int q = p + 1; q < n; q++) {
+                if (a(p, q) == 0.0) {
+                    continue;
+                }
+                // choose the rotation which zeroes a(p,q)
+                double theta = (a(q, q) - a(p, p)) / (2 * a(p, q));
+                double t = (theta >= 0 ? 1.0 : -1.0)
+                    / (fabs(theta) + sqrt(theta*theta + 1));
+                double c = 1 / sqrt(t*t + 1);
+                double s = t*c;
+                for (int k = 0; k < n; k++) {
+                    double akp = a(k, p);
+                    double akq = a(k, q);
+                    a(k, p) = c*akp - s*akq;
+                    a(k, q) = s*akp + c*akq;
+                }
+                for (int k = 0; k < n; k++) {
+                    double apk = a(p, k);
+                    double aqk = a(q, k);
+                    a(p, k) = c*apk - s*aqk;
+                    a(q, k) = s*apk + c*aqk;
+                }
+                for (int k = 0; k < n; k++) {
+                    double vkp = v(k, p);
+                    double vkq = v(k, q);
+                    v(k, p) = c*vkp - s*vkq;
+                    v(k, q) = s*vkp + c*vkq;
+                }
+            }
+        }
+    }
+    vector<int> order(n);
+    for (int i = 0; i < n; i++) {
+        order[i] = i;
+    }
+    sort(order.begin(), order.end(), [&a](int i, int j) {
+        return a(i, i) > a(j, j);
+    });
+    eigenvalues = Matrix(n, 1, false);
+    eigenvectors = Matrix(n, n, false);
+    for (int j = 0; j < n; j++) {
+        eigenvalues(j) = a(order[j], order[j]);
+        eigenvectors.setCol(j, v, order[j]);
+    }
+}
+
+/**
+ *  Shift and scale each column so that its sample mean is zero
+ *  and its sample variance (dividing by n) is one. If decorrelate
+ *  is set, the columns are instead transformed by the inverse of the
+ *  cholesky factor of their sample covariance so that the sample
+ *  covariance becomes the identity.
+ */
+Matrix matchMoments(const Matrix& m, bool decorrelate) {
+    int n = m.nRows();
+    int k = m.nCols();
+    Matrix ret = m;
+    if (n < 2) {
+        return ret;
+    }
+    Matrix means = meanCols(m);
+    for (int j = 0; j < k; j++) {
+        double* p = ret.begin() + ret.offset(0, j);
+        for (int i = 0; i < n; i++) {
+            p[i] -= means(j);
+        }
+    }
+    if (!decorrelate || k == 1 || n <= k) {
+        for (int j = 0; j < k; j++) {
+            double* p = ret.begin() + ret.offset(0, j);
+            double sumSq = 0.0;
+            for (int i = 0; i < n; i++) {
+                sumSq += p[i] * p[i];
+            }
+            if (sumSq > 0.0) {
+                double scale = std::sqrt(n / sumSq);
+                for (int i = 0; i < n; i++) {
+                    p[i] *= scale;
+                }
+            }
+        }
+        return ret;
+    }
+    Matrix cov = transpose(ret)*ret;
+    cov *= 1.0 / n;
+    Matrix L = chol(cov);
+    // each row x solves x = y*transpose(L), so we solve
+    // for y by forward substitution
+    for (int i = 0; i < n; i++) {
+        for (int j = 0; j < k; j++) {
+            double s = ret(i, j);
+            for (int l = 0; l < j; l++) {
+                s -= L(j, l)*ret(i, l);
+            }
+            ret(i, j) = s / L(j, j);
+        }
+    }
+    return ret;
+}
+
+unsigned long long hashBytes(const void* data, size_t nBytes,
+        unsigned long long hash) {
+    const unsigned char* bytes = (const unsigned char*)data;
+    for (size_t i = 0; i < nBytes; i++) {
+        hash ^= bytes[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
 
 
 ///////////////////////////////////////////////
@@ -758,6 +954,67 @@ static void testChol() {
     m.assertEquals( product, 0.001);
 }
 
+static void testCholUpdate() {
+    Matrix m("3,1,2;1,4,-1;2,-1,5");
+    Matrix x("0.5;-1;2");
+    Matrix updated = m + x*transpose(x);
+    Matrix L = cholUpdate(chol(m), x);
+    chol(updated).assertEquals(L, 1e-10);
+    chol(m).assertEquals(cholUpdate(L, x, true), 1e-10);
+
+    Matrix bordered("3,1,2,0.5;1,4,-1,1;2,-1,5,-1;0.5,1,-1,6");
+    Matrix b("0.5;1;-1");
+    chol(bordered).assertEquals(cholAppend(chol(m), b, 6), 1e-10);
+}
+
+static void testEigSymmetric() {
+    Matrix m("3,1,2;1,4,-1;2,-1,5");
+    Matrix values;
+    Matrix vectors;
+    eigSymmetric(m, values, vectors);
+    ASSERT(values(0) >= values(1) && values(1) >= values(2));
+    Matrix lambda(3, 3);
+    for (int i = 0; i < 3; i++) {
+        lambda(i, i) = values(i);
+    }
+    m.assertEquals(vectors*lambda*transpose(vectors), 1e-10);
+    Matrix identity("1,0,0;0,1,0;0,0,1");
+    identity.assertEquals(transpose(vectors)*vectors, 1e-10);
+}
+
+static void testMatchMoments() {
+    rng("default");
+    int n = 1000;
+    Matrix m = randn(n, 3);
+    m += 0.5;
+
+    Matrix matched = matchMoments(m);
+    Matrix means = meanCols(matched);
+    Matrix sds = stdCols(matched, true);
+    for (int j = 0; j < 3; j++) {
+        ASSERT_APPROX_EQUAL(means(j), 0.0, 1e-10);
+        ASSERT_APPROX_EQUAL(sds(j), 1.0, 1e-10);
+    }
+
+    Matrix decorrelated = matchMoments(m, true);
+    Matrix cov = transpose(decorrelated)*decorrelated;
+    cov *= 1.0 / n;
+    for (int i = 0; i < 3; i++) {
+        ASSERT_APPROX_EQUAL(meanCols(decorrelated)(i), 0.0, 1e-10);
+        for (int j = 0; j < 3; j++) {
+            ASSERT_APPROX_EQUAL(cov(i, j), i == j ? 1.0 : 0.0, 1e-10);
+        }
+    }
+}
+
+static void testHashBytes() {
+    ASSERT(hashBytes("", 0) == 14695981039346656037ULL);
+    ASSERT(hashBytes("a", 1) == 0xaf63dc4c8601ec8cULL);
+    // hashes can be continued
+    ASSERT(hashBytes("b", 1, hashBytes("a", 1)) == hashBytes("ab", 2));
+    ASSERT(hashBytes("ab", 2) != hashBytes("ba", 2));
+}
+
 
 void testMatlib() {
     TEST( testLinspace );
@@ -780,5 +1037,9 @@ void testMatlib() {
     TEST( testSortCols );
     TEST( testTranspose );
     TEST( testChol );
+    TEST( testCholUpdate );
+    TEST( testEigSymmetric );
+    TEST( testMatchMoments );
+    TEST( testHashBytes );
     TEST(testIntegral3);
 }
@@ -46,6 +46,10 @@ Matrix randuniform(std::mt19937& random,
 /*  Create normally distributed random numbers */
 Matrix randn(std::mt19937& random,
              int rows, int cols);
+/*  Create a single uniformly distributed random number */
+inline double randuniform(std::mt19937& random) {
+    return (random() + 0.5) / (random.max() + 1.0);
+}
 /*  Seeds the default random number generator */
 void rng( const std::string& setting );
 
@@ -72,6 +76,29 @@ inline Matrix dotTimes(Matrix& a, const Matrix& b) {
 Matrix transpose(const Matrix& m);
 /*  Cholesky decomposition */
 Matrix chol(const Matrix& m);
+/*  Given the Cholesky factor L of A, the Cholesky factor of
+    A + x*transpose(x), or of A - x*transpose(x) if downdate is
+    set, computed in O(n^2) */
+Matrix cholUpdate(const Matrix& L, const Matrix& x, bool downdate=0);
+/*  Given the Cholesky factor L of A, the Cholesky factor of A
+    bordered by a new last row and column, whose off diagonal
+    entries are the column vector b and diagonal entry is d */
+Matrix cholAppend(const Matrix& L, const Matrix& b, double d);
+/*  Eigenvalues and eigenvectors of a symmetric matrix. The
+    eigenvalues are returned as a column vector in decreasing
+    order, the eigenvectors as the columns of eigenvectors */
+void eigSymmetric(const Matrix& m,
+    Matrix& eigenvalues,
+    Matrix& eigenvectors);
+/*  Shift and scale the columns to have sample mean zero and
+    sample variance one, optionally also making the sample
+    covariance the identity */
+Matrix matchMoments(const Matrix& m, bool decorrelate=0);
+
+/*  The 64 bit FNV-1a hash of some bytes, continuing from the
+    given hash so that several pieces can be combined */
+unsigned long long hashBytes(const void* data, size_t nBytes,
+    unsigned long long hash = 14695981039346656037ULL);
 
 
 /**
@@ -19,6 +19,12 @@
 #include <mutex>
 #include <condition_variable>
 #include <thread>
+#include <atomic>
+#include <deque>
+#include <list>
+#include <chrono>
+#include <functional>
+#include <future>
 #include "testing.h"
 
 #endif // STDAFX_H_INCLUDED